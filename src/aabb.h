@@ -5,6 +5,8 @@
 #include "ray.h"
 #include "interval.h"
 
+#include <algorithm>
+
 /**
  * A class for using axis-aligned bounding boxes
  */
@@ -40,6 +42,8 @@ class aabb {
             x = (a[0] <= b[0]) ? interval(a[0], b[0]) : interval(b[0], a[0]);
             y = (a[1] <= b[1]) ? interval(a[1], b[1]) : interval(b[1], a[1]);
             z = (a[2] <= b[2]) ? interval(a[2], b[2]) : interval(b[2], a[2]);
+
+            pad_to_minimums();
         }
 
         /**
@@ -104,6 +108,97 @@ class aabb {
                 return y.size() > z.size() ? 1 : 2;
         }
         
+        /**
+         * Returns the surface area of the bounding box
+         * @return surface area, or 0 if the box is empty
+         */
+        double surface_area() const {
+            double dx = x.size(), dy = y.size(), dz = z.size();
+            if (dx < 0 || dy < 0 || dz < 0) return 0;
+            return 2.0 * (dx*dy + dy*dz + dz*dx);
+        }
+
+        /**
+         * Returns the center point of the bounding box
+         * @return center of the bounding box
+         */
+        vec3 centroid() const {
+            return vec3(
+                0.5 * (x.min + x.max),
+                0.5 * (y.min + y.max),
+                0.5 * (z.min + z.max)
+            );
+        }
+
+        /**
+         * Returns the overlap of this bounding box with another
+         * @param other bounding box to overlap with
+         * @return bounding box of the region inside both boxes, or an empty box if they do not overlap
+         */
+        aabb intersection(const aabb& other) const {
+            interval ox = interval(std::fmax(x.min, other.x.min), std::fmin(x.max, other.x.max));
+            interval oy = interval(std::fmax(y.min, other.y.min), std::fmin(y.max, other.y.max));
+            interval oz = interval(std::fmax(z.min, other.z.min), std::fmin(z.max, other.z.max));
+
+            if (ox.size() < 0 || oy.size() < 0 || oz.size() < 0) return empty;
+            return aabb(ox, oy, oz);
+        }
+
+        /**
+         * Returns the bounding box of the part of a convex polygon that lies inside this bounding box
+         * @param points vertices of the polygon in order, at most 8
+         * @param count number of vertices
+         * @return bounding box of the clipped polygon, or an empty box if none of the polygon is inside
+         */
+        aabb clip_polygon(const vec3* points, int count) const {
+            // Sutherland-Hodgman clipping against each of the box's six planes, every plane adds at most one vertex
+            vec3 buffers[2][14];
+            int sizes[2] = {count, 0};
+            std::copy(points, points + count, buffers[0]);
+
+            int current = 0;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = axis_interval(axis);
+
+                for (int side = 0; side < 2; side++) {
+                    const vec3* in = buffers[current];
+                    vec3* out = buffers[1 - current];
+                    int in_size = sizes[current];
+                    int out_size = 0;
+
+                    // Signed distance inside the plane, positive when the point is kept
+                    auto inside = [&](const vec3& p) { return side == 0 ? p[axis] - ax.min : ax.max - p[axis]; };
+
+                    for (int i = 0; i < in_size; i++) {
+                        const vec3& a = in[i];
+                        const vec3& b = in[(i + 1) % in_size];
+                        double da = inside(a);
+                        double db = inside(b);
+
+                        if (da >= 0) out[out_size++] = a;
+
+                        if ((da >= 0) != (db >= 0)) {
+                            vec3 p = a + (da / (da - db)) * (b - a);
+                            p[axis] = side == 0 ? ax.min : ax.max;
+                            out[out_size++] = p;
+                        }
+                    }
+
+                    current = 1 - current;
+                    sizes[current] = out_size;
+
+                    if (out_size == 0) return empty;
+                }
+            }
+
+            aabb box = empty;
+            for (int i = 0; i < sizes[current]; i++) {
+                box = aabb(box, aabb(buffers[current][i], buffers[current][i]));
+            }
+            return box;
+        }
+
         static const aabb empty, universe;
 
     private:
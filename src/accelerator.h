@@ -0,0 +1,106 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "collidable_list.h"
+#include "linear_bvh.h"
+#include "uniform_grid.h"
+
+#include <vector>
+#include <cmath>
+
+/**
+ * An enum for choosing which acceleration structure a scene is built into
+ */
+enum accelerator_type {
+    accelerator_auto,
+    accelerator_bvh,
+    accelerator_grid
+};
+
+/**
+ * A struct holding the primitive size statistics used to choose an acceleration structure
+ */
+struct primitive_statistics {
+    size_t count = 0;           // number of primitives
+    size_t outliers = 0;        // number of primitives far wider than the median
+    double mean_width = 0;      // mean bounding box diagonal of the other primitives
+    double width_variation = 0; // standard deviation of those diagonals relative to their mean
+};
+
+/**
+ * Measures how the sizes of a scene's primitives are spread
+ * @param list collidable_list to measure, nested collidable_lists are expanded
+ * @param config grid settings whose outlier ratio decides which primitives are left out
+ * @return size statistics of the primitives
+ */
+inline primitive_statistics measure_primitives(const collidable_list& list, const grid_config& config = grid_config()) {
+    primitive_statistics stats;
+    std::vector<double> widths;
+
+    for (const auto& object : list.flatten()) {
+        aabb box = object->bounding_box();
+        widths.push_back(vec3(box.x.size(), box.y.size(), box.z.size()).mag());
+    }
+
+    stats.count = widths.size();
+    if (widths.empty()) return stats;
+
+    std::vector<double> sorted = widths;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double median = sorted[sorted.size() / 2];
+
+    double sum = 0, sum_squared = 0;
+    size_t n = 0;
+
+    for (double width : widths) {
+        if (!std::isfinite(width) || width > config.outlier_ratio * median) {
+            stats.outliers++;
+            continue;
+        }
+
+        sum += width;
+        sum_squared += width * width;
+        n++;
+    }
+
+    stats.mean_width = sum / n;
+    double variance = std::fmax(0.0, sum_squared / n - stats.mean_width * stats.mean_width);
+    stats.width_variation = stats.mean_width > 0 ? std::sqrt(variance) / stats.mean_width : 0;
+
+    return stats;
+}
+
+/**
+ * Chooses between a uniform grid and a bounding volume hierarchy for a scene
+ *
+ * Grids win when there are enough primitives of similar size to fill their cells evenly, hierarchies adapt
+ * better to everything else.
+ * @param list collidable_list to choose for
+ * @param config grid settings used to measure the primitives
+ * @return accelerator_grid or accelerator_bvh
+ */
+inline accelerator_type choose_accelerator(const collidable_list& list, const grid_config& config = grid_config()) {
+    const size_t min_grid_primitives = 64;  // fewer primitives than this are cheap to put in any hierarchy
+    const double max_grid_variation = 0.5;  // primitives varying more in size than this crowd a grid's cells unevenly
+
+    primitive_statistics stats = measure_primitives(list, config);
+
+    if (stats.count - stats.outliers < min_grid_primitives) return accelerator_bvh;
+    return stats.width_variation <= max_grid_variation ? accelerator_grid : accelerator_bvh;
+}
+
+/**
+ * Builds a scene into an acceleration structure
+ * @param list collidable_list to build over
+ * @param type structure to build, or accelerator_auto to choose from the primitives' size statistics
+ * @param config settings used if a grid is built
+ * @return the built acceleration structure
+ */
+inline shared_ptr<collidable> make_accelerator(const collidable_list& list, accelerator_type type = accelerator_auto, grid_config config = grid_config()) {
+    if (type == accelerator_auto) type = choose_accelerator(list, config);
+
+    if (type == accelerator_grid) return make_shared<uniform_grid>(list, config);
+    return make_shared<linear_bvh>(list);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "vec3.h"
+#include "aabb.h"
+
+/**
+ * A class for representing affine transformations as a 3x4 matrix
+ *
+ * The left 3x3 block holds the linear part of the transformation and the last column holds the translation.
+ */
+class affine {
+    public:
+        /**
+         * The rows of this matrix
+         */
+        double m[3][4];
+
+        /**
+         * Creates an identity transformation
+         */
+        affine() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+        /**
+         * Returns a transformation that moves points by an offset
+         * @param offset amount to move by
+         * @return translation
+         */
+        static affine translation(const vec3& offset) {
+            affine t;
+            t.m[0][3] = offset[0];
+            t.m[1][3] = offset[1];
+            t.m[2][3] = offset[2];
+            return t;
+        }
+
+        /**
+         * Returns a transformation that scales points away from the origin
+         * @param s amount to scale each axis by
+         * @return scaling
+         */
+        static affine scaling(const vec3& s) {
+            affine t;
+            t.m[0][0] = s[0];
+            t.m[1][1] = s[1];
+            t.m[2][2] = s[2];
+            return t;
+        }
+
+        /**
+         * Returns a transformation that rotates points around an axis through the origin
+         * @param axis axis to rotate around
+         * @param degrees amount to rotate by in degrees
+         * @return rotation
+         */
+        static affine rotation(const vec3& axis, double degrees) {
+            vec3 a = axis.normalize();
+            double theta = d2r(degrees);
+            double c = std::cos(theta);
+            double s = std::sin(theta);
+            double one_c = 1 - c;
+
+            // Rodrigues' rotation formula
+            affine t;
+            t.m[0][0] = c + a[0]*a[0]*one_c;
+            t.m[0][1] = a[0]*a[1]*one_c - a[2]*s;
+            t.m[0][2] = a[0]*a[2]*one_c + a[1]*s;
+            t.m[1][0] = a[1]*a[0]*one_c + a[2]*s;
+            t.m[1][1] = c + a[1]*a[1]*one_c;
+            t.m[1][2] = a[1]*a[2]*one_c - a[0]*s;
+            t.m[2][0] = a[2]*a[0]*one_c - a[1]*s;
+            t.m[2][1] = a[2]*a[1]*one_c + a[0]*s;
+            t.m[2][2] = c + a[2]*a[2]*one_c;
+            return t;
+        }
+
+        /**
+         * Composes two transformations, applying rhs first and then this transformation
+         * @param rhs transformation to apply first
+         * @return composed transformation
+         */
+        affine operator*(const affine& rhs) const {
+            affine t;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    t.m[i][j] = m[i][0]*rhs.m[0][j] + m[i][1]*rhs.m[1][j] + m[i][2]*rhs.m[2][j];
+                }
+                t.m[i][3] += m[i][3];
+            }
+            return t;
+        }
+
+        /**
+         * Returns the inverse of this transformation
+         * @return inverse transformation
+         */
+        affine inverse() const {
+            // Invert the linear part with its adjugate
+            double c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+            double c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+            double c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+            double det = m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02;
+            double inv_det = 1.0 / det;
+
+            affine t;
+            t.m[0][0] = c00 * inv_det;
+            t.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+            t.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+            t.m[1][0] = c01 * inv_det;
+            t.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+            t.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+            t.m[2][0] = c02 * inv_det;
+            t.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+            t.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+            // The inverse translation undoes the original translation after the inverse linear part
+            for (int i = 0; i < 3; i++) {
+                t.m[i][3] = -(t.m[i][0]*m[0][3] + t.m[i][1]*m[1][3] + t.m[i][2]*m[2][3]);
+            }
+            return t;
+        }
+
+        /**
+         * Transforms a point, applying both the linear part and the translation
+         * @param p point to transform
+         * @return transformed point
+         */
+        vec3 point(const vec3& p) const {
+            return vec3(
+                m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]
+            );
+        }
+
+        /**
+         * Transforms a direction, applying only the linear part
+         * @param v direction to transform
+         * @return transformed direction
+         */
+        vec3 vector(const vec3& v) const {
+            return vec3(
+                m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]
+            );
+        }
+
+        /**
+         * Transforms a direction by the transpose of the linear part
+         *
+         * Called on the inverse of a transformation, this carries normals over with the inverse-transpose.
+         * @param n direction to transform
+         * @return transformed direction, not normalized
+         */
+        vec3 transpose_vector(const vec3& n) const {
+            return vec3(
+                m[0][0]*n[0] + m[1][0]*n[1] + m[2][0]*n[2],
+                m[0][1]*n[0] + m[1][1]*n[1] + m[2][1]*n[2],
+                m[0][2]*n[0] + m[1][2]*n[1] + m[2][2]*n[2]
+            );
+        }
+
+        /**
+         * Returns a bounding box surrounding a transformed bounding box
+         * @param box bounding box to transform
+         * @return bounding box of the transformed box
+         */
+        aabb bounding_box(const aabb& box) const {
+            interval axes[3];
+
+            // Each output axis is bounded by picking the smaller and larger end of every input axis
+            for (int i = 0; i < 3; i++) {
+                double lo = m[i][3];
+                double hi = m[i][3];
+
+                for (int j = 0; j < 3; j++) {
+                    const interval& ax = box.axis_interval(j);
+                    double a = m[i][j] * ax.min;
+                    double b = m[i][j] * ax.max;
+                    lo += std::fmin(a, b);
+                    hi += std::fmax(a, b);
+                }
+
+                axes[i] = interval(lo, hi);
+            }
+
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+};
+
+#endif
\ No newline at end of file
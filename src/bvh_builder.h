@@ -0,0 +1,1197 @@
+#ifndef BVH_BUILDER_H
+#define BVH_BUILDER_H
+
+#include "aabb.h"
+#include "sah.h"
+#include "thread_pool.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+/**
+ * A struct used to describe a primitive to the bvh_builder
+ */
+struct bvh_primitive {
+    aabb bbox;      // bounding box of the primitive
+    vec3 centroid;  // center of the primitive's bounding box
+    size_t index;   // index of the primitive in the caller's own primitive array
+
+    bvh_primitive() {}
+    bvh_primitive(const aabb& bbox, size_t index) : bbox(bbox), centroid(bbox.centroid()), index(index) {}
+};
+
+/**
+ * A node of the intermediate tree made by the bvh_builder before it is flattened
+ */
+struct bvh_build_node {
+    aabb bbox;                                      // bounding box around everything under this node
+    std::unique_ptr<bvh_build_node> children[2];    // child nodes, both null for leaves
+    int split_axis = 0;                             // axis the children were split along
+    size_t first_primitive = 0;                     // offset of the leaf's first primitive in the ordered primitive list
+    size_t primitive_count = 0;                     // number of primitives in a leaf, 0 for interior nodes
+    double cost = 0;                                // SAH cost of the subtree scaled by its surface area, set by treelet restructuring
+    int height = 0;                                 // number of levels below this node, set by treelet restructuring
+
+    /**
+     * Returns whether this node is a leaf
+     * @return true if this node holds primitives, false if it has children
+     */
+    bool is_leaf() const { return primitive_count > 0; }
+};
+
+/**
+ * A 32 byte node of a flattened bvh
+ *
+ * Bounds are stored as floats rounded outwards so they always enclose the original double precision bounds.
+ * The two children of an interior node are stored next to each other so both of their boxes share a cache line.
+ */
+struct alignas(32) linear_bvh_node {
+    float bounds_min[3];    // minimum corner of the node's bounding box
+    float bounds_max[3];    // maximum corner of the node's bounding box
+    uint32_t offset;        // interior: index of the first child, the second follows it, leaf: index of the first primitive
+    uint16_t count;         // number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;           // axis the node's children were split along
+    uint8_t pad;
+
+    /**
+     * Returns whether this node is a leaf
+     * @return true if this node holds primitives, false if it has children
+     */
+    bool is_leaf() const { return count > 0; }
+
+    /**
+     * Returns the bounding box of this node
+     * @return bounding box
+     */
+    aabb bounding_box() const {
+        aabb box;
+        box.x = interval(bounds_min[0], bounds_max[0]);
+        box.y = interval(bounds_min[1], bounds_max[1]);
+        box.z = interval(bounds_min[2], bounds_max[2]);
+        return box;
+    }
+
+    /**
+     * Sets the bounds of this node, rounding outwards to float precision
+     * @param box bounding box to store
+     */
+    void set_bounds(const aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = box.axis_interval(axis);
+            bounds_min[axis] = round_down(ax.min);
+            bounds_max[axis] = round_up(ax.max);
+        }
+    }
+
+    /**
+     * Returns whether a ray hits this node's bounding box
+     * @param origin origin of the ray
+     * @param inv_dir component-wise inverse of the ray's direction
+     * @param ray_t interval of ray to check
+     * @param t_enter distance along the ray where it enters the box
+     * @return true if the ray hits the box inside of ray_t, false otherwise
+     */
+    bool hit(const vec3& origin, const vec3& inv_dir, const interval& ray_t, double& t_enter) const {
+        double t_min = ray_t.min;
+        double t_max = ray_t.max;
+
+        for (int axis = 0; axis < 3; axis++) {
+            double t0 = (bounds_min[axis] - origin[axis]) * inv_dir[axis];
+            double t1 = (bounds_max[axis] - origin[axis]) * inv_dir[axis];
+
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > t_min) t_min = t0;
+            if (t1 < t_max) t_max = t1;
+
+            if (t_max < t_min) return false;
+        }
+
+        t_enter = t_min;
+        return true;
+    }
+
+    /**
+     * Returns the largest float that is not greater than the given value
+     */
+    static float round_down(double value) {
+        float f = float(value);
+        return (double(f) > value) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    /**
+     * Returns the smallest float that is not less than the given value
+     */
+    static float round_up(double value) {
+        float f = float(value);
+        return (double(f) < value) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fit in 32 bytes");
+
+/**
+ * A class for building bounding volume hierarchies over generic primitives
+ */
+class bvh_builder {
+    public:
+        /**
+         * Most nodes a ray can have queued while traversing a tree made by this builder
+         */
+        static const int max_stack_depth = 128;
+
+        /**
+         * A function returning the bounds of the part of a primitive, given by its index, inside a box
+         */
+        using clip_function = std::function<aabb(size_t index, const aabb& clip)>;
+
+        /**
+         * Creates a bvh_builder with the given settings
+         * @param config settings used to choose how the tree is split
+         * @param clip function used by spatial splits to clip primitives, overlaps their bounding boxes if null
+         */
+        bvh_builder(bvh_config config, clip_function clip = nullptr) : config(config), clip(clip) {
+            this->config.max_leaf_size = std::clamp(config.max_leaf_size, 1, 255);
+            this->config.treelet_size = std::clamp(config.treelet_size, 3, max_treelet_size);
+        }
+
+        /**
+         * Builds a tree over the given primitives
+         * @param primitives primitives to build over, reordered during the build
+         * @param ordered filled with the primitives' indices in the order the leaves reference them
+         * @return root of the built tree, or null if there are no primitives
+         */
+        std::unique_ptr<bvh_build_node> build(std::vector<bvh_primitive>& primitives, std::vector<size_t>& ordered) {
+            ordered.clear();
+            ordered.reserve(primitives.size());
+            node_count = 0;
+
+            if (primitives.empty()) return nullptr;
+
+            std::unique_ptr<bvh_build_node> root;
+
+            if (config.method == split_lbvh) {
+                root = build_lbvh(primitives, ordered);
+                node_count = count_nodes(*root);
+            } else if (config.method == split_sbvh) {
+                aabb bbox = aabb::empty;
+                for (const auto& p : primitives) {
+                    bbox = aabb(bbox, p.bbox);
+                }
+
+                root_area = bbox.surface_area();
+                reference_budget = size_t(std::max(0.0, config.duplication_budget) * primitives.size());
+
+                std::vector<bvh_primitive> references = primitives;
+                root = build_sbvh(references, 0, ordered);
+            } else {
+                root = build_recursive(primitives, 0, primitives.size(), 0, ordered);
+            }
+
+            if (config.restructure_treelets) {
+                restructure_treelets(*root, 0);
+            }
+
+            return root;
+        }
+
+        /**
+         * Flattens a built tree into an array of nodes where the two children of a node sit next to each other
+         * @param root root of the tree to flatten
+         * @param nodes filled with the flattened nodes, the root is at index 0
+         */
+        void flatten(const bvh_build_node& root, std::vector<linear_bvh_node>& nodes) const {
+            nodes.clear();
+            nodes.reserve(node_count);
+            nodes.emplace_back();
+            flatten_recursive(root, 0, nodes);
+
+            if (config.cluster_layout) {
+                cluster_nodes(nodes);
+            }
+        }
+
+        /**
+         * Finds a cache friendly order for the parts of a tree by cutting it into treelets that each fill a cluster
+         *
+         * Each treelet is grown from its root by repeatedly adding the part a ray is most likely to reach next, so
+         * the parts every ray passes through share a cluster. Inside a treelet parts keep their depth first order so
+         * a part's first child still tends to follow it. The parts left on a treelet's border become the roots of
+         * later treelets, so every part comes after its parent.
+         * @param root part holding the root of the tree
+         * @param part_count number of parts in the tree
+         * @param children_of function given a part and a callback, calling the callback with each child part and
+         *                    the surface area of the box a ray must hit to reach it
+         * @param parts_per_cluster number of parts in each treelet
+         * @return every part in its new order
+         */
+        template <typename children_fn>
+        static std::vector<uint32_t> cluster_order(uint32_t root, size_t part_count, children_fn children_of, size_t parts_per_cluster) {
+            std::vector<uint32_t> order;
+            order.reserve(part_count);
+            parts_per_cluster = std::max<size_t>(1, parts_per_cluster);
+
+            // Treelet each part was placed in, plus one, or 0 if it has not been placed yet
+            std::vector<uint32_t> treelet_of(part_count, 0);
+            std::vector<uint32_t> treelet_roots = {root};
+
+            // Parts waiting to be added to a treelet, the one with the largest area comes first
+            using frontier_entry = std::pair<double, uint32_t>;
+
+            for (size_t t = 0; t < treelet_roots.size(); t++) {
+                std::priority_queue<frontier_entry> frontier;
+                frontier.push({0, treelet_roots[t]});
+
+                for (size_t added = 0; added < parts_per_cluster && !frontier.empty(); added++) {
+                    uint32_t part = frontier.top().second;
+                    frontier.pop();
+                    treelet_of[part] = uint32_t(t + 1);
+
+                    children_of(part, [&](uint32_t child, double area) {
+                        frontier.push({area, child});
+                    });
+                }
+
+                while (!frontier.empty()) {
+                    treelet_roots.push_back(frontier.top().second);
+                    frontier.pop();
+                }
+
+                // Write out the treelet depth first
+                std::vector<uint32_t> stack = {treelet_roots[t]};
+                std::vector<uint32_t> children;
+
+                while (!stack.empty()) {
+                    uint32_t part = stack.back();
+                    stack.pop_back();
+                    order.push_back(part);
+
+                    children.clear();
+                    children_of(part, [&](uint32_t child, double) {
+                        if (treelet_of[child] == t + 1) children.push_back(child);
+                    });
+                    stack.insert(stack.end(), children.rbegin(), children.rend());
+                }
+            }
+
+            return order;
+        }
+
+        /**
+         * Returns the surface area heuristic cost of a flattened tree
+         * @param nodes flattened nodes of the tree
+         * @return SAH cost in units of the build config's traversal and intersection costs
+         */
+        double sah_cost(const std::vector<linear_bvh_node>& nodes) const {
+            if (nodes.empty()) return 0;
+            return sah_cost(nodes, 0);
+        }
+
+        /**
+         * Returns the number of nodes in the last built tree
+         * @return node count
+         */
+        size_t get_node_count() const { return node_count; }
+
+    private:
+        /**
+         * The settings used to build trees
+         */
+        bvh_config config;
+
+        /**
+         * The function used to clip primitives for spatial splits
+         */
+        clip_function clip;
+
+        /**
+         * The number of nodes in the last built tree
+         */
+        size_t node_count = 0;
+
+        /**
+         * The surface area of the root of the spatial split tree being built
+         */
+        double root_area = 0;
+
+        /**
+         * The number of references spatial splits may still add to the tree being built
+         */
+        size_t reference_budget = 0;
+
+        /**
+         * Depth after which SAH splits give way to median splits so trees stay shallow enough to traverse
+         */
+        static const int max_sah_depth = 64;
+
+        /**
+         * Most leaves a restructured treelet may have
+         */
+        static constexpr int max_treelet_size = 8;
+
+        /**
+         * Deepest a restructured treelet may push a leaf, so traversal stacks of max_stack_depth never overflow
+         */
+        static constexpr int max_restructured_depth = max_stack_depth - 1;
+
+        /**
+         * Number of bits of each axis in a Morton code
+         */
+        static constexpr int morton_bits = 10;
+
+        /**
+         * Number of leading Morton code bits shared by the primitives of one LBVH treelet
+         */
+        static constexpr int treelet_bits = 12;
+
+        /**
+         * A struct pairing a primitive with its Morton code
+         */
+        struct morton_primitive {
+            uint32_t code;  // Morton code of the primitive's centroid
+            uint32_t index; // index of the primitive in the build's primitive vector
+        };
+
+        /**
+         * Recursively builds a subtree over a range of primitives
+         * @param primitives primitives to build over
+         * @param start lower bound of range to use
+         * @param end upper bound of range to use
+         * @param depth depth of the subtree's root
+         * @param ordered list of primitive indices to append leaf primitives to
+         * @return root of the built subtree
+         */
+        std::unique_ptr<bvh_build_node> build_recursive(std::vector<bvh_primitive>& primitives, size_t start, size_t end, int depth, std::vector<size_t>& ordered) {
+            auto node = std::make_unique<bvh_build_node>();
+            node_count++;
+
+            for (size_t i = start; i < end; i++) {
+                node->bbox = aabb(node->bbox, primitives[i].bbox);
+            }
+
+            size_t range = end - start;
+            size_t mid;
+
+            if (range == 1) {
+                make_leaf(*node, primitives, start, end, ordered);
+                return node;
+            }
+
+            if (config.method == split_sah && depth < max_sah_depth) {
+                sah_split split = find_sah_split(
+                    primitives, start, end,
+                    [](const bvh_primitive& p) { return p.bbox; },
+                    config
+                );
+
+                if (split.make_leaf) {
+                    make_leaf(*node, primitives, start, end, ordered);
+                    return node;
+                }
+
+                mid = split.mid;
+                node->split_axis = split.axis;
+            } else {
+                // Split at the object median along the longest axis of the centroids
+                aabb centroid_bounds = aabb::empty;
+                for (size_t i = start; i < end; i++) {
+                    centroid_bounds = aabb(centroid_bounds, aabb(primitives[i].centroid, primitives[i].centroid));
+                }
+
+                int axis = centroid_bounds.longest_axis();
+                mid = start + range/2;
+
+                std::nth_element(
+                    std::begin(primitives) + start, std::begin(primitives) + mid, std::begin(primitives) + end,
+                    [axis](const bvh_primitive& a, const bvh_primitive& b) { return a.centroid[axis] < b.centroid[axis]; }
+                );
+
+                node->split_axis = axis;
+            }
+
+            node->children[0] = build_recursive(primitives, start, mid, depth + 1, ordered);
+            node->children[1] = build_recursive(primitives, mid, end, depth + 1, ordered);
+
+            return node;
+        }
+
+        /**
+         * A struct used to hold the result of a spatial split search
+         */
+        struct spatial_split {
+            int axis = -1;          // axis of the splitting plane, -1 if no split was found
+            double position = 0;    // position of the splitting plane along its axis
+            double cost = infinity; // estimated cost of the split
+        };
+
+        /**
+         * Recursively builds a subtree that may split references to a primitive across both children
+         *
+         * Each node tries a binned SAH object split, and if its children overlap it also tries splitting space with
+         * a plane, clipping the references that straddle it. References are duplicated until the budget runs out.
+         * @param references primitive references to build over, cleared once they are handed to the children
+         * @param depth depth of the subtree's root
+         * @param ordered list of primitive indices to append leaf primitives to
+         * @return root of the built subtree
+         */
+        std::unique_ptr<bvh_build_node> build_sbvh(std::vector<bvh_primitive>& references, int depth, std::vector<size_t>& ordered) {
+            size_t n = references.size();
+
+            // Past this depth fall back on median splits, which always separate the references
+            if (depth >= max_sah_depth) return build_recursive(references, 0, n, depth, ordered);
+
+            auto node = std::make_unique<bvh_build_node>();
+            node_count++;
+
+            for (const auto& r : references) {
+                node->bbox = aabb(node->bbox, r.bbox);
+            }
+
+            if (n == 1) {
+                make_leaf(*node, references, 0, n, ordered);
+                return node;
+            }
+
+            sah_split object = find_sah_split(
+                references, 0, n,
+                [](const bvh_primitive& p) { return p.bbox; },
+                config
+            );
+
+            if (object.make_leaf) {
+                make_leaf(*node, references, 0, n, ordered);
+                return node;
+            }
+
+            // Only look for a spatial split when the children of the object split overlap noticeably
+            aabb left_bounds = aabb::empty;
+            aabb right_bounds = aabb::empty;
+            for (size_t i = 0; i < n; i++) {
+                aabb& side = i < object.mid ? left_bounds : right_bounds;
+                side = aabb(side, references[i].bbox);
+            }
+
+            std::vector<bvh_primitive> left, right;
+            double overlap = left_bounds.intersection(right_bounds).surface_area();
+
+            if (reference_budget > 0 && overlap > config.spatial_split_alpha * root_area) {
+                spatial_split spatial = find_spatial_split(references, node->bbox);
+
+                if (spatial.axis != -1 && spatial.cost < object.cost) {
+                    split_references(references, node->bbox, spatial, left, right);
+                    node->split_axis = spatial.axis;
+                }
+            }
+
+            if (left.empty() || right.empty()) {
+                left.assign(std::begin(references), std::begin(references) + object.mid);
+                right.assign(std::begin(references) + object.mid, std::end(references));
+                node->split_axis = object.axis;
+            }
+
+            references.clear();
+            references.shrink_to_fit();
+
+            node->children[0] = build_sbvh(left, depth + 1, ordered);
+            node->children[1] = build_sbvh(right, depth + 1, ordered);
+
+            return node;
+        }
+
+        /**
+         * Finds the cheapest plane to split the space of a node at using binned references clipped to each bin
+         * @param references primitive references in the node
+         * @param bbox bounding box of the node
+         * @return the cheapest split, with an axis of -1 if none was found
+         */
+        spatial_split find_spatial_split(const std::vector<bvh_primitive>& references, const aabb& bbox) const {
+            const int bins = std::max(2, config.bins);
+            double area = bbox.surface_area();
+            double inv_area = area > 0 ? 1.0 / area : 0;
+
+            spatial_split best;
+
+            std::vector<aabb> bin_bounds(bins);
+            std::vector<int> entries(bins);
+            std::vector<int> exits(bins);
+            std::vector<double> right_area(bins);
+            std::vector<int> right_count(bins);
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = bbox.axis_interval(axis);
+                if (ax.size() <= 0) continue;
+
+                double width = ax.size() / bins;
+                auto bin_of = [&](double value) { return std::clamp(int((value - ax.min) / width), 0, bins - 1); };
+
+                std::fill(bin_bounds.begin(), bin_bounds.end(), aabb::empty);
+                std::fill(entries.begin(), entries.end(), 0);
+                std::fill(exits.begin(), exits.end(), 0);
+
+                // Clip every reference to each bin it spans, counting where it enters and leaves
+                for (const auto& r : references) {
+                    const interval& extent = r.bbox.axis_interval(axis);
+                    int first = bin_of(extent.min);
+                    int last = bin_of(extent.max);
+
+                    for (int b = first; b <= last; b++) {
+                        double lo = ax.min + b * width;
+                        double hi = b == bins - 1 ? ax.max : lo + width;
+                        bin_bounds[b] = aabb(bin_bounds[b], clip_reference(r, slab(bbox, axis, lo, hi)));
+                    }
+
+                    entries[first]++;
+                    exits[last]++;
+                }
+
+                // Sweep from the right to get the area and count on the far side of every plane
+                aabb right = aabb::empty;
+                int count = 0;
+                for (int b = bins - 1; b > 0; b--) {
+                    right = aabb(right, bin_bounds[b]);
+                    count += exits[b];
+                    right_area[b] = right.surface_area();
+                    right_count[b] = count;
+                }
+
+                // Sweep from the left and evaluate the cost of a plane after each bin
+                aabb left = aabb::empty;
+                count = 0;
+                for (int b = 0; b < bins - 1; b++) {
+                    left = aabb(left, bin_bounds[b]);
+                    count += entries[b];
+
+                    if (count == 0 || right_count[b+1] == 0) continue;
+
+                    double cost = config.traversal_cost + inv_area *
+                        (leaf_intersect_cost(config, count) * left.surface_area() + leaf_intersect_cost(config, right_count[b+1]) * right_area[b+1]);
+
+                    if (cost < best.cost) {
+                        best.axis = axis;
+                        best.position = ax.min + (b + 1) * width;
+                        best.cost = cost;
+                    }
+                }
+            }
+
+            return best;
+        }
+
+        /**
+         * Distributes references between two children at a spatial split, clipping references that straddle it
+         *
+         * A straddling reference is only split when that is cheaper than moving it whole into either child, and
+         * only while the duplication budget lasts.
+         * @param references primitive references in the node
+         * @param bbox bounding box of the node
+         * @param split plane to split at
+         * @param left filled with the references of the left child
+         * @param right filled with the references of the right child
+         */
+        void split_references(
+            const std::vector<bvh_primitive>& references, const aabb& bbox, const spatial_split& split,
+            std::vector<bvh_primitive>& left, std::vector<bvh_primitive>& right
+        ) {
+            int axis = split.axis;
+            aabb left_slab = slab(bbox, axis, bbox.axis_interval(axis).min, split.position);
+            aabb right_slab = slab(bbox, axis, split.position, bbox.axis_interval(axis).max);
+
+            // Place the references entirely on one side first so straddling ones can be judged against them
+            aabb left_bounds = aabb::empty;
+            aabb right_bounds = aabb::empty;
+            std::vector<const bvh_primitive*> straddling;
+
+            for (const auto& r : references) {
+                const interval& extent = r.bbox.axis_interval(axis);
+
+                if (extent.max <= split.position) {
+                    left.push_back(r);
+                    left_bounds = aabb(left_bounds, r.bbox);
+                } else if (extent.min >= split.position) {
+                    right.push_back(r);
+                    right_bounds = aabb(right_bounds, r.bbox);
+                } else {
+                    straddling.push_back(&r);
+                }
+            }
+
+            for (const bvh_primitive* r : straddling) {
+                aabb left_part = clip_reference(*r, left_slab);
+                aabb right_part = clip_reference(*r, right_slab);
+
+                // Splitting, moving left and moving right, all in units of area times reference count
+                double left_count = left.size() + 1;
+                double right_count = right.size() + 1;
+                aabb split_left = aabb(left_bounds, left_part);
+                aabb split_right = aabb(right_bounds, right_part);
+                aabb whole_left = aabb(left_bounds, r->bbox);
+                aabb whole_right = aabb(right_bounds, r->bbox);
+
+                double split_cost = split_left.surface_area() * left_count + split_right.surface_area() * right_count;
+                double left_cost = whole_left.surface_area() * left_count + right_bounds.surface_area() * (right_count - 1);
+                double right_cost = left_bounds.surface_area() * (left_count - 1) + whole_right.surface_area() * right_count;
+
+                bool can_split = reference_budget > 0 && left_part.surface_area() > 0 && right_part.surface_area() > 0;
+
+                if (can_split && split_cost < left_cost && split_cost < right_cost) {
+                    left.emplace_back(left_part, r->index);
+                    right.emplace_back(right_part, r->index);
+                    left_bounds = split_left;
+                    right_bounds = split_right;
+                    reference_budget--;
+                } else if (left_cost <= right_cost) {
+                    left.push_back(*r);
+                    left_bounds = whole_left;
+                } else {
+                    right.push_back(*r);
+                    right_bounds = whole_right;
+                }
+            }
+        }
+
+        /**
+         * Returns the bounds of the part of a reference inside a box
+         * @param reference primitive reference to clip
+         * @param box box to clip to
+         * @return clipped bounds, no larger than the reference's current bounds
+         */
+        aabb clip_reference(const bvh_primitive& reference, const aabb& box) const {
+            aabb region = reference.bbox.intersection(box);
+            if (!clip || region.surface_area() <= 0) return region;
+            return clip(reference.index, region).intersection(reference.bbox);
+        }
+
+        /**
+         * Returns the part of a box between two positions along an axis
+         * @param box box to cut
+         * @param axis axis to cut along
+         * @param lo lower position of the slab
+         * @param hi upper position of the slab
+         * @return slab of the box
+         */
+        static aabb slab(const aabb& box, int axis, double lo, double hi) {
+            interval axes[3] = {box.x, box.y, box.z};
+            axes[axis] = interval(lo, hi);
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+
+        /**
+         * Builds a tree by sorting primitives along a Morton curve and splitting at the bits where their codes differ
+         *
+         * Morton codes are computed and radix sorted in parallel, treelets sharing the leading code bits are emitted
+         * in parallel, and the treelets are joined by a SAH build over their bounding boxes.
+         * @param primitives primitives to build over
+         * @param ordered filled with the primitives' indices in the order the leaves reference them
+         * @return root of the built tree
+         */
+        std::unique_ptr<bvh_build_node> build_lbvh(const std::vector<bvh_primitive>& primitives, std::vector<size_t>& ordered) {
+            size_t n = primitives.size();
+            int threads = config.build_threads > 0 ? config.build_threads : std::max(1u, std::thread::hardware_concurrency());
+            thread_pool pool(threads);
+
+            aabb centroid_bounds = aabb::empty;
+            for (const auto& p : primitives) {
+                centroid_bounds = aabb(centroid_bounds, aabb(p.centroid, p.centroid));
+            }
+
+            // Compute Morton codes of the centroids scaled into the centroid bounds
+            std::vector<morton_primitive> morton(n);
+            const double scale = 1 << morton_bits;
+
+            parallel_for(pool, threads, n, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t code = 0;
+                    for (int axis = 0; axis < 3; axis++) {
+                        const interval& ax = centroid_bounds.axis_interval(axis);
+                        double offset = (primitives[i].centroid[axis] - ax.min) / ax.size();
+                        uint32_t cell = uint32_t(std::clamp(offset * scale, 0.0, scale - 1));
+                        code |= spread_bits(cell) << (2 - axis);
+                    }
+                    morton[i] = {code, uint32_t(i)};
+                }
+            });
+
+            radix_sort(morton, pool, threads);
+
+            ordered.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                ordered[i] = primitives[morton[i].index].index;
+            }
+
+            // Split the sorted primitives into treelets sharing their leading bits
+            const int low_bits = 3 * morton_bits - treelet_bits;
+            std::vector<std::pair<size_t, size_t>> ranges;
+            size_t start = 0;
+
+            for (size_t end = 1; end <= n; end++) {
+                if (end == n || (morton[start].code >> low_bits) != (morton[end].code >> low_bits)) {
+                    ranges.emplace_back(start, end);
+                    start = end;
+                }
+            }
+
+            std::vector<std::unique_ptr<bvh_build_node>> treelets(ranges.size());
+
+            for (size_t t = 0; t < ranges.size(); t++) {
+                pool.enqueue([&, t] {
+                    treelets[t] = emit_lbvh(primitives, morton, ranges[t].first, ranges[t].second, low_bits - 1);
+                });
+            }
+            pool.wait();
+
+            if (treelets.size() == 1) return std::move(treelets[0]);
+
+            // Join the treelets with a SAH build over their bounding boxes, one treelet per leaf
+            std::vector<bvh_primitive> treelet_primitives;
+            treelet_primitives.reserve(treelets.size());
+            for (size_t t = 0; t < treelets.size(); t++) {
+                treelet_primitives.emplace_back(treelets[t]->bbox, t);
+            }
+
+            bvh_config upper_config = config;
+            upper_config.method = split_sah;
+            upper_config.max_leaf_size = 1;
+
+            bvh_builder upper_builder(upper_config);
+            std::vector<size_t> treelet_order;
+            auto root = upper_builder.build_recursive(treelet_primitives, 0, treelet_primitives.size(), 0, treelet_order);
+
+            graft_treelets(root, treelets, treelet_order);
+            return root;
+        }
+
+        /**
+         * Recursively emits the hierarchy over a range of Morton sorted primitives
+         * @param primitives primitives to build over
+         * @param morton Morton sorted primitives
+         * @param start lower bound of range to use
+         * @param end upper bound of range to use
+         * @param bit highest Morton code bit that may still differ within the range
+         * @return root of the emitted subtree
+         */
+        std::unique_ptr<bvh_build_node> emit_lbvh(const std::vector<bvh_primitive>& primitives, const std::vector<morton_primitive>& morton, size_t start, size_t end, int bit) const {
+            auto node = std::make_unique<bvh_build_node>();
+            size_t range = end - start;
+
+            if (range <= size_t(config.max_leaf_size)) {
+                node->first_primitive = start;
+                node->primitive_count = range;
+                for (size_t i = start; i < end; i++) {
+                    node->bbox = aabb(node->bbox, primitives[morton[i].index].bbox);
+                }
+                return node;
+            }
+
+            // Skip the bits every code in the range shares
+            while (bit >= 0 && ((morton[start].code ^ morton[end-1].code) & (1u << bit)) == 0) {
+                bit--;
+            }
+
+            size_t mid;
+
+            if (bit < 0) {
+                // Every code is identical, so split the range in half
+                mid = start + range/2;
+                node->split_axis = 0;
+            } else {
+                // Binary search for the first code with the differing bit set
+                uint32_t mask = 1u << bit;
+                auto first = std::partition_point(
+                    std::begin(morton) + start, std::begin(morton) + end,
+                    [mask](const morton_primitive& p) { return (p.code & mask) == 0; }
+                );
+                mid = first - std::begin(morton);
+                node->split_axis = 2 - bit % 3;
+            }
+
+            node->children[0] = emit_lbvh(primitives, morton, start, mid, bit - 1);
+            node->children[1] = emit_lbvh(primitives, morton, mid, end, bit - 1);
+            node->bbox = aabb(node->children[0]->bbox, node->children[1]->bbox);
+
+            return node;
+        }
+
+        /**
+         * Replaces the leaves of a tree built over treelets with the treelets themselves
+         * @param node subtree to graft onto
+         * @param treelets roots of the treelets
+         * @param treelet_order treelet indices in the order the subtree's leaves reference them
+         */
+        static void graft_treelets(std::unique_ptr<bvh_build_node>& node, std::vector<std::unique_ptr<bvh_build_node>>& treelets, const std::vector<size_t>& treelet_order) {
+            if (node->is_leaf()) {
+                node = std::move(treelets[treelet_order[node->first_primitive]]);
+                return;
+            }
+
+            graft_treelets(node->children[0], treelets, treelet_order);
+            graft_treelets(node->children[1], treelets, treelet_order);
+        }
+
+        /**
+         * Sorts primitives by their Morton codes with a parallel least significant digit radix sort
+         * @param morton primitives to sort
+         * @param pool thread pool to run on
+         * @param threads number of chunks to split the work into
+         */
+        static void radix_sort(std::vector<morton_primitive>& morton, thread_pool& pool, int threads) {
+            const int digit_bits = 8;
+            const int buckets = 1 << digit_bits;
+            size_t n = morton.size();
+            size_t chunk = (n + threads - 1) / threads;
+
+            std::vector<morton_primitive> scratch(n);
+            std::vector<std::vector<size_t>> offsets(threads, std::vector<size_t>(buckets));
+
+            for (int shift = 0; shift < 3 * morton_bits; shift += digit_bits) {
+                // Count each chunk's digits
+                for (int t = 0; t < threads; t++) {
+                    pool.enqueue([&, t, shift] {
+                        std::fill(offsets[t].begin(), offsets[t].end(), 0);
+                        for (size_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++) {
+                            offsets[t][(morton[i].code >> shift) & (buckets - 1)]++;
+                        }
+                    });
+                }
+                pool.wait();
+
+                // Turn the counts into where each chunk writes each digit, keeping the sort stable
+                size_t total = 0;
+                for (int digit = 0; digit < buckets; digit++) {
+                    for (int t = 0; t < threads; t++) {
+                        size_t count = offsets[t][digit];
+                        offsets[t][digit] = total;
+                        total += count;
+                    }
+                }
+
+                for (int t = 0; t < threads; t++) {
+                    pool.enqueue([&, t, shift] {
+                        for (size_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++) {
+                            scratch[offsets[t][(morton[i].code >> shift) & (buckets - 1)]++] = morton[i];
+                        }
+                    });
+                }
+                pool.wait();
+
+                morton.swap(scratch);
+            }
+        }
+
+        /**
+         * Runs a function over evenly sized chunks of a range on a thread pool and waits for them to finish
+         * @param pool thread pool to run on
+         * @param threads number of chunks to split the range into
+         * @param n size of the range
+         * @param fn function taking the bounds of a chunk
+         */
+        template <typename chunk_fn>
+        static void parallel_for(thread_pool& pool, int threads, size_t n, chunk_fn fn) {
+            size_t chunk = (n + threads - 1) / threads;
+
+            for (size_t begin = 0; begin < n; begin += chunk) {
+                size_t end = std::min(n, begin + chunk);
+                pool.enqueue([&fn, begin, end] { fn(begin, end); });
+            }
+            pool.wait();
+        }
+
+        /**
+         * Spreads the low 10 bits of a value out so there are two zero bits between each of them
+         * @param x value to spread
+         * @return spread value
+         */
+        static uint32_t spread_bits(uint32_t x) {
+            x = (x | (x << 16)) & 0x030000FF;
+            x = (x | (x << 8)) & 0x0300F00F;
+            x = (x | (x << 4)) & 0x030C30C3;
+            x = (x | (x << 2)) & 0x09249249;
+            return x;
+        }
+
+        /**
+         * Returns the number of nodes in a subtree
+         * @param node root of the subtree
+         * @return node count
+         */
+        static size_t count_nodes(const bvh_build_node& node) {
+            if (node.is_leaf()) return 1;
+            return 1 + count_nodes(*node.children[0]) + count_nodes(*node.children[1]);
+        }
+
+        /**
+         * Reorganizes every treelet of a subtree into its cheapest topology, working from the bottom up
+         *
+         * A treelet is grown from a node by repeatedly opening its largest interior leaf, and the best way to
+         * arrange its leaves is found by dynamic programming over every subset of them. The cheapest arrangement
+         * can be much taller than the old one, so it is only kept if it is no taller or its leaves stay within
+         * max_restructured_depth.
+         * @param node root of the subtree
+         * @param depth depth of the node in the whole tree
+         * @return SAH cost of the subtree scaled by its surface area
+         */
+        double restructure_treelets(bvh_build_node& node, int depth) {
+            if (node.is_leaf()) {
+                node.cost = leaf_intersect_cost(config, node.primitive_count) * node.bbox.surface_area();
+                node.height = 0;
+                return node.cost;
+            }
+
+            restructure_treelets(*node.children[0], depth + 1);
+            restructure_treelets(*node.children[1], depth + 1);
+
+            // Cost and height of the treelet as it was built, used if it can't be restructured
+            double old_cost = config.traversal_cost * node.bbox.surface_area() + node.children[0]->cost + node.children[1]->cost;
+            int old_height = 1 + std::max(node.children[0]->height, node.children[1]->height);
+
+            // Grow the treelet by opening its largest interior leaves
+            std::vector<std::unique_ptr<bvh_build_node>*> leaf_slots = {&node.children[0], &node.children[1]};
+            std::vector<std::unique_ptr<bvh_build_node>*> interior_slots;
+
+            while (int(leaf_slots.size()) < config.treelet_size) {
+                int largest = -1;
+                double largest_area = -1;
+
+                for (size_t i = 0; i < leaf_slots.size(); i++) {
+                    const bvh_build_node& leaf = **leaf_slots[i];
+                    if (leaf.is_leaf()) continue;
+
+                    double area = leaf.bbox.surface_area();
+                    if (area > largest_area) {
+                        largest_area = area;
+                        largest = int(i);
+                    }
+                }
+
+                if (largest == -1) break;
+
+                auto opened = leaf_slots[largest];
+                interior_slots.push_back(opened);
+                leaf_slots[largest] = &(*opened)->children[0];
+                leaf_slots.push_back(&(*opened)->children[1]);
+            }
+
+            int n = int(leaf_slots.size());
+            if (n < 3) {
+                node.cost = old_cost;
+                node.height = old_height;
+                return node.cost;
+            }
+
+            // Find the cheapest topology of every subset of leaves, subsets of a set are always numerically smaller
+            int subsets = 1 << n;
+            std::vector<aabb> bounds(subsets);
+            std::vector<double> best_cost(subsets);
+            std::vector<int> best_split(subsets);
+            std::vector<int> height(subsets);
+
+            for (int set = 1; set < subsets; set++) {
+                int lowest = __builtin_ctz(set);
+
+                if (set == (1 << lowest)) {
+                    bounds[set] = (*leaf_slots[lowest])->bbox;
+                    best_cost[set] = (*leaf_slots[lowest])->cost;
+                    height[set] = (*leaf_slots[lowest])->height;
+                    continue;
+                }
+
+                bounds[set] = aabb(bounds[set & (set - 1)], bounds[1 << lowest]);
+                best_cost[set] = infinity;
+
+                // Only try splits holding the lowest leaf on the left to avoid testing every split twice
+                for (int left = (set - 1) & set; left > 0; left = (left - 1) & set) {
+                    if (!(left & (1 << lowest))) continue;
+
+                    double cost = best_cost[left] + best_cost[set ^ left];
+                    if (cost < best_cost[set]) {
+                        best_cost[set] = cost;
+                        best_split[set] = left;
+                    }
+                }
+
+                best_cost[set] += config.traversal_cost * bounds[set].surface_area();
+                height[set] = 1 + std::max(height[best_split[set]], height[set ^ best_split[set]]);
+            }
+
+            // Keep the treelet as it was if the new arrangement would push its leaves too deep
+            if (height[subsets - 1] > old_height && depth + height[subsets - 1] > max_restructured_depth) {
+                node.cost = old_cost;
+                node.height = old_height;
+                return node.cost;
+            }
+
+            // Take the treelet apart, then put it back together in its cheapest arrangement
+            std::vector<std::unique_ptr<bvh_build_node>> leaves(n);
+            for (int i = 0; i < n; i++) {
+                leaves[i] = std::move(*leaf_slots[i]);
+            }
+
+            std::vector<std::unique_ptr<bvh_build_node>> spare_nodes;
+            for (auto slot : interior_slots) {
+                spare_nodes.push_back(std::move(*slot));
+            }
+
+            assemble_treelet(node, subsets - 1, leaves, spare_nodes, bounds, best_cost, best_split, height);
+            return node.cost;
+        }
+
+        /**
+         * Recursively rebuilds a treelet node from the cheapest split of a subset of its leaves
+         * @param node node to fill in
+         * @param set subset of leaves the node holds
+         * @param leaves leaves of the treelet
+         * @param spare_nodes interior nodes of the old treelet available for reuse
+         * @param bounds bounding box of every subset
+         * @param best_cost cheapest cost of every subset
+         * @param best_split left half of the cheapest split of every subset
+         * @param height height of the cheapest topology of every subset
+         */
+        static void assemble_treelet(
+            bvh_build_node& node, int set,
+            std::vector<std::unique_ptr<bvh_build_node>>& leaves,
+            std::vector<std::unique_ptr<bvh_build_node>>& spare_nodes,
+            const std::vector<aabb>& bounds,
+            const std::vector<double>& best_cost,
+            const std::vector<int>& best_split,
+            const std::vector<int>& height
+        ) {
+            int halves[2] = {best_split[set], set ^ best_split[set]};
+
+            for (int c = 0; c < 2; c++) {
+                int half = halves[c];
+
+                if ((half & (half - 1)) == 0) {
+                    node.children[c] = std::move(leaves[__builtin_ctz(half)]);
+                } else {
+                    node.children[c] = std::move(spare_nodes.back());
+                    spare_nodes.pop_back();
+                    assemble_treelet(*node.children[c], half, leaves, spare_nodes, bounds, best_cost, best_split, height);
+                }
+            }
+
+            node.bbox = bounds[set];
+            node.cost = best_cost[set];
+            node.height = height[set];
+            node.split_axis = node.bbox.longest_axis();
+        }
+
+        /**
+         * Turns a node into a leaf holding a range of primitives
+         * @param node node to make into a leaf
+         * @param primitives primitives to build over
+         * @param start lower bound of range to use
+         * @param end upper bound of range to use
+         * @param ordered list of primitive indices to append the leaf's primitives to
+         */
+        static void make_leaf(bvh_build_node& node, const std::vector<bvh_primitive>& primitives, size_t start, size_t end, std::vector<size_t>& ordered) {
+            node.first_primitive = ordered.size();
+            node.primitive_count = end - start;
+
+            for (size_t i = start; i < end; i++) {
+                ordered.push_back(primitives[i].index);
+            }
+        }
+
+        /**
+         * Recursively writes a build node and its descendants into the flattened node array
+         * @param node build node to write
+         * @param index index in the array reserved for this node
+         * @param nodes flattened node array
+         */
+        static void flatten_recursive(const bvh_build_node& node, size_t index, std::vector<linear_bvh_node>& nodes) {
+            nodes[index].set_bounds(node.bbox);
+            nodes[index].axis = uint8_t(node.split_axis);
+            nodes[index].pad = 0;
+
+            if (node.is_leaf()) {
+                nodes[index].offset = uint32_t(node.first_primitive);
+                nodes[index].count = uint16_t(node.primitive_count);
+                return;
+            }
+
+            // Reserve both children next to each other before descending
+            size_t first_child = nodes.size();
+            nodes.emplace_back();
+            nodes.emplace_back();
+
+            nodes[index].offset = uint32_t(first_child);
+            nodes[index].count = 0;
+
+            flatten_recursive(*node.children[0], first_child, nodes);
+            flatten_recursive(*node.children[1], first_child + 1, nodes);
+        }
+
+        /**
+         * Reorders flattened nodes into clusters of config.cluster_bytes using cluster_order
+         *
+         * Sibling pairs are kept together and moved as one part, so each pair still shares a cache line.
+         * @param nodes flattened node array, the root is at index 0 and each pair of children starts at an odd index
+         */
+        void cluster_nodes(std::vector<linear_bvh_node>& nodes) const {
+            // Part 0 is the root on its own, part k is the pair of children at nodes 2k-1 and 2k
+            size_t part_count = (nodes.size() + 1) / 2;
+            size_t parts_per_cluster = size_t(std::max(1, config.cluster_bytes)) / (2 * sizeof(linear_bvh_node));
+
+            auto children_of = [&](uint32_t part, auto visit) {
+                uint32_t first = part == 0 ? 0 : 2 * part - 1;
+                uint32_t last = part == 0 ? 0 : 2 * part;
+
+                for (uint32_t i = first; i <= last; i++) {
+                    if (!nodes[i].is_leaf()) visit((nodes[i].offset + 1) / 2, nodes[i].bounding_box().surface_area());
+                }
+            };
+
+            std::vector<uint32_t> order = cluster_order(0, part_count, children_of, parts_per_cluster);
+
+            // Place every part, then point interior nodes at their children's new places
+            std::vector<uint32_t> new_index(nodes.size());
+            std::vector<linear_bvh_node> clustered;
+            clustered.reserve(nodes.size());
+
+            for (uint32_t part : order) {
+                if (part == 0) {
+                    new_index[0] = uint32_t(clustered.size());
+                    clustered.push_back(nodes[0]);
+                } else {
+                    new_index[2 * part - 1] = uint32_t(clustered.size());
+                    clustered.push_back(nodes[2 * part - 1]);
+                    new_index[2 * part] = uint32_t(clustered.size());
+                    clustered.push_back(nodes[2 * part]);
+                }
+            }
+
+            for (linear_bvh_node& node : clustered) {
+                if (!node.is_leaf()) node.offset = new_index[node.offset];
+            }
+
+            nodes = std::move(clustered);
+        }
+
+        /**
+         * Recursively computes the surface area heuristic cost of a flattened subtree
+         * @param nodes flattened node array
+         * @param index index of the subtree's root
+         * @return SAH cost of the subtree
+         */
+        double sah_cost(const std::vector<linear_bvh_node>& nodes, size_t index) const {
+            const linear_bvh_node& node = nodes[index];
+
+            if (node.is_leaf()) return leaf_intersect_cost(config, node.count);
+
+            double area = node.bounding_box().surface_area();
+            const linear_bvh_node& left = nodes[node.offset];
+            const linear_bvh_node& right = nodes[node.offset + 1];
+
+            double left_cost = sah_cost(nodes, node.offset);
+            double right_cost = sah_cost(nodes, node.offset + 1);
+
+            if (area <= 0) return config.traversal_cost + left_cost + right_cost;
+
+            return config.traversal_cost +
+                (left.bounding_box().surface_area() * left_cost + right.bounding_box().surface_area() * right_cost) / area;
+        }
+};
+
+#endif
\ No newline at end of file
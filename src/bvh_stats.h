@@ -0,0 +1,163 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include "aabb.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * A class for collecting and reporting the shape and quality of an acceleration structure
+ *
+ * Hierarchies describe themselves to a bvh_stats one node at a time. The SAH cost is recomputed from the node boxes
+ * with unit traversal and intersection costs, so it can be compared between different kinds of hierarchy.
+ */
+class bvh_stats {
+    public:
+        size_t node_count = 0;                      // number of interior and leaf nodes
+        size_t leaf_count = 0;                      // number of leaf nodes
+        size_t primitive_references = 0;            // number of primitives referenced by leaves, counting duplicates
+        int max_depth = 0;                          // depth of the deepest node, the root is at depth 0
+        size_t memory_bytes = 0;                    // memory used by the hierarchy itself, not counting its primitives
+        std::vector<size_t> interiors_per_depth;    // number of interior nodes at each depth
+        std::vector<size_t> leaves_per_depth;       // number of leaves at each depth
+        std::map<size_t, size_t> leaves_per_size;   // number of leaves holding each number of primitives
+
+        /**
+         * Records an interior node
+         * @param depth depth of the node
+         * @param box bounding box of the node
+         * @param children bounding boxes of the node's children
+         * @param child_count number of children
+         */
+        void add_interior(int depth, const aabb& box, const aabb* children, int child_count) {
+            add_node(depth, box, 1.0);
+            interiors_per_depth[depth]++;
+
+            // Sum the area shared by every pair of children, relative to the node's own area
+            double area = box.surface_area();
+            double overlap = 0;
+
+            for (int i = 0; i < child_count; i++) {
+                for (int j = i + 1; j < child_count; j++) {
+                    overlap += children[i].intersection(children[j]).surface_area();
+                }
+            }
+
+            if (area > 0) overlap_sums[depth] += overlap / area;
+        }
+
+        /**
+         * Records a leaf node
+         * @param depth depth of the node
+         * @param box bounding box of the node
+         * @param primitive_count number of primitives the leaf holds
+         */
+        void add_leaf(int depth, const aabb& box, size_t primitive_count) {
+            add_node(depth, box, double(primitive_count));
+            leaves_per_depth[depth]++;
+            leaf_count++;
+            primitive_references += primitive_count;
+            leaves_per_size[primitive_count]++;
+        }
+
+        /**
+         * Returns the surface area heuristic cost of the hierarchy using unit traversal and intersection costs
+         * @return SAH cost
+         */
+        double sah_cost() const {
+            return root_area > 0 ? area_sum / root_area : 0;
+        }
+
+        /**
+         * Returns how much the children of interior nodes at a depth overlap on average
+         * @param depth depth to check
+         * @return mean ratio of the area shared by pairs of children to the area of their parent
+         */
+        double mean_overlap(int depth) const {
+            if (depth >= int(interiors_per_depth.size()) || interiors_per_depth[depth] == 0) return 0;
+            return overlap_sums[depth] / interiors_per_depth[depth];
+        }
+
+        /**
+         * Writes a readable report of the collected statistics
+         * @param out stream to write to
+         * @param name name of the hierarchy to put in the report's title
+         */
+        void print(std::ostream& out, const std::string& name) const {
+            double depth_sum = 0;
+            for (size_t d = 0; d < leaves_per_depth.size(); d++) {
+                depth_sum += double(d) * leaves_per_depth[d];
+            }
+
+            std::ios_base::fmtflags flags = out.flags();
+            out << std::fixed << std::setprecision(3);
+
+            out << name << " statistics:\n"
+                << "  nodes:                " << node_count << " (" << node_count - leaf_count << " interior, " << leaf_count << " leaves)\n"
+                << "  primitive references: " << primitive_references << "\n"
+                << "  primitives per leaf:  " << (leaf_count ? double(primitive_references) / leaf_count : 0) << " mean\n"
+                << "  depth:                " << max_depth << " max, " << (leaf_count ? depth_sum / leaf_count : 0) << " mean leaf depth\n"
+                << "  SAH cost:             " << sah_cost() << "\n"
+                << "  memory:               " << memory_bytes / 1024.0 << " KiB\n";
+
+            out << "  leaf sizes:          ";
+            for (const auto& [size, count] : leaves_per_size) {
+                out << " " << size << ":" << count;
+            }
+            out << "\n";
+
+            out << "  depth  interior  leaves  overlap\n";
+            for (int d = 0; d <= max_depth; d++) {
+                out << "  " << std::setw(5) << d
+                    << "  " << std::setw(8) << interiors_per_depth[d]
+                    << "  " << std::setw(6) << leaves_per_depth[d]
+                    << "  " << std::setw(7) << mean_overlap(d) << "\n";
+            }
+
+            out.flags(flags);
+            out << std::flush;
+        }
+
+    private:
+        /**
+         * The surface area of the root node
+         */
+        double root_area = 0;
+
+        /**
+         * The sum of every node's surface area weighted by the cost of visiting it
+         */
+        double area_sum = 0;
+
+        /**
+         * The sum of the overlap ratios of the interior nodes at each depth
+         */
+        std::vector<double> overlap_sums;
+
+        /**
+         * Records the parts of a node shared by interior nodes and leaves
+         * @param depth depth of the node
+         * @param box bounding box of the node
+         * @param weight cost of visiting the node
+         */
+        void add_node(int depth, const aabb& box, double weight) {
+            if (depth >= int(interiors_per_depth.size())) {
+                interiors_per_depth.resize(depth + 1);
+                leaves_per_depth.resize(depth + 1);
+                overlap_sums.resize(depth + 1);
+            }
+
+            double area = box.surface_area();
+            if (depth == 0) root_area = area;
+
+            area_sum += weight * area;
+            max_depth = std::max(max_depth, depth);
+            node_count++;
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+#ifndef BVH_TRAVERSAL_H
+#define BVH_TRAVERSAL_H
+
+#include "bvh_builder.h"
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+/**
+ * Traversals shared by the binary hierarchies
+ *
+ * A hierarchy describes itself to a traversal through a tree type with:
+ *   node_type                                                      handle to a node, such as an index or pointer
+ *   node_type root() const                                         the root node
+ *   bool hit(node_type, const interval& ray_t, double& t_enter)    whether the ray hits the node's box, and where
+ *   bool is_leaf(node_type) const                                  whether the node holds primitives
+ *   node_type child(node_type, int i) const                        the node's first or second child
+ *
+ * Each hierarchy only supplies the test for its leaves, so the order nodes are visited in and when they are skipped
+ * is the same everywhere. Trees are small views of a hierarchy for one ray and are taken by value, so the compiler
+ * can keep them in registers while the leaf tests write to memory.
+ */
+
+/**
+ * Visits the leaves a ray may hit, nearest first, skipping any that start past the closest collision found so far
+ * @param tree hierarchy to traverse, which must not be empty
+ * @param ray_t interval of ray to check
+ * @param leaf callable taking a leaf and the interval left to check, returning true if it found a collision closer
+ * than the interval's max and narrowed the max to it
+ * @return true if any leaf found a collision, false otherwise
+ */
+template <typename Tree, typename Leaf>
+bool traverse_closest(Tree tree, interval ray_t, Leaf&& leaf) {
+    using node_type = typename Tree::node_type;
+
+    // Nodes waiting to be visited along with where the ray enters them
+    struct stack_entry {
+        node_type node;
+        double t_enter;
+    } stack[bvh_builder::max_stack_depth];
+
+    int stack_size = 0;
+    double t_enter = 0;
+
+    if (!tree.hit(tree.root(), ray_t, t_enter)) return false;
+    stack[stack_size++] = {tree.root(), t_enter};
+
+    bool hit_anything = false;
+
+    while (stack_size > 0) {
+        stack_entry entry = stack[--stack_size];
+
+        // A closer hit was found after this node was queued
+        if (entry.t_enter > ray_t.max) continue;
+
+        if (tree.is_leaf(entry.node)) {
+            if (leaf(entry.node, ray_t)) hit_anything = true;
+            continue;
+        }
+
+        // Test both children, queueing the farther one first so the nearer one is visited next
+        node_type left = tree.child(entry.node, 0);
+        node_type right = tree.child(entry.node, 1);
+
+        double t_left = 0, t_right = 0;
+        bool hit_left = tree.hit(left, ray_t, t_left);
+        bool hit_right = tree.hit(right, ray_t, t_right);
+
+        assert(stack_size + 2 <= bvh_builder::max_stack_depth && "tree is deeper than bvh_builder::max_stack_depth");
+        if (hit_left && hit_right) {
+            if (t_left <= t_right) {
+                stack[stack_size++] = {right, t_right};
+                stack[stack_size++] = {left, t_left};
+            } else {
+                stack[stack_size++] = {left, t_left};
+                stack[stack_size++] = {right, t_right};
+            }
+        } else if (hit_left) {
+            stack[stack_size++] = {left, t_left};
+        } else if (hit_right) {
+            stack[stack_size++] = {right, t_right};
+        }
+    }
+
+    return hit_anything;
+}
+
+/**
+ * Visits the leaves a ray may hit until one finds any collision
+ *
+ * Any collision ends the search, so nodes are visited in whatever order is cheapest.
+ * @param tree hierarchy to traverse, which must not be empty
+ * @param ray_t interval of ray to check
+ * @param leaf callable taking a leaf, returning true if it found a collision in ray_t
+ * @return true if any leaf found a collision, false otherwise
+ */
+template <typename Tree, typename Leaf>
+bool traverse_any(Tree tree, const interval& ray_t, Leaf&& leaf) {
+    using node_type = typename Tree::node_type;
+
+    node_type stack[bvh_builder::max_stack_depth];
+    int stack_size = 0;
+    double t_enter = 0;
+
+    if (!tree.hit(tree.root(), ray_t, t_enter)) return false;
+    stack[stack_size++] = tree.root();
+
+    while (stack_size > 0) {
+        node_type node = stack[--stack_size];
+
+        if (tree.is_leaf(node)) {
+            if (leaf(node)) return true;
+            continue;
+        }
+
+        node_type left = tree.child(node, 0);
+        node_type right = tree.child(node, 1);
+
+        assert(stack_size + 2 <= bvh_builder::max_stack_depth && "tree is deeper than bvh_builder::max_stack_depth");
+        if (tree.hit(right, ray_t, t_enter)) stack[stack_size++] = right;
+        if (tree.hit(left, ray_t, t_enter)) stack[stack_size++] = left;
+    }
+
+    return false;
+}
+
+/**
+ * A flattened hierarchy of linear_bvh_nodes as seen by one ray, for the traversals above
+ */
+struct linear_bvh_tree {
+    using node_type = uint32_t;
+
+    const linear_bvh_node* nodes;   // flattened nodes, the root first
+    vec3 origin;                    // origin of the ray
+    vec3 inv_dir;                   // component-wise inverse of the ray's direction
+
+    /**
+     * Creates a view of a hierarchy for a ray
+     * @param nodes flattened nodes of the hierarchy
+     * @param r ray to traverse the hierarchy with
+     */
+    linear_bvh_tree(const std::vector<linear_bvh_node>& nodes, const ray& r) :
+        nodes(nodes.data()),
+        origin(r.origin()),
+        inv_dir(1.0 / r.direction()[0], 1.0 / r.direction()[1], 1.0 / r.direction()[2]) {}
+
+    node_type root() const { return 0; }
+
+    bool hit(node_type node, const interval& ray_t, double& t_enter) const {
+        return nodes[node].hit(origin, inv_dir, ray_t, t_enter);
+    }
+
+    bool is_leaf(node_type node) const { return nodes[node].is_leaf(); }
+
+    node_type child(node_type node, int i) const { return nodes[node].offset + i; }
+};
+
+#endif
\ No newline at end of file
@@ -7,7 +7,6 @@
 #include "material.h"
 #include "mathutils.h"
 #include "cube_map.h"
-#include "pdf.h"
 
 #define EPSILON 0.001
 
@@ -403,9 +402,9 @@ class camera {
                 return background.value(r);
             }
 
-            // Get emitted and scattered colors
-            color emission = rec.mat->emit(r, rec, rec.u, rec.v, rec.point);
-            
+            // Only lights emit, so every other material skips the emitted color
+            color emission = rec.mat->emits() ? rec.mat->emit(r, rec) : color();
+
             scatter_record srec;
             if (!rec.mat->scatter(r, rec, srec)) {
                 return emission;
@@ -413,29 +412,27 @@ class camera {
 
             // Material doesn't support pdfs, use deterministic scattered ray instead
             if (srec.skip_pdf) {
-                return srec.attenuation * ray_color(srec.skip_pdf_ray, world, lights, depth-1, mode);
+                return srec.attenuation * ray_color(srec.scattered, world, lights, depth-1, mode);
             }
 
             if (mode == no_lights) {
-                ray scattered = ray(rec.point, srec.pdf_ptr->generate(), r.time());
-                double pdf = srec.pdf_ptr->value(scattered.direction());
-
-                double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
-
-                color scatter = srec.attenuation * scattering_pdf * ray_color(scattered, world, lights, depth-1, mode) / pdf;
+                color scatter = srec.attenuation * srec.scattering_pdf * ray_color(srec.scattered, world, lights, depth-1, mode) / srec.pdf;
 
                 return emission + scatter;
             }
 
-            // Use the lights' pdf to sample lights more often
-            auto light_ptr = make_shared<collidable_pdf>(lights, rec.point);
-            mixture_pdf p(light_ptr, srec.pdf_ptr);
+            // Sample the lights half of the time instead of the material, weighting by the mixture of both pdfs
+            ray scattered = srec.scattered;
+            double material_pdf = srec.pdf;
+            double scattering_pdf = srec.scattering_pdf;
 
-            ray scattered = ray(rec.point, p.generate(), r.time());
-            double pdf_value = p.value(scattered.direction());
+            if (random_double() < 0.5) {
+                scattered = ray(rec.point, lights.random(rec.point), r.time());
+                scattering_pdf = rec.mat->scattering_pdf(rec, scattered.direction(), material_pdf);
+            }
+
+            double pdf_value = 0.5*lights.pdf_value(rec.point, scattered.direction()) + 0.5*material_pdf;
 
-            double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
-            
             color scatter = (srec.attenuation * scattering_pdf * ray_color(scattered, world, lights, depth-1, mode)) / pdf_value;
 
             return emission + scatter;
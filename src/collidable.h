@@ -3,7 +3,9 @@
 
 #include "renderlib.h"
 #include "aabb.h"
-#include "quaternion.h"
+
+#include <cstdint>
+#include <cassert>
 
 class material;
 
@@ -13,7 +15,7 @@ class material;
 struct collision_hit {
     vec3 point;                     // collision point
     vec3 normal;                    // normal of collision
-    std::shared_ptr<material> mat;  // material from collision
+    const material* mat;            // material from collision, owned by the collidable that was hit
     double t;                       // t value of ray that collided
     double u, v;                    // u-v values of the collision's texture
     bool front_face;                // used to determine if collision happened "inside" or "outside"
@@ -28,6 +30,71 @@ struct collision_hit {
     }
 };
 
+class collidable;
+
+/**
+ * A struct holding what traversal needs to know about the closest collision found so far
+ *
+ * Finding the closest collision only needs its t value and where on which primitive it lies. Everything else,
+ * such as the point, normal, texture coords and material, is computed once for the final collision by
+ * compute_surface_interaction, so collisions that are later replaced by closer ones cost no more than that.
+ */
+struct collision {
+    /**
+     * Most instances a collision can be found through
+     *
+     * Instances of instances are folded into one when made, so only instances nested through aggregates, such as
+     * a linear_bvh of instances placed by another instance, count towards the limit.
+     */
+    static constexpr int max_instance_depth = 8;
+
+    double t;                                           // t value of ray that collided
+    const collidable* object;                           // primitive collidable that was hit
+    uint32_t primitive;                                 // index of the primitive hit, for collidables holding many
+    double alpha, beta;                                 // coords of the collision on the primitive, such as barycentric coords
+    const collidable* instances[max_instance_depth];    // instances the collision was found through, innermost first
+    int instance_count = 0;                             // number of instances the collision was found through
+
+    /**
+     * Records a collision with a primitive as the closest so far
+     * @param t t value of ray that collided
+     * @param object primitive collidable that was hit
+     * @param primitive index of the primitive hit, for collidables holding many
+     * @param alpha first coord of the collision on the primitive
+     * @param beta second coord of the collision on the primitive
+     */
+    void record(double t, const collidable* object, uint32_t primitive = 0, double alpha = 0, double beta = 0) {
+        this->t = t;
+        this->object = object;
+        this->primitive = primitive;
+        this->alpha = alpha;
+        this->beta = beta;
+
+        // Instances append themselves as the search returns through them
+        instance_count = 0;
+    }
+
+    /**
+     * Adds an instance the collision just recorded was found through
+     *
+     * Every instance of the chain is needed to transform the collision back to world space, so a deeper chain
+     * can't be resolved and is an error rather than being cut short.
+     * @param placed instance holding every instance already added
+     */
+    void add_instance(const collidable* placed) {
+        assert(instance_count < max_instance_depth && "instances are nested deeper than collision::max_instance_depth");
+        if (instance_count < max_instance_depth) instances[instance_count++] = placed;
+    }
+
+    /**
+     * Returns the collidable that computes the surface interaction of this collision
+     * @return outermost instance the collision was found through, or the primitive if there is none
+     */
+    const collidable* outermost() const {
+        return instance_count > 0 ? instances[instance_count - 1] : object;
+    }
+};
+
 /**
  * A virtual class for interfacing with objects affected by light
  */
@@ -37,219 +104,106 @@ class collidable {
 
         /**
          * Returns if a ray collides with this collidable object and information about the collision
+         *
+         * Finds the closest collision with intersect, then computes its surface interaction once.
          * @param r ray to check
          * @param ray_t interval of ray to check
          * @param rec place to collect collision info
          * @return true if ray collides, false if ray doesn't collide
          */
-        virtual bool hit(const ray& r, interval ray_t, collision_hit& rec) const = 0;
-
-        /**
-         * Returns the bounding box of this collidable object
-         * @return bounding box
-         */
-        virtual aabb bounding_box() const = 0;
-
-        /**
-         * Returns the pdf value associated with this collidable and the given incoming ray
-         * @param origin origin of incoming ray
-         * @param direction direction of incoming ray
-         * @return pdf value of ray
-         */
-        virtual double pdf_value(const vec3& origin, const vec3& direction) const {
-            return 0.0;
-        }
-
-        /**
-         * Returns a random direction towards this collidable
-         * @param origin point to come from
-         * @return direction to collidable
-         */
-        virtual vec3 random(const vec3& origin) const {
-            return vec3(1, 0, 0);
-        }
-};
-
-/**
- * A class for translating collidable objects around in 3D space
- */
-class translate : public collidable {
-    public:
-        /**
-         * Creates a translated copy of an existing collidable object
-         * @param obj original object
-         * @param offset translation offset from original object
-         */
-        translate(shared_ptr<collidable> obj, vec3 offset):obj(obj), offset(offset) {
-            bbox = obj->bounding_box() + offset;
-        }
-
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
-            // Offset our ray to mimic moving this object 
-            ray offset_r(r.origin() - offset, r.direction(), r.time());
-
-            // Use object's hit function with offset ray
-            if (!obj->hit(offset_r, ray_t, rec)) return false;
-
-            // Make sure to update hit point with offset
-            rec.point += offset;
+        bool hit(const ray& r, interval ray_t, collision_hit& rec) const {
+            collision closest;
+            if (!intersect(r, ray_t, closest)) return false;
 
+            closest.outermost()->compute_surface_interaction(r, closest, rec);
             return true;
         }
 
-        aabb bounding_box() const { return bbox; }
-
-    private:
         /**
-         * The object affected by this translation
-         */
-        shared_ptr<collidable> obj;
-        
-        /**
-         * The offset of this translation
-         */
-        vec3 offset;
-        
-        /**
-         * The updated bounding box after being moved by this translation
+         * Returns if a ray collides with this collidable object closer than the closest collision so far
+         *
+         * Only the t value and where on which primitive the collision lies are recorded, and hit is left untouched
+         * if the ray doesn't collide.
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param hit place to record the closest collision
+         * @return true if ray collides, false if ray doesn't collide
          */
-        aabb bbox;
-};
-
+        virtual bool intersect(const ray& r, interval ray_t, collision& hit) const = 0;
 
-/**
- * A class for translating collidable objects around in 3D space
- */
-class rotate : public collidable {
-    public:
         /**
-         * Creates a translated copy of an existing collidable object
-         * @param obj original object
-         * @param offset translation offset from original object
+         * Fills in the collision info for a collision recorded by intersect
+         *
+         * Primitives and instances override this. Collidables that only hold others never record collisions with
+         * themselves, so they can keep the default.
+         * @param r ray that collided, in this collidable's space
+         * @param hit collision recorded by intersect
+         * @param rec place to collect collision info
          */
-        rotate(shared_ptr<collidable> obj, vec3 axis, double degrees): obj(obj), axis(axis.normalize()), degrees(degrees) {}
-
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
-            // Transform the ray into object space
-            vec3 orig = rotate_by_axis(r.origin(), axis, -degrees);
-            vec3 dir = rotate_by_axis(r.direction(), axis, -degrees);
-
-            ray rotated_r(orig, dir, r.time());
+        virtual void compute_surface_interaction(const ray&, const collision&, collision_hit&) const {}
 
-            if (!obj->hit(rotated_r, ray_t, rec)) {
-                return false;
-            }
-
-            // Transform normal and collision point back to world space
-            rec.normal = rotate_by_axis(rec.normal, axis, degrees);
-            rec.point = rotate_by_axis(rec.point, axis, degrees);
-
-            return true;
-        }
-
-        aabb bounding_box() const { return bbox; }
-
-    private:
-        /**
-         * The object affected by this rotation
-         */
-        shared_ptr<collidable> obj;
-        
         /**
-         * The axis this rotation is based around
+         * Returns if a ray collides with this collidable object anywhere in an interval
+         *
+         * Unlike intersect, this may stop at the first collision found and computes no collision info, so it is the
+         * cheaper query for visibility tests.
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @return true if ray collides, false if ray doesn't collide
          */
-        vec3 axis;
+        virtual bool occluded(const ray& r, interval ray_t) const {
+            collision hit;
+            return intersect(r, ray_t, hit);
+        }
 
         /**
-         * The amount to rotate by in degrees
-         */
-        double degrees;
-        
-        /**
-         * The updated bounding box after being moved by this rotation
+         * Returns the bounding box of this collidable object
+         * @return bounding box
          */
-        aabb bbox;
-};
+        virtual aabb bounding_box() const = 0;
 
-/**
- * A class for scaling collidables
- */
-class scale : public collidable {
-    public:
         /**
-         * Creates a scaled version of a given collidable object
-         * @param obj object to scale
-         * @param s amount to scale by
+         * Returns the bounding box of this collidable object at a single point in time
+         *
+         * Collidables whose bounds move linearly over the shutter should override this so motion aware hierarchies
+         * can interpolate between their bounds at the start and end of the shutter.
+         * @param time time to get the bounds at, between 0 and 1
+         * @return bounding box at the given time, the whole bounding box by default
          */
-        scale(shared_ptr<collidable> obj, const vec3& s)
-            : object(obj), scale_factor(s),
-            inv_scale(1.0 / s.x(), 1.0 / s.y(), 1.0 / s.z())
-        {
-            // Scale bounding box
-            bbox = object->bounding_box();
-
-            vec3 min = vec3(bbox.x.min, bbox.y.min, bbox.z.min);
-            vec3 max = vec3(bbox.x.max, bbox.x.max, bbox.x.max);
-
-            min = vec3(min.x() * s.x(), min.y() * s.y(), min.z() * s.z());
-            max = vec3(max.x() * s.x(), max.y() * s.y(), max.z() * s.z());
-
-            bbox = aabb(min, max);
+        virtual aabb bounding_box_at(double) const {
+            return bounding_box();
         }
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
-            // Transform ray into object space
-            ray scaled_ray(
-                r.origin() * inv_scale,
-                r.direction() * inv_scale,
-                r.time()
-            );
-
-            if (!object->hit(scaled_ray, ray_t, rec))
-                return false;
-
-            // Transform hit point and normal back into world space
-            rec.point = vec3(
-                rec.point.x()*scale_factor.x(),
-                rec.point.y()*scale_factor.y(),
-                rec.point.z()*scale_factor.z()
-            );
-
-            vec3 normal = vec3(
-                rec.normal.x() * inv_scale.x(),
-                rec.normal.y() * inv_scale.y(),
-                rec.normal.z() * inv_scale.z()
-            );
-
-            rec.normal = normal.normalize();
-
-            return true;
-        }
-
-        aabb bounding_box() const override {
-            return bbox;
-        }
-
-    private:
-        /**
-         * The object this scaling affects
-         */
-        shared_ptr<collidable> object;
-
         /**
-         * The factor to scale by
+         * Returns a bounding box around the part of this collidable that lies inside a given box
+         *
+         * Used by spatial split builders to tighten the bounds of primitives split across nodes. Collidables
+         * that can do better than overlapping their bounding box with the clip box should override this.
+         * @param clip box to clip this collidable to
+         * @return bounding box of the clipped collidable, or an empty box if none of it is inside
          */
-        vec3 scale_factor;
+        virtual aabb clipped_bounding_box(const aabb& clip) const {
+            return bounding_box().intersection(clip);
+        }
 
         /**
-         * The inverse factor used to scale by
+         * Returns the pdf value associated with this collidable and the given incoming ray
+         * @param origin origin of incoming ray
+         * @param direction direction of incoming ray
+         * @return pdf value of ray
          */
-        vec3 inv_scale;
+        virtual double pdf_value(const vec3& origin, const vec3& direction) const {
+            return 0.0;
+        }
 
         /**
-         * The updated bounding box of the scaled object
+         * Returns a random direction towards this collidable
+         * @param origin point to come from
+         * @return direction to collidable
          */
-        aabb bbox;
+        virtual vec3 random(const vec3& origin) const {
+            return vec3(1, 0, 0);
+        }
 };
 
 #endif
\ No newline at end of file
@@ -49,22 +49,48 @@ class collidable_list : public collidable {
             objects.clear();
         }
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
-            collision_hit temp_rec;
+        /**
+         * Returns the collidables of this list with any nested collidable_lists expanded in place
+         * @return vector of pointers to every non-list collidable reachable from this list
+         */
+        std::vector<shared_ptr<collidable>> flatten() const {
+            std::vector<shared_ptr<collidable>> flat;
+
+            for (const auto& object : objects) {
+                auto nested = std::dynamic_pointer_cast<collidable_list>(object);
+
+                if (nested) {
+                    auto nested_flat = nested->flatten();
+                    flat.insert(flat.end(), nested_flat.begin(), nested_flat.end());
+                } else {
+                    flat.push_back(object);
+                }
+            }
+
+            return flat;
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
             bool hit_anything = false;
-            auto closest_so_far = ray_t.max;
 
             for (const auto& object : objects) {
-                if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                if (object->intersect(r, ray_t, hit)) {
                     hit_anything = true;
-                    closest_so_far = temp_rec.t;
-                    rec = temp_rec;
+                    ray_t.max = hit.t;
                 }
             }
 
             return hit_anything;
         }
 
+        bool occluded(const ray& r, interval ray_t) const override {
+            for (const auto& object : objects) {
+                if (object->occluded(r, ray_t)) return true;
+            }
+
+            return false;
+        }
+
         aabb bounding_box() const override { return bbox; }
         
         double pdf_value(const vec3& origin, const vec3& direction) const override {
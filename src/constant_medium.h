@@ -32,30 +32,30 @@ class constant_medium : public collidable {
             phase_function(make_shared<isotropic>(albedo))
         {}
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
-            collision_hit rec1, rec2;
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            collision hit1, hit2;
 
             // Get where the ray goes into the boundary, ray doesn't hit boundary means ray can't scatter
-            if (!boundary->hit(r, interval::universe, rec1))
+            if (!boundary->intersect(r, interval::universe, hit1))
                 return false;
 
             // Get where the ray leaves the boundary, ray doesn't hit boundary means ray can't scatter
-            if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
+            if (!boundary->intersect(r, interval(hit1.t+0.0001, infinity), hit2))
                 return false;
 
             // Clamp ingoing and outgoing t values to ray's t values
-            rec1.t = std::max(rec1.t, ray_t.min);
-            rec2.t = std::min(rec2.t, ray_t.max);
+            hit1.t = std::max(hit1.t, ray_t.min);
+            hit2.t = std::min(hit2.t, ray_t.max);
 
             // Ray doesn't lie within ray_t interval, ray doesn't hit
-            if (rec1.t >= rec2.t)
+            if (hit1.t >= hit2.t)
                 return false;
 
-            rec1.t = std::max(rec1.t, 0.0);
+            hit1.t = std::max(hit1.t, 0.0);
 
             // Get distance travelled in volume
             double ray_length = r.direction().mag();
-            double distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+            double distance_inside_boundary = (hit2.t - hit1.t) * ray_length;
 
             // Get a scattering distance
             double hit_distance = neg_inv_density * std::log(random_double());
@@ -64,8 +64,13 @@ class constant_medium : public collidable {
             if (hit_distance > distance_inside_boundary)
                 return false;
 
-            // Scatter point lands inside boundary, update ray collision info with new scatter point
-            rec.t = rec1.t + hit_distance / ray_length;
+            // Scatter point lands inside boundary
+            hit.record(hit1.t + hit_distance / ray_length, this);
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            rec.t = hit.t;
             rec.point = r.at(rec.t);
 
             // Normals don't matter for volume collisions/scattering
@@ -73,9 +78,7 @@ class constant_medium : public collidable {
             rec.front_face = true;
 
             // Scatter according to given function
-            rec.mat = phase_function;
-
-            return true;
+            rec.mat = phase_function.get();
         }
 
         aabb bounding_box() const override { return boundary->bounding_box(); }
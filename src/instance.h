@@ -0,0 +1,162 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "collidable.h"
+#include "affine.h"
+
+/**
+ * A class for placing a shared collidable in the world with an affine transformation
+ *
+ * The collidable, usually an acceleration structure built once in object space, can be shared by any number
+ * of instances. Building a linear_bvh over instances gives a two-level hierarchy where each mesh's hierarchy
+ * is only built once no matter how many times it is placed.
+ */
+class instance : public collidable {
+    public:
+        /**
+         * Creates an instance of a collidable
+         * @param obj collidable to place, in its own object space
+         * @param object_to_world transformation from the collidable's object space to world space
+         */
+        instance(shared_ptr<collidable> obj, const affine& object_to_world) : obj(obj), object_to_world(object_to_world) {
+            // Fold an instance of an instance into one, so a chain of transformations costs a single matrix per ray
+            auto inner = std::dynamic_pointer_cast<instance>(obj);
+
+            if (inner) {
+                this->obj = inner->obj;
+                this->object_to_world = object_to_world * inner->object_to_world;
+            }
+
+            world_to_object = this->object_to_world.inverse();
+            bbox = this->object_to_world.bounding_box(this->obj->bounding_box());
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (!obj->intersect(to_object(r), ray_t, hit)) return false;
+
+            // The collision just recorded was found through this instance
+            hit.add_instance(this);
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            // Hand the collision to the next instance in, or to the primitive once there are none left
+            int level = hit.instance_count - 1;
+            while (level > 0 && hit.instances[level] != this) level--;
+            const collidable* inner = level > 0 ? hit.instances[level - 1] : hit.object;
+
+            inner->compute_surface_interaction(to_object(r), hit, rec);
+
+            // Transform the collision point and normal back to world space
+            rec.point = object_to_world.point(rec.point);
+            rec.normal = world_to_object.transpose_vector(rec.normal).normalize();
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            return obj->occluded(to_object(r), ray_t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        aabb bounding_box_at(double time) const override {
+            return object_to_world.bounding_box(obj->bounding_box_at(time));
+        }
+
+        /**
+         * Returns the collidable placed by this instance, never itself an instance
+         * @return placed collidable, in its own object space
+         */
+        shared_ptr<collidable> get_object() const { return obj; }
+
+        /**
+         * Returns the transformation from this instance's object space to world space
+         * @return object to world transformation
+         */
+        const affine& get_transform() const { return object_to_world; }
+
+        /**
+         * Moves this instance to a new place, any hierarchy holding it must be refit afterwards
+         * @param transform new transformation from the placed collidable's object space to world space
+         */
+        void set_transform(const affine& transform) {
+            object_to_world = transform;
+            world_to_object = transform.inverse();
+            bbox = object_to_world.bounding_box(obj->bounding_box());
+        }
+
+    private:
+        /**
+         * The collidable placed by this instance
+         */
+        shared_ptr<collidable> obj;
+
+        /**
+         * The transformation from object space to world space
+         */
+        affine object_to_world;
+
+        /**
+         * The transformation from world space to object space
+         */
+        affine world_to_object;
+
+        /**
+         * The bounding box of the transformed collidable
+         */
+        aabb bbox;
+
+        /**
+         * Transforms a ray into object space, leaving its direction unnormalized so t values carry over
+         * @param r ray in world space
+         * @return ray in object space
+         */
+        ray to_object(const ray& r) const {
+            return ray(
+                world_to_object.point(r.origin()),
+                world_to_object.vector(r.direction()),
+                r.time()
+            );
+        }
+};
+
+/**
+ * A class for translating collidable objects around in 3D space
+ */
+class translate : public instance {
+    public:
+        /**
+         * Creates a translated copy of an existing collidable object
+         * @param obj original object
+         * @param offset translation offset from original object
+         */
+        translate(shared_ptr<collidable> obj, const vec3& offset) : instance(obj, affine::translation(offset)) {}
+};
+
+/**
+ * A class for rotating collidable objects around an axis through the origin
+ */
+class rotate : public instance {
+    public:
+        /**
+         * Creates a rotated copy of an existing collidable object
+         * @param obj original object
+         * @param axis axis to rotate around
+         * @param degrees amount to rotate by in degrees
+         */
+        rotate(shared_ptr<collidable> obj, const vec3& axis, double degrees) : instance(obj, affine::rotation(axis, degrees)) {}
+};
+
+/**
+ * A class for scaling collidables
+ */
+class scale : public instance {
+    public:
+        /**
+         * Creates a scaled version of a given collidable object
+         * @param obj object to scale
+         * @param s amount to scale each axis by
+         */
+        scale(shared_ptr<collidable> obj, const vec3& s) : instance(obj, affine::scaling(s)) {}
+};
+
+#endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "aabb.h"
 #include "collidable_list.h"
+#include "sah.h"
+#include "bvh_stats.h"
 
 #include <vector>
 #include <algorithm>
@@ -13,18 +15,20 @@
 class kd_tree : public collidable {
     public:
         /**
-         * Creates a kd_tree from a given collidable_list
+         * Creates a kd_tree from a given collidable_list, expanding any nested collidable_lists
          * @param list collidable_list to turn into a kd_tree
+         * @param config settings used to choose how the tree is split
          */
-        kd_tree(collidable_list list) : kd_tree(list.objects, 0, list.objects.size()) {}
+        kd_tree(collidable_list list, bvh_config config = bvh_config()) : kd_tree(list.flatten(), config) {}
 
         /**
          * Recursively creates a kd_tree from a given collidable_list and range
          * @param objects vector of collidable pointers
          * @param start lower bound of vector to use
          * @param end upper bound of vector to use
+         * @param config settings used to choose how the tree is split
          */
-        kd_tree(std::vector<shared_ptr<collidable>>& objects, size_t start, size_t end) {
+        kd_tree(std::vector<shared_ptr<collidable>>& objects, size_t start, size_t end, bvh_config config = bvh_config()) {
             bbox = aabb::empty;
 
             for (size_t idx = start; idx < end; idx++) {
@@ -32,6 +36,7 @@ class kd_tree : public collidable {
             }
             
             int axis = bbox.longest_axis();
+            split_axis = axis;
 
             auto comp = (axis == 1) ? aabb_comp_y : (axis == 2) ? aabb_comp_z : aabb_comp_x;
 
@@ -39,29 +44,79 @@ class kd_tree : public collidable {
 
             if (range == 1) {
                 left = right = objects[start];
+                cost = leaf_intersect_cost(config, 1);
             } else if (range == 2) {
+                // Keep the lower object on the left so traversal can order the pair by direction
+                if (comp(objects[start+1], objects[start])) std::swap(objects[start], objects[start+1]);
                 left = objects[start];
                 right = objects[start+1];
+                cost = split_cost(leaf_intersect_cost(config, 1), leaf_intersect_cost(config, 1), config);
+            } else if (config.method == split_sah) {
+                sah_split split = find_sah_split(
+                    objects, start, end,
+                    [](const shared_ptr<collidable>& object) { return object->bounding_box(); },
+                    config
+                );
+
+                if (split.make_leaf) {
+                    // Keep the remaining objects together in a single leaf
+                    auto leaf = make_shared<collidable_list>();
+                    for (size_t idx = start; idx < end; idx++) {
+                        leaf->add(objects[idx]);
+                    }
+                    left = right = leaf;
+                    cost = leaf_intersect_cost(config, range);
+                } else {
+                    auto left_tree = make_shared<kd_tree>(objects, start, split.mid, config);
+                    auto right_tree = make_shared<kd_tree>(objects, split.mid, end, config);
+                    left = left_tree;
+                    right = right_tree;
+                    split_axis = split.axis;
+                    cost = split_cost(left_tree->sah_cost(), right_tree->sah_cost(), config);
+                }
             } else {
                 std::sort(std::begin(objects) + start, std::begin(objects) + end, comp);
 
                 int mid = start + range/2;
 
-                left = make_shared<kd_tree>(objects, start, mid);
-                right = make_shared<kd_tree>(objects, mid, end);
+                auto left_tree = make_shared<kd_tree>(objects, start, mid, config);
+                auto right_tree = make_shared<kd_tree>(objects, mid, end, config);
+                left = left_tree;
+                right = right_tree;
+                cost = split_cost(left_tree->sah_cost(), right_tree->sah_cost(), config);
             }
 
             bbox = aabb(left->bounding_box(), right->bounding_box());
+            left_tree = dynamic_cast<const kd_tree*>(left.get());
+            right_tree = dynamic_cast<const kd_tree*>(right.get());
         }
         
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
             if (!bbox.hit(r, ray_t)) return false;
 
-            // If we are hit, search deeper down the tree
-            bool hit_left = left->hit(r, ray_t, rec);
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+            return hit_children(r, ray_t, hit);
+        }
 
-            return hit_left || hit_right;
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (!bbox.hit(r, ray_t)) return false;
+
+            return occluded_children(r, ray_t);
+        }
+
+        /**
+         * Returns the surface area heuristic cost of this tree, the expected cost of tracing a ray through it
+         * @return SAH cost in units of the build config's traversal and intersection costs
+         */
+        double sah_cost() const { return cost; }
+
+        /**
+         * Returns statistics describing the shape and quality of this tree
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            collect_stats(stats, 0);
+            return stats;
         }
 
         aabb bounding_box() const override { return bbox; }
@@ -77,11 +132,158 @@ class kd_tree : public collidable {
          */
         shared_ptr<collidable> right;
 
+        /**
+         * The left node as a kd_tree, or nullptr if it is a leaf
+         */
+        const kd_tree* left_tree = nullptr;
+
+        /**
+         * The right node as a kd_tree, or nullptr if it is a leaf
+         */
+        const kd_tree* right_tree = nullptr;
+
+        /**
+         * The axis the left and right nodes were split along, the left node lies lower along it
+         */
+        int split_axis = 0;
+
         /**
          * The bounding box surrounding all collidables in this tree
          */
         aabb bbox;
 
+        /**
+         * The surface area heuristic cost of this tree
+         */
+        double cost;
+
+        /**
+         * Creates a kd_tree from a vector of collidables
+         * @param objects vector of collidable pointers
+         * @param config settings used to choose how the tree is split
+         */
+        kd_tree(std::vector<shared_ptr<collidable>> objects, bvh_config config) : kd_tree(objects, 0, objects.size(), config) {}
+
+        /**
+         * Finds the closest hit among this tree's nodes, visiting the node nearer the ray's origin first
+         *
+         * A hit in the near node shrinks the interval the far node is tested against, so the far node is skipped
+         * whenever the ray only enters its bounding box beyond the closest hit so far.
+         * @param r ray to check
+         * @param ray_t interval of ray to check, already known to overlap this tree's bounding box
+         * @param hit record of the closest collision so far
+         * @return true if any node was hit, false otherwise
+         */
+        bool hit_children(const ray& r, interval ray_t, collision& hit) const {
+            if (left == right) return left->intersect(r, ray_t, hit);
+
+            bool reversed = r.direction()[split_axis] < 0;
+
+            bool hit_near = reversed ? hit_child(right.get(), right_tree, r, ray_t, hit)
+                                     : hit_child(left.get(), left_tree, r, ray_t, hit);
+            if (hit_near) ray_t.max = hit.t;
+
+            bool hit_far = reversed ? hit_child(left.get(), left_tree, r, ray_t, hit)
+                                    : hit_child(right.get(), right_tree, r, ray_t, hit);
+
+            return hit_near || hit_far;
+        }
+
+        /**
+         * Finds the closest hit in one of this tree's nodes
+         * @param child node to check
+         * @param tree the node as a kd_tree, or nullptr if it is a leaf
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param hit record of the closest collision so far
+         * @return true if the node was hit, false otherwise
+         */
+        static bool hit_child(const collidable* child, const kd_tree* tree, const ray& r, const interval& ray_t, collision& hit) {
+            if (!tree) return child->intersect(r, ray_t, hit);
+
+            // Calls the subtree directly rather than through the virtual intersect
+            if (!tree->bbox.hit(r, ray_t)) return false;
+            return tree->hit_children(r, ray_t, hit);
+        }
+
+        /**
+         * Returns whether any of this tree's nodes block a ray
+         *
+         * Any hit ends the search, so the nodes are visited in build order rather than sorted along the ray.
+         * @param r ray to check
+         * @param ray_t interval of ray to check, already known to overlap this tree's bounding box
+         * @return true if any node was hit, false otherwise
+         */
+        bool occluded_children(const ray& r, const interval& ray_t) const {
+            if (left == right) return left->occluded(r, ray_t);
+
+            return occluded_child(left.get(), left_tree, r, ray_t) || occluded_child(right.get(), right_tree, r, ray_t);
+        }
+
+        /**
+         * Returns whether one of this tree's nodes blocks a ray
+         * @param child node to check
+         * @param tree the node as a kd_tree, or nullptr if it is a leaf
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @return true if the node was hit, false otherwise
+         */
+        static bool occluded_child(const collidable* child, const kd_tree* tree, const ray& r, const interval& ray_t) {
+            if (!tree) return child->occluded(r, ray_t);
+
+            if (!tree->bbox.hit(r, ray_t)) return false;
+            return tree->occluded_children(r, ray_t);
+        }
+
+        /**
+         * Recursively adds this subtree to a set of statistics
+         * @param stats statistics to add to
+         * @param depth depth of this subtree's root
+         */
+        void collect_stats(bvh_stats& stats, int depth) const {
+            stats.memory_bytes += sizeof(kd_tree);
+
+            // A node whose children are the same object is a leaf
+            if (left == right) {
+                auto leaf = std::dynamic_pointer_cast<collidable_list>(left);
+
+                if (leaf) {
+                    stats.memory_bytes += sizeof(collidable_list) + leaf->objects.capacity() * sizeof(shared_ptr<collidable>);
+                }
+
+                stats.add_leaf(depth, bbox, leaf ? leaf->objects.size() : 1);
+                return;
+            }
+
+            aabb children[2] = {left->bounding_box(), right->bounding_box()};
+            stats.add_interior(depth, bbox, children, 2);
+
+            for (const auto& child : {left, right}) {
+                auto tree = dynamic_cast<const kd_tree*>(child.get());
+
+                if (tree) {
+                    tree->collect_stats(stats, depth + 1);
+                } else {
+                    stats.add_leaf(depth + 1, child->bounding_box(), 1);
+                }
+            }
+        }
+
+        /**
+         * Returns the surface area heuristic cost of splitting this tree into its left and right nodes
+         * @param left_cost cost of the left node
+         * @param right_cost cost of the right node
+         * @param config settings holding the traversal cost
+         * @return SAH cost of this tree
+         */
+        double split_cost(double left_cost, double right_cost, const bvh_config& config) const {
+            double area = aabb(left->bounding_box(), right->bounding_box()).surface_area();
+            if (area <= 0) return config.traversal_cost + left_cost + right_cost;
+
+            return config.traversal_cost +
+                (left->bounding_box().surface_area() * left_cost + right->bounding_box().surface_area() * right_cost) / area;
+        }
+
         /**
          * Compares the length of two collidables' bounding boxes along either the x, y, or z axis
          * @param a pointer to collidable to compare
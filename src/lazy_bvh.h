@@ -0,0 +1,290 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "collidable_list.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+/**
+ * A bounding volume hierarchy that splits each node the first time a ray reaches it
+ *
+ * Creating one only measures the bounds of its primitives, so rendering can start right away and subtrees no ray
+ * reaches are never built. Nodes are split at most once under std::call_once, so any number of render threads can
+ * traverse and grow the tree at the same time. Splitting a node only reorders its own range of primitives, which
+ * no other node's split touches.
+ */
+class lazy_bvh : public collidable {
+    public:
+        /**
+         * Creates a lazy_bvh from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the hierarchy over
+         * @param config settings used to choose how nodes are split
+         */
+        lazy_bvh(const collidable_list& list, bvh_config config = default_config()) : config(config) {
+            objects = list.flatten();
+            this->config.max_leaf_size = std::clamp(config.max_leaf_size, 1, 255);
+
+            primitives.reserve(objects.size());
+            for (size_t i = 0; i < objects.size(); i++) {
+                primitives.emplace_back(objects[i]->bounding_box(), i);
+            }
+
+            if (!primitives.empty()) {
+                root = make_node(0, primitives.size(), 0);
+            }
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (!root) return false;
+
+            return traverse_closest(lazy_tree(*this, r), ray_t, [&](lazy_bvh_node* node, interval& leaf_t) {
+                bool hit_leaf = false;
+
+                for (size_t i = node->start; i < node->end; i++) {
+                    if (objects[primitives[i].index]->intersect(r, leaf_t, hit)) {
+                        hit_leaf = true;
+                        leaf_t.max = hit.t;
+                    }
+                }
+
+                return hit_leaf;
+            });
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (!root) return false;
+
+            return traverse_any(lazy_tree(*this, r), ray_t, [&](lazy_bvh_node* node) {
+                for (size_t i = node->start; i < node->end; i++) {
+                    if (objects[primitives[i].index]->occluded(r, ray_t)) return true;
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return root ? root->bbox : aabb::empty; }
+
+        /**
+         * Returns the number of nodes that have been split or made into leaves so far
+         * @return expanded node count
+         */
+        size_t get_expanded_count() const { return expanded_count.load(std::memory_order_relaxed); }
+
+        /**
+         * Returns the default settings used to build a lazy_bvh
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * A node of a lazy_bvh, whose children are only made once a ray reaches it
+         */
+        struct lazy_bvh_node {
+            aabb bbox;                                      // bounding box around the node's primitives
+            size_t start = 0;                               // offset of the node's first primitive
+            size_t end = 0;                                 // offset one past the node's last primitive
+            int depth = 0;                                  // depth of the node, the root is at depth 0
+            bool leaf = false;                              // whether the node was kept as a leaf when expanded
+            std::unique_ptr<lazy_bvh_node> children[2];     // child nodes, null until expanded and for leaves
+            std::once_flag expanded;                        // guards the one time the node is split
+            std::atomic<bool> ready{false};                 // set once the node has been split
+
+            /**
+             * Returns whether this node is a leaf, only valid once it has been expanded
+             * @return true if this node holds primitives, false if it has children
+             */
+            bool is_leaf() const { return leaf; }
+        };
+
+        /**
+         * The hierarchy as seen by one ray, for the shared traversals, expanding nodes as the ray reaches them
+         */
+        struct lazy_tree {
+            using node_type = lazy_bvh_node*;
+
+            const lazy_bvh& bvh;    // hierarchy being traversed
+            vec3 origin;            // origin of the ray
+            vec3 inv_dir;           // component-wise inverse of the ray's direction
+
+            lazy_tree(const lazy_bvh& bvh, const ray& r) :
+                bvh(bvh),
+                origin(r.origin()),
+                inv_dir(1.0 / r.direction()[0], 1.0 / r.direction()[1], 1.0 / r.direction()[2]) {}
+
+            node_type root() const { return bvh.root.get(); }
+
+            bool hit(node_type node, const interval& ray_t, double& t_enter) const {
+                return box_hit(node->bbox, origin, inv_dir, ray_t, t_enter);
+            }
+
+            bool is_leaf(node_type node) const {
+                bvh.expand(*node);
+                return node->is_leaf();
+            }
+
+            node_type child(node_type node, int i) const { return node->children[i].get(); }
+        };
+
+        /**
+         * The settings used to split nodes
+         */
+        bvh_config config;
+
+        /**
+         * The collidables this hierarchy was built over
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The bounds of every collidable, reordered so each node's primitives are contiguous as nodes are split
+         */
+        mutable std::vector<bvh_primitive> primitives;
+
+        /**
+         * The root of the hierarchy
+         */
+        std::unique_ptr<lazy_bvh_node> root;
+
+        /**
+         * The number of nodes expanded so far
+         */
+        mutable std::atomic<size_t> expanded_count{0};
+
+        /**
+         * Depth after which SAH splits give way to median splits so the tree stays shallow enough to traverse
+         */
+        static const int max_sah_depth = 64;
+
+        /**
+         * Creates an unexpanded node over a range of primitives
+         * @param start lower bound of range
+         * @param end upper bound of range
+         * @param depth depth of the node
+         * @return the new node
+         */
+        std::unique_ptr<lazy_bvh_node> make_node(size_t start, size_t end, int depth) const {
+            auto node = std::make_unique<lazy_bvh_node>();
+            node->start = start;
+            node->end = end;
+            node->depth = depth;
+            node->bbox = aabb::empty;
+
+            for (size_t i = start; i < end; i++) {
+                node->bbox = aabb(node->bbox, primitives[i].bbox);
+            }
+
+            return node;
+        }
+
+        /**
+         * Splits a node into two children or keeps it as a leaf, unless another ray already has
+         * @param node node to expand
+         */
+        void expand(lazy_bvh_node& node) const {
+            // Skip the call_once bookkeeping once the node is known to be expanded
+            if (node.ready.load(std::memory_order_acquire)) return;
+
+            std::call_once(node.expanded, [&] {
+                split(node);
+                node.ready.store(true, std::memory_order_release);
+            });
+        }
+
+        /**
+         * Splits a node's primitives between two new children, or marks the node as a leaf
+         * @param node node to split
+         */
+        void split(lazy_bvh_node& node) const {
+            expanded_count.fetch_add(1, std::memory_order_relaxed);
+
+            size_t n = node.end - node.start;
+            if (n <= size_t(config.max_leaf_size)) {
+                node.leaf = true;
+                return;
+            }
+
+            size_t mid;
+
+            if (config.method == split_sah && node.depth < max_sah_depth) {
+                sah_split result = find_sah_split(
+                    primitives, node.start, node.end,
+                    [](const bvh_primitive& p) { return p.bbox; },
+                    config
+                );
+
+                if (result.make_leaf && n <= 255) {
+                    node.leaf = true;
+                    return;
+                }
+
+                mid = result.make_leaf ? median_split(node) : result.mid;
+            } else {
+                mid = median_split(node);
+            }
+
+            node.children[0] = make_node(node.start, mid, node.depth + 1);
+            node.children[1] = make_node(mid, node.end, node.depth + 1);
+        }
+
+        /**
+         * Partitions a node's primitives around the median centroid along the node's longest axis
+         * @param node node to partition
+         * @return index the range was partitioned at
+         */
+        size_t median_split(const lazy_bvh_node& node) const {
+            aabb centroid_bounds = aabb::empty;
+            for (size_t i = node.start; i < node.end; i++) {
+                centroid_bounds = aabb(centroid_bounds, aabb(primitives[i].centroid, primitives[i].centroid));
+            }
+
+            int axis = centroid_bounds.longest_axis();
+            size_t mid = node.start + (node.end - node.start) / 2;
+
+            std::nth_element(primitives.begin() + node.start, primitives.begin() + mid, primitives.begin() + node.end,
+                [axis](const bvh_primitive& a, const bvh_primitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+            return mid;
+        }
+
+        /**
+         * Returns whether a ray hits a bounding box
+         * @param box bounding box to test
+         * @param origin origin of the ray
+         * @param inv_dir component-wise inverse of the ray's direction
+         * @param ray_t interval of ray to check
+         * @param t_enter distance along the ray where it enters the box
+         * @return true if the ray hits the box inside of ray_t, false otherwise
+         */
+        static bool box_hit(const aabb& box, const vec3& origin, const vec3& inv_dir, const interval& ray_t, double& t_enter) {
+            double t_min = ray_t.min;
+            double t_max = ray_t.max;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = box.axis_interval(axis);
+                double t0 = (ax.min - origin[axis]) * inv_dir[axis];
+                double t1 = (ax.max - origin[axis]) * inv_dir[axis];
+
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > t_min) t_min = t0;
+                if (t1 < t_max) t_max = t1;
+
+                if (t_max < t_min) return false;
+            }
+
+            t_enter = t_min;
+            return true;
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,383 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "collidable_list.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+#include "bvh_stats.h"
+
+#include <vector>
+
+/**
+ * A bounding volume hierarchy stored as one contiguous array of nodes and traversed without recursion
+ */
+class linear_bvh : public collidable {
+    public:
+        /**
+         * Creates a linear_bvh from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the hierarchy over
+         * @param config settings used to choose how the hierarchy is split
+         */
+        linear_bvh(const collidable_list& list, bvh_config config = default_config()) : config(config) {
+            objects = list.flatten();
+            build();
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            return traverse_closest(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index, interval& leaf_t) {
+                const linear_bvh_node& node = nodes[index];
+                bool hit_leaf = false;
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (primitives[i]->intersect(r, leaf_t, hit)) {
+                        hit_leaf = true;
+                        leaf_t.max = hit.t;
+                    }
+                }
+
+                return hit_leaf;
+            });
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            return traverse_any(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index) {
+                const linear_bvh_node& node = nodes[index];
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (primitives[i]->occluded(r, ray_t)) return true;
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Recomputes the bounds of every node from the current bounds of its collidables, keeping the tree's shape
+         */
+        void refit() {
+            if (nodes.empty()) return;
+
+            // Children are always stored after their parent, so walking backwards refits children before parents
+            for (size_t i = nodes.size(); i-- > 0;) {
+                nodes[i].set_bounds(node_bounds(nodes[i]));
+            }
+
+            bbox = nodes[0].bounding_box();
+            area_cost = compute_area_cost();
+        }
+
+        /**
+         * Recomputes the bounds of only the nodes above collidables that have moved, keeping the tree's shape
+         *
+         * Each changed collidable's leaves are refit and the change is carried upwards until a node's bounds stay
+         * the same, so the work done is proportional to how much of the tree actually changed.
+         * @param changed indices of the moved collidables, in the order the list this was built from flattens to
+         */
+        void refit(const std::vector<size_t>& changed) {
+            if (nodes.empty()) return;
+
+            for (size_t index : changed) {
+                for (uint32_t i = object_leaf_offsets[index]; i < object_leaf_offsets[index + 1]; i++) {
+                    uint32_t node = object_leaves[i];
+
+                    while (true) {
+                        linear_bvh_node refit_node = nodes[node];
+                        refit_node.set_bounds(node_bounds(refit_node));
+
+                        if (same_bounds(refit_node, nodes[node])) break;
+
+                        double weight = node_weight(nodes[node]);
+                        area_cost += weight * (refit_node.bounding_box().surface_area() - nodes[node].bounding_box().surface_area());
+                        nodes[node] = refit_node;
+
+                        if (node == 0) break;
+                        node = parents[node];
+                    }
+                }
+            }
+
+            bbox = nodes[0].bounding_box();
+        }
+
+        /**
+         * Refits the nodes above collidables that have moved, then rebuilds the whole tree if refitting has made
+         * it too costly to trace compared to when it was built
+         * @param changed indices of the moved collidables, in the order the list this was built from flattens to
+         * @return true if the tree was rebuilt, false if it was only refit
+         */
+        bool update(const std::vector<size_t>& changed) {
+            refit(changed);
+
+            if (sah_cost() <= config.rebuild_cost_ratio * built_cost) return false;
+
+            rebuild();
+            return true;
+        }
+
+        /**
+         * Rebuilds this hierarchy from scratch over the current bounds of its collidables
+         */
+        void rebuild() {
+            build();
+        }
+
+        /**
+         * Returns the surface area heuristic cost of this hierarchy, the expected cost of tracing a ray through it
+         * @return SAH cost in units of the build config's traversal and intersection costs
+         */
+        double sah_cost() const {
+            double area = nodes.empty() ? 0 : nodes[0].bounding_box().surface_area();
+            return area > 0 ? area_cost / area : 0;
+        }
+
+        /**
+         * Returns statistics describing the shape and quality of this hierarchy
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(linear_bvh_node) +
+                primitives.capacity() * sizeof(const collidable*) +
+                objects.capacity() * sizeof(shared_ptr<collidable>) +
+                (parents.capacity() + object_leaf_offsets.capacity() + object_leaves.capacity()) * sizeof(uint32_t);
+
+            if (nodes.empty()) return stats;
+
+            std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+
+            while (!stack.empty()) {
+                auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                const linear_bvh_node& node = nodes[index];
+
+                if (node.is_leaf()) {
+                    stats.add_leaf(depth, node.bounding_box(), node.count);
+                    continue;
+                }
+
+                aabb children[2] = {nodes[node.offset].bounding_box(), nodes[node.offset + 1].bounding_box()};
+                stats.add_interior(depth, node.bounding_box(), children, 2);
+
+                stack.push_back({node.offset + 1, depth + 1});
+                stack.push_back({node.offset, depth + 1});
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the surface area heuristic cost of this hierarchy when it was last built, before any refits
+         * @return SAH cost in units of the build config's traversal and intersection costs
+         */
+        double built_sah_cost() const { return built_cost; }
+
+        /**
+         * Returns the flattened nodes of this hierarchy, the root is at index 0
+         * @return vector of nodes
+         */
+        const std::vector<linear_bvh_node>& get_nodes() const { return nodes; }
+
+        /**
+         * Returns the primitives of this hierarchy in the order its leaves reference them
+         * @return vector of primitive pointers
+         */
+        const std::vector<const collidable*>& get_primitives() const { return primitives; }
+
+        /**
+         * Returns the settings this hierarchy was built with
+         * @return build config
+         */
+        const bvh_config& get_config() const { return config; }
+
+        /**
+         * Returns the default settings used to build a linear_bvh
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * The collidables this hierarchy was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The primitives of this hierarchy, stored contiguously per leaf
+         */
+        std::vector<const collidable*> primitives;
+
+        /**
+         * The flattened nodes of this hierarchy
+         */
+        std::vector<linear_bvh_node> nodes;
+
+        /**
+         * The settings this hierarchy was built with
+         */
+        bvh_config config;
+
+        /**
+         * The bounding box surrounding all collidables in this hierarchy
+         */
+        aabb bbox;
+
+        /**
+         * The index of every node's parent, the root is its own parent
+         */
+        std::vector<uint32_t> parents;
+
+        /**
+         * Where each collidable's leaves start in object_leaves, with one extra entry marking the end
+         */
+        std::vector<uint32_t> object_leaf_offsets;
+
+        /**
+         * The leaves holding each collidable, grouped by collidable
+         */
+        std::vector<uint32_t> object_leaves;
+
+        /**
+         * The surface area heuristic cost of this hierarchy scaled by the area of its root, kept up to date by refits
+         */
+        double area_cost = 0;
+
+        /**
+         * The surface area heuristic cost of this hierarchy when it was last built
+         */
+        double built_cost = 0;
+
+        /**
+         * Builds the hierarchy over the collidables along with the links needed to refit it
+         */
+        void build() {
+            nodes.clear();
+            primitives.clear();
+            parents.clear();
+            object_leaf_offsets.clear();
+            object_leaves.clear();
+            bbox = aabb();
+            area_cost = built_cost = 0;
+
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(objects.size());
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                build_primitives.emplace_back(objects[i]->bounding_box(), i);
+            }
+
+            // Spatial splits clip primitives to the parts of space they are split into
+            bvh_builder builder(config, [this](size_t index, const aabb& clip) {
+                return objects[index]->clipped_bounding_box(clip);
+            });
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            if (!root) return;
+
+            bbox = root->bbox;
+            builder.flatten(*root, nodes);
+
+            // Store the primitives in the order the leaves reference them
+            primitives.reserve(ordered.size());
+            for (size_t index : ordered) {
+                primitives.push_back(objects[index].get());
+            }
+
+            // Link every node to its parent and every collidable to the leaves holding it
+            parents.assign(nodes.size(), 0);
+            object_leaf_offsets.assign(objects.size() + 1, 0);
+            object_leaves.resize(ordered.size());
+
+            for (uint32_t i = 0; i < nodes.size(); i++) {
+                if (!nodes[i].is_leaf()) {
+                    parents[nodes[i].offset] = parents[nodes[i].offset + 1] = i;
+                    continue;
+                }
+
+                for (uint32_t p = nodes[i].offset; p < nodes[i].offset + nodes[i].count; p++) {
+                    object_leaf_offsets[ordered[p] + 1]++;
+                }
+            }
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                object_leaf_offsets[i + 1] += object_leaf_offsets[i];
+            }
+
+            std::vector<uint32_t> next(object_leaf_offsets.begin(), object_leaf_offsets.end() - 1);
+            for (uint32_t i = 0; i < nodes.size(); i++) {
+                if (!nodes[i].is_leaf()) continue;
+
+                for (uint32_t p = nodes[i].offset; p < nodes[i].offset + nodes[i].count; p++) {
+                    object_leaves[next[ordered[p]]++] = i;
+                }
+            }
+
+            area_cost = compute_area_cost();
+            built_cost = sah_cost();
+        }
+
+        /**
+         * Returns the bounds a node should have from the current bounds of its children or collidables
+         * @param node node to bound
+         * @return bounding box of the node's contents
+         */
+        aabb node_bounds(const linear_bvh_node& node) const {
+            if (!node.is_leaf()) {
+                return aabb(nodes[node.offset].bounding_box(), nodes[node.offset + 1].bounding_box());
+            }
+
+            aabb box = aabb::empty;
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                box = aabb(box, primitives[i]->bounding_box());
+            }
+            return box;
+        }
+
+        /**
+         * Returns how much a node's surface area counts towards the surface area heuristic cost
+         * @param node node to weigh
+         * @return cost of visiting the node if a ray hits it
+         */
+        double node_weight(const linear_bvh_node& node) const {
+            return node.is_leaf() ? leaf_intersect_cost(config, node.count) : config.traversal_cost;
+        }
+
+        /**
+         * Returns the surface area heuristic cost of this hierarchy scaled by the area of its root
+         * @return sum of every node's weight times its surface area
+         */
+        double compute_area_cost() const {
+            double total = 0;
+            for (const auto& node : nodes) {
+                total += node_weight(node) * node.bounding_box().surface_area();
+            }
+            return total;
+        }
+
+        /**
+         * Returns whether two nodes have the same bounds
+         * @param a node to compare
+         * @param b node to compare
+         * @return true if every bound matches, false otherwise
+         */
+        static bool same_bounds(const linear_bvh_node& a, const linear_bvh_node& b) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (a.bounds_min[axis] != b.bounds_min[axis] || a.bounds_max[axis] != b.bounds_max[axis]) return false;
+            }
+            return true;
+        }
+};
+
+#endif
\ No newline at end of file
@@ -1,8 +1,20 @@
 #include "camera.h"
 #include "collidable_list.h"
 #include "kd_tree.h"
+#include "spatial_kd_tree.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "quantized_bvh.h"
+#include "motion_bvh.h"
+#include "lazy_bvh.h"
+#include "packed_scene.h"
+#include "uniform_grid.h"
+#include "accelerator.h"
+#include "scene_compiler.h"
+#include "instance.h"
 #include "texture.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "quad.h"
 #include "triangle.h"
 #include "obj_parser.h"
@@ -10,6 +22,77 @@
 
 #include <chrono>
 
+/**
+ * Whether demos print statistics about the acceleration structures they build, set by --stats
+ */
+bool show_stats = false;
+
+/**
+ * Whether demos build their hierarchies lazily as rays reach them, set by --lazy
+ */
+bool lazy_build = false;
+
+/**
+ * Whether demos pack their primitives into arrays by type under a single hierarchy, set by --packed
+ */
+bool packed_build = false;
+
+/**
+ * Builds a linear_bvh over the given list using the surface area heuristic and logs the cost of the resulting hierarchy
+ *
+ * With --lazy a lazy_bvh is returned instead, which splits nodes as rays first reach them. With --packed a
+ * packed_scene is returned instead, which stores spheres, quads and triangles in arrays by type.
+ * @param list collidables to build the hierarchy over
+ * @return pointer to the built hierarchy
+ */
+shared_ptr<collidable> build_bvh(const collidable_list& list)
+{
+    if (lazy_build)
+    {
+        std::clog << "Lazy BVH over " << list.flatten().size() << " collidables" << std::endl;
+        return make_shared<lazy_bvh>(list);
+    }
+
+    if (packed_build)
+    {
+        auto scene = make_shared<packed_scene>(list);
+        std::clog << "Packed " << scene->get_primitive_count(primitive_sphere) << " spheres, "
+                  << scene->get_primitive_count(primitive_quad) << " quads, "
+                  << scene->get_primitive_count(primitive_triangle) << " triangles and "
+                  << scene->get_primitive_count(primitive_other) << " other collidables" << std::endl;
+
+        if (show_stats)
+            scene->stats().print(std::clog, "Packed BVH");
+
+        return scene;
+    }
+
+    auto bvh = make_shared<linear_bvh>(list);
+    std::clog << "BVH SAH cost: " << bvh->sah_cost() << std::endl;
+
+    if (show_stats)
+        bvh->stats().print(std::clog, "BVH");
+
+    return bvh;
+}
+
+/**
+ * Builds either a uniform_grid or a bounding volume hierarchy over the given list, whichever suits its primitives
+ * @param list collidables to build the acceleration structure over
+ * @return pointer to the built acceleration structure
+ */
+shared_ptr<collidable> build_accelerator(const collidable_list& list)
+{
+    if (choose_accelerator(list) == accelerator_bvh)
+        return build_bvh(list);
+
+    auto grid = make_shared<uniform_grid>(list);
+    std::clog << "Grid resolution: " << grid->get_resolution(0) << "x" << grid->get_resolution(1) << "x"
+              << grid->get_resolution(2) << ", " << grid->get_outlier_count() << " outliers" << std::endl;
+
+    return grid;
+}
+
 void bouncing_spheres()
 {
     collidable_list world;
@@ -20,6 +103,21 @@ void bouncing_spheres()
     auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
     world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
 
+    // The small spheres are packed into one sphere_set, with each sphere indexing its own material
+    std::vector<vec3> centers, end_centers;
+    std::vector<double> radii;
+    std::vector<uint32_t> material_ids;
+    std::vector<shared_ptr<material>> materials;
+
+    auto add_sphere = [&](const vec3& center1, const vec3& center2, double radius, shared_ptr<material> mat)
+    {
+        centers.push_back(center1);
+        end_centers.push_back(center2);
+        radii.push_back(radius);
+        material_ids.push_back(uint32_t(materials.size()));
+        materials.push_back(mat);
+    };
+
     for (int a = -11; a < 11; a++)
     {
         for (int b = -11; b < 11; b++)
@@ -37,7 +135,7 @@ void bouncing_spheres()
                     auto albedo = randvec3() * randvec3();
                     sphere_material = make_shared<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0, 0.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    add_sphere(center, center2, 0.2, sphere_material);
                 }
                 else if (choose_mat < 0.95)
                 {
@@ -45,13 +143,13 @@ void bouncing_spheres()
                     auto albedo = randvec3(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
                     sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    add_sphere(center, center, 0.2, sphere_material);
                 }
                 else
                 {
                     // glass
                     sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    add_sphere(center, center, 0.2, sphere_material);
                 }
             }
         }
@@ -61,9 +159,11 @@ void bouncing_spheres()
     auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
 
-    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
-    world.add(make_shared<sphere>(vec3(-4, 1, 0), 1.0, material3));
-    world.add(make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+    add_sphere(vec3(0, 1, 0), vec3(0, 1, 0), 1.0, material1);
+    add_sphere(vec3(-4, 1, 0), vec3(-4, 1, 0), 1.0, material3);
+    add_sphere(vec3(4, 1, 0), vec3(4, 1, 0), 1.0, material3);
+
+    world.add(make_shared<sphere_set>(centers, radii, material_ids, materials, end_centers));
 
     camera_config config = {
         1200,           //  int image_width;
@@ -81,7 +181,7 @@ void bouncing_spheres()
         2               //  double gamma;
     };
 
-    world = collidable_list(make_shared<kd_tree>(world));
+    world = collidable_list(compile_scene(world, build_accelerator));
 
     camera cam(config);
     cam.render(world, "bouncing_spheres.ppm", std::thread::hardware_concurrency());
@@ -298,6 +398,8 @@ void cornell_box()
     // lights.add(light_quad);
     lights.add(make_shared<sphere>(vec3(190, 90, 190), 90, empty_material));
 
+    world = collidable_list(compile_scene(world, build_bvh));
+
     camera_config config = {
         600,                  //  int image_width;
         600,                  //  int image_height;
@@ -347,7 +449,7 @@ void diamond_obj()
     world.add(model);
     world.add(floor);
 
-    world = collidable_list(make_shared<kd_tree>(world));
+    world = collidable_list(compile_scene(world, build_bvh));
 
     camera_config config = {
         400,               //  int image_width;
@@ -419,7 +521,7 @@ void diamond_recreated()
     world.add(t9);
     world.add(floor);
 
-    world = collidable_list(make_shared<kd_tree>(world));
+    world = collidable_list(compile_scene(world, build_bvh));
 
     cube_map background = cube_map(tex_image("resources/Earth_cube_map.png"));
 
@@ -477,7 +579,7 @@ void cube()
     world.add(model);
     world.add(floor);
 
-    world = collidable_list(make_shared<kd_tree>(world));
+    world = collidable_list(compile_scene(world, build_bvh));
 
     camera_config config = {
         400,             //  int image_width;
@@ -524,7 +626,12 @@ void teapot()
     world.add(model);
     world.add(floor);
 
-    world = collidable_list(make_shared<kd_tree>(world));
+    auto bvh = make_shared<bvh8>(world);
+
+    if (show_stats)
+        bvh->stats().print(std::clog, "BVH8");
+
+    world = collidable_list(bvh);
 
     camera_config config = {
         400,                         //  int image_width;
@@ -601,16 +708,15 @@ void final_render()
     // Teapot and smoke diamond
     obj_parser p = obj_parser();
     p.parse_obj_file("resources/teapot.obj");
-    auto teapot = p.generate_triangles(shiny);
-    teapot = make_shared<scale>(teapot, vec3(1, 1, 1)*9);
-    teapot = make_shared<rotate>(teapot, vec3(0, 1, 0), -30);
-    teapot = make_shared<translate>(teapot, vec3(370.5, 390.0, 377.5));
-    // teapot = make_shared<rotate>(teapot, vec3(0, 1, 0), -30);
-    // teapot = make_shared<translate>(teapot, vec3(350, 335, -600));
+    auto teapot = p.generate_mesh(shiny);
+    auto teapot_transform =
+        affine::translation(vec3(370.5, 390.0, 377.5)) *
+        affine::rotation(vec3(0, 1, 0), -30) *
+        affine::scaling(vec3(1, 1, 1)*9);
 
-    auto tea = make_shared<kd_tree>(collidable_list(teapot));
+    world.add(make_shared<instance>(teapot, teapot_transform));
 
-    world.add(tea);
+    world = collidable_list(compile_scene(world, build_bvh));
 
     camera_config config = {
         600,                  //  int image_width;
@@ -633,6 +739,69 @@ void final_render()
     cam.render(world, lights, "final_render.ppm", std::thread::hardware_concurrency());
 }
 
+void instanced_teapots()
+{
+    collidable_list world;
+
+    // Materials
+    auto shiny = make_shared<metal>(color(.73, .73, .73), 0);
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto checker_tex = make_shared<checker_texture>(15, color(.2, .3, .1), color(.9, .9, .9));
+    auto checker_mat = make_shared<lambertian>(checker_tex);
+
+    // The teapot's hierarchy is built once and shared by every instance, and both colors share its vertex buffers
+    obj_parser p = obj_parser();
+    p.parse_obj_file("resources/teapot.obj");
+
+    auto teapot = p.generate_mesh(shiny);
+    auto red_teapot = p.generate_mesh(red);
+
+    for (int a = -2; a <= 2; a++)
+    {
+        for (int b = -2; b <= 2; b++)
+        {
+            // Rest each teapot on the floor, the model's base sits 7.875 units below its origin
+            double size = random_double(0.25, 0.35);
+            auto transform =
+                affine::translation(vec3(a * 12, 7.875 * size, b * 12)) *
+                affine::rotation(vec3(0, 1, 0), random_double(0, 360)) *
+                affine::scaling(vec3(1, 1, 1) * size);
+
+            world.add(make_shared<instance>((a + b) % 2 == 0 ? teapot : red_teapot, transform));
+        }
+    }
+
+    auto floor = make_shared<quad>(
+        vec3(-5000, 0, -5000),
+        vec3(10000, 0, 0),
+        vec3(0, 0, 10000),
+        checker_mat);
+
+    world.add(floor);
+
+    world = collidable_list(compile_scene(world, build_bvh));
+
+    camera_config config = {
+        400,                         //  int image_width;
+        400,                         //  int image_height;
+        60,                          //  double vfov;
+        vec3(40, 35, -50),           //  vec3 lookfrom;
+        vec3(0, 0, 0),               //  vec3 lookat;
+        vec3(0, 1, 0),               //  vec3 up;
+        4,                           //  int samples_per_batch;
+        4,                           //  int batches_per_pixel;
+        0.005,                       //  double max_tolerance;
+        50,                          //  int max_depth;
+        0,                           //  double defocus_angle;
+        10,                          //  double defocus_dist;
+        2                            //  double gamma;
+    };
+
+    camera cam(config);
+
+    cam.render(world, "instanced_teapots.ppm", std::thread::hardware_concurrency());
+}
+
 void load_demo(int selection)
 {
     switch (selection)
@@ -673,6 +842,9 @@ void load_demo(int selection)
     case 12:
         final_render();
         break;
+    case 13:
+        instanced_teapots();
+        break;
     default:
         break;
     }
@@ -683,7 +855,7 @@ int main(int argc, const char **argv)
 
     if (argc < 2)
     {
-        std::cout << "usage: main.exe [demo number] [other demo numbers...]\n"
+        std::cout << "usage: main.exe [--stats] [--lazy] [--packed] [demo number] [other demo numbers...]\n"
                      "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
                      "Renders the given demos\n"
                      "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n"
@@ -700,19 +872,50 @@ int main(int argc, const char **argv)
                      "9: Diamond recreated in code\n"
                      "10: Cube\n"
                      "11: Teapot\n"
-                     "12: Final Render"
+                     "12: Final Render\n"
+                     "13: Instanced Teapots\n"
+                     "\n"
+                     "Options: \n"
+                     "--stats: Print statistics about each demo's acceleration structure\n"
+                     "--lazy: Build hierarchies as rays reach them, for quicker previews\n"
+                     "--packed: Store primitives in arrays by type, intersected without virtual calls"
                   << std::endl;
         return 0;
     }
 
-    std::cout << "Loading " << argc - 1 << " demo" << (argc == 2 ? "..." : "s...") << "\n"
-              << std::endl;
+    std::vector<int> demos;
 
-    for (int i = 0; i < argc - 1; i++)
+    for (int i = 1; i < argc; i++)
     {
-        std::istringstream ss(argv[i + 1]);
+        if (std::string(argv[i]) == "--stats")
+        {
+            show_stats = true;
+            continue;
+        }
+
+        if (std::string(argv[i]) == "--lazy")
+        {
+            lazy_build = true;
+            continue;
+        }
+
+        if (std::string(argv[i]) == "--packed")
+        {
+            packed_build = true;
+            continue;
+        }
+
+        std::istringstream ss(argv[i]);
         int demo_num;
         ss >> demo_num;
+        demos.push_back(demo_num);
+    }
+
+    std::cout << "Loading " << demos.size() << " demo" << (demos.size() == 1 ? "..." : "s...") << "\n"
+              << std::endl;
+
+    for (int demo_num : demos)
+    {
         auto start = std::chrono::steady_clock::now();
         load_demo(demo_num);
         auto elapsed = std::chrono::steady_clock::now() - start;
@@ -3,67 +3,214 @@
 
 #include "collidable.h"
 #include "texture.h"
-#include "pdf.h"
+#include "onb.h"
+
+#include <cstdint>
+
+/**
+ * An enum for the kinds of materials, which a material dispatches on with a switch
+ */
+enum material_type : uint8_t {
+    material_absorbing,     // absorbs every ray and emits nothing
+    material_lambertian,
+    material_metal,
+    material_dielectric,
+    material_diffuse_light,
+    material_isotropic
+};
 
 /**
  * A struct used to collect information about scattering
+ *
+ * For materials that sample with a pdf, the value of their bsdf in the scattered direction is the attenuation
+ * times the scattering pdf.
  */
 class scatter_record {
     public:
-        color attenuation;
-        shared_ptr<pdf> pdf_ptr;
-        bool skip_pdf;
-        ray skip_pdf_ray;
+        color attenuation;      // color the light from the scattered ray is multiplied by
+        ray scattered;          // scattered ray
+        double pdf;             // probability density of sampling the scattered direction
+        double scattering_pdf;  // density of light scattering in the scattered direction
+        bool skip_pdf;          // true if the scattered ray is deterministic and pdf and scattering_pdf are unused
 };
 
 /**
  * A class for representing materials
+ *
+ * Materials are small blocks of parameters selected by a type rather than a virtual hierarchy, so they can be
+ * copied into tables and evaluated without any virtual calls unless they use a texture. The subclasses below only
+ * set parameters and add no members, so they can be copied as materials. A default material absorbs every ray.
  */
 class material {
     public:
-        virtual ~material() = default;
+        /**
+         * Creates a material that absorbs every ray and emits nothing
+         */
+        material() {}
+
+        /**
+         * Returns the type of this material
+         * @return material type
+         */
+        material_type get_type() const { return type; }
+
+        /**
+         * Returns if this material emits light, so the emitted color can be skipped for materials that don't
+         * @return true if material emits, false if it doesn't
+         */
+        bool emits() const { return type == material_diffuse_light; }
 
         /**
          * Returns the color emitted by this material
-         * @param u u coordinate
-         * @param v v coordinate
-         * @param p point in 3D space
+         * @param r_in incoming ray
+         * @param rec collision info of ray
          * @return emitted color
          */
-        virtual color emit(const ray& r_in, const collision_hit& rec, double u, double v, const vec3& p) const {
-            return color(0, 0, 0);
+        color emit(const ray& r_in, const collision_hit& rec) const {
+            if (type != material_diffuse_light || !rec.front_face) return color(0, 0, 0);
+            return albedo_at(rec);
         }
 
         /**
-         * Returns true if this ray scatters and a scattered ray 
+         * Returns if a ray scatters, sampling the scattered ray along with its pdf and scattering pdf
          * @param r_in incoming ray to scatter
          * @param rec collision info of ray
-         * @param attenuation current color collected
-         * @param scattered outgoing ray to return
-         * @param pdf probability density of generating the scattered ray
+         * @param srec place to store the scattered ray and its attenuation and densities
          * @return true if material scatters, false if material does not scatter
          */
-        virtual bool scatter(
-            const ray& r_in,
-            const collision_hit& rec,
-            scatter_record& srec)
-        const {
-            return false;
+        bool scatter(const ray& r_in, const collision_hit& rec, scatter_record& srec) const {
+            switch (type) {
+                case material_lambertian: {
+                    // Cosine sampling makes the pdf equal to the scattering pdf, both cos(theta)/pi
+                    onb ijk(rec.normal);
+                    vec3 local = random_cosine_direction();
+
+                    srec.attenuation = albedo_at(rec);
+                    srec.scattered = ray(rec.point, ijk.transform(local), r_in.time());
+                    srec.pdf = local.z() / M_PI;
+                    srec.scattering_pdf = srec.pdf;
+                    srec.skip_pdf = false;
+                    return true;
+                }
+                case material_metal: {
+                    vec3 reflection = reflect(r_in.direction(), rec.normal);
+                    reflection = reflection.normalize() + (fuzz * randvec3().normalize());
+
+                    srec.attenuation = albedo;
+                    srec.scattered = ray(rec.point, reflection, r_in.time());
+                    srec.skip_pdf = true;
+                    return true;
+                }
+                case material_dielectric: {
+                    double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
+
+                    vec3 unit_direction = r_in.direction().normalize();
+                    double cos_theta = std::fmin(vec3::dot(-unit_direction, rec.normal), 1.0);
+                    double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
+
+                    bool cannot_refract = ri * sin_theta > 1.0;
+                    vec3 direction;
+
+                    if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+                        direction = reflect(unit_direction, rec.normal);
+                    else
+                        direction = refract(unit_direction, rec.normal, ri);
+
+                    srec.attenuation = color(1.0, 1.0, 1.0);
+                    srec.scattered = ray(rec.point, direction, r_in.time());
+                    srec.skip_pdf = true;
+                    return true;
+                }
+                case material_isotropic:
+                    srec.attenuation = albedo_at(rec);
+                    srec.scattered = ray(rec.point, randvec3().normalize(), r_in.time());
+                    srec.pdf = 1/(4*M_PI);
+                    srec.scattering_pdf = srec.pdf;
+                    srec.skip_pdf = false;
+                    return true;
+                default:
+                    return false;
+            }
         }
 
         /**
-         * Returns the scattering pdf associated with this material
-         * @param r_in incoming ray to scatter
+         * Returns the scattering pdf of this material in a direction it didn't sample, such as one towards a light
          * @param rec collision info of ray
-         * @param scattered outgoing scattered ray
-         * @return pdf of material
+         * @param direction scattered direction
+         * @param pdf place to store the probability density of this material sampling the direction
+         * @return scattering pdf in the direction
          */
-        virtual double scattering_pdf(
-            const ray& r_in,
-            const collision_hit& rec,
-            const ray& scattered)
-        const {
-            return 0;
+        double scattering_pdf(const collision_hit& rec, const vec3& direction, double& pdf) const {
+            switch (type) {
+                case material_lambertian: {
+                    double cos_theta = vec3::dot(rec.normal, direction.normalize());
+                    pdf = cos_theta < 0 ? 0 : cos_theta/M_PI;
+                    return pdf;
+                }
+                case material_isotropic:
+                    pdf = 1/(4*M_PI);
+                    return pdf;
+                default:
+                    pdf = 0;
+                    return 0;
+            }
+        }
+
+    protected:
+        /**
+         * Creates a material of a given type with a color or texture
+         * @param type type of material
+         * @param albedo solid color, used if there is no texture
+         * @param tex pointer to texture, or nullptr to use the solid color
+         */
+        material(material_type type, const color& albedo, shared_ptr<texture> tex = nullptr)
+        : type(type), albedo(albedo), tex(tex) {}
+
+        /**
+         * Type of this material
+         */
+        material_type type = material_absorbing;
+
+        /**
+         * Solid color of this material, the color emitted for lights
+         */
+        color albedo;
+
+        /**
+         * Percentage of fuzzy reflection for metals, 0 for no fuzz, 1 for full fuzz
+         */
+        double fuzz = 0;
+
+        /**
+         * Refractive index of dielectrics in a vacuum
+         */
+        double refraction_index = 1;
+
+        /**
+         * Texture of this material, or nullptr if it has a solid color
+         */
+        shared_ptr<texture> tex;
+
+        /**
+         * Returns the color of this material at a collision, skipping the texture lookup for solid colors
+         * @param rec collision info of ray
+         * @return color at the collision
+         */
+        color albedo_at(const collision_hit& rec) const {
+            return tex ? tex->value(rec.u, rec.v, rec.point) : albedo;
+        }
+
+        /**
+         * Returns the reflectance probability using Schlick's approximation:
+         * r(theta) = r0 + (1-r0)(1-cos(theta))^5
+         * @param cosine calculated value of cosine
+         * @param refraction_index refractive index of material
+         * @return probability of reflecting
+         */
+        static double reflectance(double cosine, double refraction_index) {
+            double r0 = (1 - refraction_index) / (1 + refraction_index);
+            r0 = r0*r0;
+            return r0 + (1-r0)*std::pow((1 - cosine),5);
         }
 };
 
@@ -76,36 +223,13 @@ class lambertian : public material {
          * Creates a lambertian material with a solid color
          * @param albedo solid color
          */
-        lambertian(const color& albedo): tex(make_shared<solid_color>(albedo)) {}
+        lambertian(const color& albedo) : material(material_lambertian, albedo) {}
 
         /**
          * Creates a lambertian material with a given texture
          * @param tex pointer to texture
          */
-        lambertian(shared_ptr<texture> tex): tex(tex) {}
-
-        bool scatter(const ray& r_in, const collision_hit& rec, scatter_record& srec)
-        const override {
-            srec.attenuation = tex->value(rec.u, rec.v, rec.point);
-            srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
-            srec.skip_pdf = false;
-            return true;
-        }
-
-        double scattering_pdf(
-            const ray& r_in,
-            const collision_hit& rec,
-            const ray& scattered)
-        const override {
-            double cos_theta = vec3::dot(rec.normal, scattered.direction().normalize());
-            return cos_theta < 0 ? 0 : cos_theta/M_PI; 
-        }
-
-    private:
-        /**
-         * Texture of this material
-         */
-        shared_ptr<texture> tex;
+        lambertian(shared_ptr<texture> tex) : material(material_lambertian, color(), tex) {}
 };
 
 /**
@@ -118,31 +242,9 @@ class metal : public material {
          * @param albedo solid color
          * @param fuzz percentage of fuzzy reflection, 0 for no fuzz, 1 for full fuzz
         */
-        metal(const color& albedo, double fuzz): albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
-
-        bool scatter(const ray& r_in, const collision_hit& rec, scatter_record& srec)
-        const override {
-            vec3 reflection = reflect(r_in.direction(), rec.normal);
-            reflection = reflection.normalize() + (fuzz * randvec3().normalize());
-            
-            srec.attenuation = albedo;
-            srec.pdf_ptr = nullptr;
-            srec.skip_pdf = true;
-            srec.skip_pdf_ray = ray(rec.point, reflection, r_in.time());
-            
-            return true;
+        metal(const color& albedo, double fuzz) : material(material_metal, albedo) {
+            this->fuzz = fuzz < 1 ? fuzz : 1;
         }
-
-    private:
-        /**
-         * Color of this material
-         */
-        color albedo;
-
-        /**
-         * Percentage of fuzzy reflection, 0 for no fuzz, 1 for full fuzz
-         */
-        double fuzz;
 };
 
 /**
@@ -154,48 +256,8 @@ class dielectric : public material {
          * Creates a dielectric material with a given refractive index
          * @param refraction_index refractive index
          */
-        dielectric(double refraction_index) : refraction_index(refraction_index) {}
-
-        bool scatter(const ray& r_in, const collision_hit& rec, scatter_record& srec) const override {
-            srec.attenuation = color(1.0, 1.0, 1.0);
-            srec.pdf_ptr = nullptr;
-            srec.skip_pdf = true;
-            
-            double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
-
-            vec3 unit_direction = r_in.direction().normalize();
-            double cos_theta = std::fmin(vec3::dot(-unit_direction, rec.normal), 1.0);
-            double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
-
-            bool cannot_refract = ri * sin_theta > 1.0;
-            vec3 direction;
-
-            if (cannot_refract || reflectance(cos_theta, ri) > random_double())
-                direction = reflect(unit_direction, rec.normal);
-            else
-                direction = refract(unit_direction, rec.normal, ri);
- 
-            srec.skip_pdf_ray = ray(rec.point, direction, r_in.time());
-            return true;
-        }
-
-    private:
-        /**
-         * Refractive index of the material in a vacuum
-        */
-        double refraction_index;
-
-        /**
-         * Returns the reflectance probability using Schlick's approximation:
-         * r(theta) = r0 + (1-r0)(1-cos(theta))^5
-         * @param cosine calculated value of cosine
-         * @param refraction_index refractive index of material
-         * @return probability of reflecting
-         */ 
-        static double reflectance(double cosine, double refraction_index) {
-            double r0 = (1 - refraction_index) / (1 + refraction_index);
-            r0 = r0*r0;
-            return r0 + (1-r0)*std::pow((1 - cosine),5);
+        dielectric(double refraction_index) : material(material_dielectric, color(1, 1, 1)) {
+            this->refraction_index = refraction_index;
         }
 };
 
@@ -208,23 +270,13 @@ class diffuse_light : public material {
          * Creates a diffuse_light material with a solid color
          * @param emit solid color
          */
-        diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+        diffuse_light(const color& emit) : material(material_diffuse_light, emit) {}
 
         /**
          * Creates a diffuse_light material with a given texture
          * @param tex pointer to texture
          */
-        diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    
-        color emit(const ray& r_in, const collision_hit& rec, double u, double v, const vec3& p) const override {
-            if (!rec.front_face) return color(0,0,0);
-            return tex->value(u, v, p);
-        }    
-    private:
-        /**
-         * Texture of this material
-         */
-        shared_ptr<texture> tex;
+        diffuse_light(shared_ptr<texture> tex) : material(material_diffuse_light, color(), tex) {}
 };
 
 /**
@@ -236,28 +288,13 @@ class isotropic : public material {
          * Creates an isotropic material with a solid color used for volume scattering
          * @param albedo solid color of material
          */
-        isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-        
+        isotropic(const color& albedo) : material(material_isotropic, albedo) {}
+
         /**
          * Creates an isotropic material with a given texture used for volume scattering
          * @param tex texture of material
          */
-        isotropic(shared_ptr<texture> tex) : tex(tex) {}
-
-        bool scatter(const ray& r_in, const collision_hit& rec, scatter_record& srec)
-        const override {
-            srec.attenuation = tex->value(rec.u, rec.v, rec.point);
-            srec.pdf_ptr = make_shared<sphere_pdf>();
-            srec.skip_pdf = false;
-            return true;
-        }
-
-        double scattering_pdf(const ray& r_in, const collision_hit& rec, const ray& scattered) const override {
-            return 1/(4*M_PI);
-        }
-
-    private:
-        shared_ptr<texture> tex;
+        isotropic(shared_ptr<texture> tex) : material(material_isotropic, color(), tex) {}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,301 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "collidable_list.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+
+#include <vector>
+
+/**
+ * A 64 byte node of a motion_bvh holding its bounds at the start and end of the shutter
+ *
+ * Interpolating the two boxes by a ray's time gives bounds that enclose everything under the node at that time,
+ * as long as the bounds of its primitives move linearly over the shutter.
+ */
+struct alignas(64) motion_bvh_node {
+    float bounds_min[2][3]; // minimum corner of the node's bounding box at the start and end of the shutter
+    float bounds_max[2][3]; // maximum corner of the node's bounding box at the start and end of the shutter
+    uint32_t offset;        // interior: index of the first child, the second follows it, leaf: index of the first primitive
+    uint16_t count;         // number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;           // axis the node's children were split along
+    uint8_t pad;
+
+    /**
+     * Returns whether this node is a leaf
+     * @return true if this node holds primitives, false if it has children
+     */
+    bool is_leaf() const { return count > 0; }
+
+    /**
+     * Sets the bounds of this node at one end of the shutter, rounding outwards to float precision
+     * @param key 0 for the start of the shutter, 1 for the end
+     * @param box bounding box to store
+     */
+    void set_bounds(int key, const aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ax = box.axis_interval(axis);
+            bounds_min[key][axis] = linear_bvh_node::round_down(ax.min);
+            bounds_max[key][axis] = linear_bvh_node::round_up(ax.max);
+        }
+    }
+
+    /**
+     * Returns whether a ray hits this node's bounding box at the ray's time
+     * @param origin origin of the ray
+     * @param inv_dir component-wise inverse of the ray's direction
+     * @param time time of the ray, between 0 and 1
+     * @param ray_t interval of ray to check
+     * @param t_enter distance along the ray where it enters the box
+     * @return true if the ray hits the box inside of ray_t, false otherwise
+     */
+    bool hit(const vec3& origin, const vec3& inv_dir, double time, const interval& ray_t, double& t_enter) const {
+        double t_min = ray_t.min;
+        double t_max = ray_t.max;
+
+        for (int axis = 0; axis < 3; axis++) {
+            double lo = bounds_min[0][axis] + time * (bounds_min[1][axis] - bounds_min[0][axis]);
+            double hi = bounds_max[0][axis] + time * (bounds_max[1][axis] - bounds_max[0][axis]);
+
+            double t0 = (lo - origin[axis]) * inv_dir[axis];
+            double t1 = (hi - origin[axis]) * inv_dir[axis];
+
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > t_min) t_min = t0;
+            if (t1 < t_max) t_max = t1;
+
+            if (t_max < t_min) return false;
+        }
+
+        t_enter = t_min;
+        return true;
+    }
+};
+
+static_assert(sizeof(motion_bvh_node) == 64, "motion_bvh_node should fit in one cache line");
+
+/**
+ * A bounding volume hierarchy over moving collidables whose nodes follow their contents over the shutter
+ *
+ * Nodes built over moving spheres would otherwise have to cover the whole sweep of every sphere under them. The
+ * shutter is cut into time segments with a tree each, split using bounds at the middle of the segment, and every
+ * node stores its bounds at both ends of its segment. More segments keep siblings moving in different directions
+ * from dragging their parents' bounds apart, at the cost of building and storing more trees.
+ */
+class motion_bvh : public collidable {
+    public:
+        /**
+         * Creates a motion_bvh from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the hierarchy over
+         * @param config settings used to choose how the hierarchy is split
+         * @param segments number of equal time segments to cut the shutter into, each getting its own tree
+         */
+        motion_bvh(const collidable_list& list, bvh_config config = default_config(), int segments = 1) {
+            objects = list.flatten();
+            segments = std::max(1, segments);
+
+            if (objects.empty()) return;
+
+            for (int s = 0; s < segments; s++) {
+                build_segment(double(s) / segments, double(s + 1) / segments, config);
+            }
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (trees.empty()) return false;
+
+            motion_tree tree(*this, r);
+
+            return traverse_closest(tree, ray_t, [&](uint32_t index, interval& leaf_t) {
+                const motion_bvh_node& node = tree.nodes[index];
+                bool hit_leaf = false;
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (tree.primitives[i]->intersect(r, leaf_t, hit)) {
+                        hit_leaf = true;
+                        leaf_t.max = hit.t;
+                    }
+                }
+
+                return hit_leaf;
+            });
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (trees.empty()) return false;
+
+            motion_tree tree(*this, r);
+
+            return traverse_any(tree, ray_t, [&](uint32_t index) {
+                const motion_bvh_node& node = tree.nodes[index];
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (tree.primitives[i]->occluded(r, ray_t)) return true;
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the surface area heuristic cost of this hierarchy, averaged over the middles of its time segments
+         * @return SAH cost in units of the build config's traversal and intersection costs
+         */
+        double sah_cost() const {
+            double total = 0;
+            for (const auto& tree : trees) {
+                total += tree.cost;
+            }
+            return trees.empty() ? 0 : total / trees.size();
+        }
+
+        /**
+         * Returns the number of time segments the shutter is cut into
+         * @return segment count
+         */
+        int get_segment_count() const { return int(trees.size()); }
+
+        /**
+         * Returns the default settings used to build a motion_bvh
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * A struct holding the tree of one time segment
+         */
+        struct segment_tree {
+            std::vector<motion_bvh_node> nodes;         // flattened nodes, the root is at index 0
+            std::vector<const collidable*> primitives;  // primitives stored contiguously per leaf
+            double cost = 0;                            // SAH cost at the middle of the segment
+        };
+
+        /**
+         * The tree of a ray's time segment as seen by the ray, for the shared traversals
+         */
+        struct motion_tree {
+            using node_type = uint32_t;
+
+            const motion_bvh_node* nodes;           // flattened nodes of the segment's tree
+            const collidable* const* primitives;    // primitives of the segment's tree
+            double time;                            // time of the ray within the segment, between 0 and 1
+            vec3 origin;                            // origin of the ray
+            vec3 inv_dir;                           // component-wise inverse of the ray's direction
+
+            motion_tree(const motion_bvh& bvh, const ray& r) :
+                origin(r.origin()),
+                inv_dir(1.0 / r.direction()[0], 1.0 / r.direction()[1], 1.0 / r.direction()[2]) {
+                const segment_tree& tree = bvh.tree_at(r.time(), time);
+                nodes = tree.nodes.data();
+                primitives = tree.primitives.data();
+            }
+
+            node_type root() const { return 0; }
+
+            bool hit(node_type node, const interval& ray_t, double& t_enter) const {
+                return nodes[node].hit(origin, inv_dir, time, ray_t, t_enter);
+            }
+
+            bool is_leaf(node_type node) const { return nodes[node].is_leaf(); }
+
+            node_type child(node_type node, int i) const { return nodes[node].offset + i; }
+        };
+
+        /**
+         * The collidables this hierarchy was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The tree of each time segment, in order
+         */
+        std::vector<segment_tree> trees;
+
+        /**
+         * The bounding box surrounding all collidables in this hierarchy over the whole shutter
+         */
+        aabb bbox;
+
+        /**
+         * Builds the tree of one time segment
+         * @param start time the segment starts at
+         * @param end time the segment ends at
+         * @param config settings used to choose how the tree is split
+         */
+        void build_segment(double start, double end, const bvh_config& config) {
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(objects.size());
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                build_primitives.emplace_back(objects[i]->bounding_box_at(0.5 * (start + end)), i);
+            }
+
+            bvh_builder builder(config);
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            std::vector<linear_bvh_node> layout;
+            builder.flatten(*root, layout);
+
+            segment_tree tree;
+            tree.cost = builder.sah_cost(layout);
+
+            tree.primitives.reserve(ordered.size());
+            for (size_t index : ordered) {
+                tree.primitives.push_back(objects[index].get());
+            }
+
+            // Children are always stored after their parent, so walking backwards bounds children before parents
+            std::vector<aabb> start_bounds(layout.size());
+            std::vector<aabb> end_bounds(layout.size());
+            tree.nodes.resize(layout.size());
+
+            for (size_t i = layout.size(); i-- > 0;) {
+                const linear_bvh_node& node = layout[i];
+
+                if (node.is_leaf()) {
+                    for (uint32_t p = node.offset; p < node.offset + node.count; p++) {
+                        start_bounds[i] = aabb(start_bounds[i], tree.primitives[p]->bounding_box_at(start));
+                        end_bounds[i] = aabb(end_bounds[i], tree.primitives[p]->bounding_box_at(end));
+                    }
+                } else {
+                    start_bounds[i] = aabb(start_bounds[node.offset], start_bounds[node.offset + 1]);
+                    end_bounds[i] = aabb(end_bounds[node.offset], end_bounds[node.offset + 1]);
+                }
+
+                motion_bvh_node& motion_node = tree.nodes[i];
+                motion_node.set_bounds(0, start_bounds[i]);
+                motion_node.set_bounds(1, end_bounds[i]);
+                motion_node.offset = node.offset;
+                motion_node.count = node.count;
+                motion_node.axis = node.axis;
+                motion_node.pad = 0;
+            }
+
+            bbox = aabb(bbox, aabb(start_bounds[0], end_bounds[0]));
+            trees.push_back(std::move(tree));
+        }
+
+        /**
+         * Returns the tree of the time segment holding a given time
+         * @param time time of a ray, between 0 and 1
+         * @param local_time place to store how far through the segment the time is, between 0 and 1
+         * @return tree of the segment
+         */
+        const segment_tree& tree_at(double time, double& local_time) const {
+            double scaled = std::clamp(time, 0.0, 1.0) * trees.size();
+            size_t s = std::min(size_t(scaled), trees.size() - 1);
+
+            local_time = scaled - s;
+            return trees[s];
+        }
+};
+
+#endif
\ No newline at end of file
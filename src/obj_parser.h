@@ -4,6 +4,7 @@
 #include "vec3.h"
 #include "collidable_list.h"
 #include "triangle.h"
+#include "triangle_mesh.h"
 #include "material.h"
 
 #include <iostream>
@@ -11,6 +12,8 @@
 #include <filesystem>
 #include <vector>
 #include <deque>
+#include <map>
+#include <tuple>
 
 namespace fs = std::filesystem;
 
@@ -47,6 +50,9 @@ class obj_parser {
             }
 
             std::string line;
+
+            // Any mesh generated before no longer matches the parsed data
+            mesh.reset();
             
             // Start with first face group
             face_groups.emplace_back();
@@ -185,10 +191,72 @@ class obj_parser {
             }
             return objects;
         }
+        /**
+         * Generates a single triangle_mesh holding every face of the parsed file
+         *
+         * Face corners sharing the same position, texture coordinate and normal become one vertex. Texture
+         * coordinates and normals are only kept if every corner has one. Meshes generated by the same parser share
+         * their vertex buffers, so the same model can be placed with several materials at little cost.
+         * @param mat material of the mesh
+         * @param config settings used to build the mesh's hierarchy
+         * @return pointer to the mesh
+         */
+        shared_ptr<triangle_mesh> generate_mesh(shared_ptr<material> mat, bvh_config config = triangle_mesh::default_config()) {
+            if (!mesh) build_mesh_buffers();
+            return make_shared<triangle_mesh>(mesh, mesh_indices, mat, config);
+        }
     private:
         std::vector<vec3> verts, norms, texs;
         std::deque<face_group> face_groups;
 
+        /**
+         * The vertex buffers shared by every mesh this parser generates, made on the first call to generate_mesh
+         */
+        shared_ptr<mesh_buffers> mesh;
+
+        /**
+         * Three indices into the mesh's vertex buffers per triangle
+         */
+        std::vector<uint32_t> mesh_indices;
+
+        /**
+         * Builds the vertex buffers and index buffer shared by generated meshes
+         */
+        void build_mesh_buffers() {
+            mesh = make_shared<mesh_buffers>();
+            mesh_indices.clear();
+
+            bool has_uvs = true, has_normals = true;
+            for (const auto& face_group : face_groups) {
+                for (const auto& corner : face_group.face_verts) {
+                    has_uvs = has_uvs && corner.uv_index != -1;
+                    has_normals = has_normals && corner.normal_index != -1;
+                }
+            }
+
+            std::map<std::tuple<int, int, int>, uint32_t> vertex_of;
+
+            for (const auto& face_group : face_groups) {
+                for (const auto& corner : face_group.face_verts) {
+                    int uv = has_uvs ? corner.uv_index : -1;
+                    int normal = has_normals ? corner.normal_index : -1;
+                    auto [it, inserted] = vertex_of.try_emplace({corner.vertex_index, uv, normal}, uint32_t(mesh->positions.size()));
+
+                    if (inserted) {
+                        mesh->positions.push_back(verts.at(corner.vertex_index));
+                        if (has_uvs) mesh->uvs.push_back(texs.at(uv));
+                        if (has_normals) mesh->normals.push_back(norms.at(normal).normalize());
+                    }
+
+                    mesh_indices.push_back(it->second);
+                }
+            }
+
+            mesh->positions.shrink_to_fit();
+            mesh->uvs.shrink_to_fit();
+            mesh->normals.shrink_to_fit();
+        }
+
         void process_face(const std::vector<std::string>& clusters, std::vector<face_vertex>& vertices) {
             for (auto& index_cluster : clusters) {
                 face_vertex v;
@@ -0,0 +1,312 @@
+#ifndef PACKED_SCENE_H
+#define PACKED_SCENE_H
+
+#include "collidable_list.h"
+#include "sphere.h"
+#include "quad.h"
+#include "triangle.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+#include "bvh_stats.h"
+
+#include <vector>
+#include <cstdint>
+#include <typeinfo>
+
+/**
+ * An enum for the kinds of primitives a packed_scene stores in arrays of their own
+ */
+enum primitive_type : uint32_t {
+    primitive_sphere,
+    primitive_quad,
+    primitive_triangle,
+    primitive_other     // any other collidable, called through its virtual functions
+};
+
+/**
+ * A reference from a packed_scene's hierarchy to one of its primitives
+ */
+struct primitive_ref {
+    primitive_type type;    // array the primitive is stored in
+    uint32_t index;         // index of the primitive in that array
+};
+
+/**
+ * A scene whose primitives are stored by type in contiguous arrays under a single bounding volume hierarchy
+ *
+ * Spheres, quads and triangles are copied into arrays of their own type and the hierarchy's leaves refer to them
+ * by type and index. Leaves dispatch on the type with a switch and call each type's intersection directly, so
+ * the calls can be inlined instead of going through a virtual function per primitive. Any other collidable,
+ * such as an instance or a triangle_mesh, is kept as it is and called through its virtual functions.
+ */
+class packed_scene : public collidable {
+    public:
+        /**
+         * Creates a packed_scene from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to pack
+         * @param config settings used to choose how the hierarchy is split
+         */
+        packed_scene(const collidable_list& list, bvh_config config = default_config()) : config(config) {
+            for (const auto& object : list.flatten()) {
+                add(object);
+            }
+
+            build();
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            return traverse_closest(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index, interval& leaf_t) {
+                const linear_bvh_node& node = nodes[index];
+                bool hit_leaf = false;
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (intersect_primitive(refs[i], r, leaf_t, hit)) {
+                        hit_leaf = true;
+                        leaf_t.max = hit.t;
+                    }
+                }
+
+                return hit_leaf;
+            });
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            return traverse_any(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index) {
+                const linear_bvh_node& node = nodes[index];
+
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    if (occluded_primitive(refs[i], r, ray_t)) return true;
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the number of primitives of a type stored in this scene
+         * @param type type of primitive to count
+         * @return primitive count
+         */
+        size_t get_primitive_count(primitive_type type) const {
+            switch (type) {
+                case primitive_sphere: return spheres.size();
+                case primitive_quad: return quads.size();
+                case primitive_triangle: return triangles.size();
+                default: return others.size();
+            }
+        }
+
+        /**
+         * Returns statistics describing the shape and quality of the hierarchy, with memory including the primitive arrays
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(linear_bvh_node) +
+                refs.capacity() * sizeof(primitive_ref) +
+                spheres.capacity() * sizeof(sphere) +
+                quads.capacity() * sizeof(quad) +
+                triangles.capacity() * sizeof(triangle) +
+                others.capacity() * sizeof(shared_ptr<collidable>);
+
+            if (nodes.empty()) return stats;
+
+            std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+
+            while (!stack.empty()) {
+                auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                const linear_bvh_node& node = nodes[index];
+
+                if (node.is_leaf()) {
+                    stats.add_leaf(depth, node.bounding_box(), node.count);
+                    continue;
+                }
+
+                aabb children[2] = {nodes[node.offset].bounding_box(), nodes[node.offset + 1].bounding_box()};
+                stats.add_interior(depth, node.bounding_box(), children, 2);
+
+                stack.push_back({node.offset + 1, depth + 1});
+                stack.push_back({node.offset, depth + 1});
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the default settings used to build a packed_scene's hierarchy
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * The spheres of this scene
+         */
+        std::vector<sphere> spheres;
+
+        /**
+         * The quads of this scene
+         */
+        std::vector<quad> quads;
+
+        /**
+         * The triangles of this scene
+         */
+        std::vector<triangle> triangles;
+
+        /**
+         * The collidables of this scene that aren't stored by type
+         */
+        std::vector<shared_ptr<collidable>> others;
+
+        /**
+         * The primitives in the order the hierarchy's leaves reference them
+         */
+        std::vector<primitive_ref> refs;
+
+        /**
+         * The flattened nodes of the hierarchy
+         */
+        std::vector<linear_bvh_node> nodes;
+
+        /**
+         * The bounding box of the whole scene
+         */
+        aabb bbox;
+
+        /**
+         * The settings the hierarchy was built with
+         */
+        bvh_config config;
+
+        /**
+         * The primitives in the order they were added, before the hierarchy orders them
+         */
+        std::vector<primitive_ref> added;
+
+        /**
+         * Copies a collidable into the array for its type, or keeps it as it is if it has none
+         *
+         * Only collidables whose type is exactly one of the stored types are copied, so subclasses keep their
+         * overrides.
+         * @param object collidable to add, not a collidable_list
+         */
+        void add(const shared_ptr<collidable>& object) {
+            const std::type_info& type = typeid(*object);
+
+            if (type == typeid(sphere)) {
+                added.push_back({primitive_sphere, uint32_t(spheres.size())});
+                spheres.push_back(static_cast<const sphere&>(*object));
+            } else if (type == typeid(quad)) {
+                added.push_back({primitive_quad, uint32_t(quads.size())});
+                quads.push_back(static_cast<const quad&>(*object));
+            } else if (type == typeid(triangle)) {
+                added.push_back({primitive_triangle, uint32_t(triangles.size())});
+                triangles.push_back(static_cast<const triangle&>(*object));
+            } else {
+                added.push_back({primitive_other, uint32_t(others.size())});
+                others.push_back(object);
+            }
+        }
+
+        /**
+         * Returns a primitive as a collidable, for work that isn't worth dispatching statically
+         * @param ref reference to the primitive
+         * @return the primitive
+         */
+        const collidable& primitive(const primitive_ref& ref) const {
+            switch (ref.type) {
+                case primitive_sphere: return spheres[ref.index];
+                case primitive_quad: return quads[ref.index];
+                case primitive_triangle: return triangles[ref.index];
+                default: return *others[ref.index];
+            }
+        }
+
+        /**
+         * Builds the hierarchy and stores the primitive references in the order its leaves use them
+         */
+        void build() {
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(added.size());
+
+            for (size_t i = 0; i < added.size(); i++) {
+                build_primitives.emplace_back(primitive(added[i]).bounding_box(), i);
+            }
+
+            // Spatial splits clip primitives to the parts of space they are split into
+            bvh_builder builder(config, [this](size_t index, const aabb& clip) {
+                return primitive(added[index]).clipped_bounding_box(clip);
+            });
+
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            if (!root) {
+                bbox = aabb::empty;
+                return;
+            }
+
+            bbox = root->bbox;
+            builder.flatten(*root, nodes);
+
+            refs.reserve(ordered.size());
+            for (size_t index : ordered) {
+                refs.push_back(added[index]);
+            }
+
+            added.clear();
+            added.shrink_to_fit();
+        }
+
+        /**
+         * Returns if a ray collides with a primitive closer than the closest collision so far
+         *
+         * Stored types are called by their qualified names, which skips the virtual call and lets the compiler
+         * inline them.
+         * @param ref reference to the primitive
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param hit place to record the closest collision
+         * @return true if ray collides, false if ray doesn't collide
+         */
+        bool intersect_primitive(const primitive_ref& ref, const ray& r, const interval& ray_t, collision& hit) const {
+            switch (ref.type) {
+                case primitive_sphere: return spheres[ref.index].sphere::intersect(r, ray_t, hit);
+                case primitive_quad: return quads[ref.index].quad::intersect(r, ray_t, hit);
+                case primitive_triangle: return triangles[ref.index].triangle::intersect(r, ray_t, hit);
+                default: return others[ref.index]->intersect(r, ray_t, hit);
+            }
+        }
+
+        /**
+         * Returns if a ray collides with a primitive anywhere in an interval
+         * @param ref reference to the primitive
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @return true if ray collides, false if ray doesn't collide
+         */
+        bool occluded_primitive(const primitive_ref& ref, const ray& r, const interval& ray_t) const {
+            switch (ref.type) {
+                case primitive_sphere: return spheres[ref.index].sphere::occluded(r, ray_t);
+                case primitive_quad: return quads[ref.index].quad::occluded(r, ray_t);
+                case primitive_triangle: return triangles[ref.index].triangle::occluded(r, ray_t);
+                default: return others[ref.index]->occluded(r, ray_t);
+            }
+        }
+};
+
+#endif
\ No newline at end of file
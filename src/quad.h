@@ -33,63 +33,86 @@ class quad : public collidable{
             bbox = aabb(diag1, diag2);
         }
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const override {
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            double t, alpha, beta;
+
+            if (!intersect_plane(r, ray_t, t, alpha, beta) || !is_interior(alpha, beta))
+                return false;
+
+            hit.record(t, this, 0, alpha, beta);
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            rec.t = hit.t;
+            rec.point = r.at(hit.t);
+            rec.mat = mat.get();
+            rec.set_face_normal(r, normal);
+            rec.u = hit.alpha;
+            rec.v = hit.beta;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            double t, alpha, beta;
+            return intersect_plane(r, ray_t, t, alpha, beta) && is_interior(alpha, beta);
+        }
+
+        /**
+         * Returns if a ray collides with the plane of this quad and the quad coordinates of the collision
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param t place to store the t value of the collision
+         * @param alpha place to store the coord of the collision along the u basis vector
+         * @param beta place to store the coord of the collision along the v basis vector
+         * @return true if ray collides with the plane inside the interval, false otherwise
+         */
+        bool intersect_plane(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const {
             double den = vec3::dot(normal, r.direction());
 
             // Ray is parallel to the plane, so return false
             if (std::fabs(den) < 1e-8) return false;
 
             // t value is outside of our range, so return false
-            double t = (d - vec3::dot(normal, r.origin()))/den;
+            t = (d - vec3::dot(normal, r.origin()))/den;
             if (!ray_t.contains(t)) return false;
 
             // Use quad coordinates to find if the hit point lies inside the quad
-            vec3 intersection = r.at(t);
-            vec3 hit_vec = intersection - q;
-            double alpha = vec3::dot(w, vec3::cross(hit_vec, v));
-            double beta = vec3::dot(w, vec3::cross(u, hit_vec));
+            vec3 hit_vec = r.at(t) - q;
+            alpha = vec3::dot(w, vec3::cross(hit_vec, v));
+            beta = vec3::dot(w, vec3::cross(u, hit_vec));
 
-            if (!is_interior(alpha, beta, rec))
-                return false;
-
-            // Hit point is inside quad, update collision info
-            rec.t = t;
-            rec.point = intersection;
-            rec.mat = mat;
-            rec.set_face_normal(r, normal);
-            
             return true;
         }
 
         /**
-         * Returns whether quad coordinates (a, b) are inside of this quad and updates uv coords
+         * Returns whether quad coordinates (a, b) are inside of this quad, which become its uv coords
          * @param a coord of u basis vector
          * @param b coord of v basis vector
-         * @param rec collision info to update if the hit is inside this quad
-         * @return true if hit, false if not; updates collision info if hit
+         * @return true if hit, false if not
          */
-        virtual bool is_interior(double a, double b, collision_hit& rec) const {
+        virtual bool is_interior(double a, double b) const {
             const interval unit_interval = interval(0, 1);
             
             // If our quad coords aren't between 0 and 1, they aren't inside the quad
-            if (!unit_interval.contains(a) || !unit_interval.contains(b)) return false;
-
-            rec.u = a;
-            rec.v = b;
-            return true;
+            return unit_interval.contains(a) && unit_interval.contains(b);
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        aabb clipped_bounding_box(const aabb& clip) const override {
+            vec3 vertices[4] = {q, q + u, q + u + v, q + v};
+            return clip.clip_polygon(vertices, 4);
+        }
+
         double pdf_value(const vec3& origin, const vec3& direction) const override {
             // Ensure that incoming ray is sampling this quad
-            collision_hit rec;
-            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            double t, alpha, beta;
+            if (!intersect_plane(ray(origin, direction), interval(0.001, infinity), t, alpha, beta) || !is_interior(alpha, beta))
                 return 0;
 
             // Get pdf of the given direction 
-            auto distance_squared = rec.t * rec.t * direction.sqmag();
-            auto cosine = std::fabs(vec3::dot(direction, rec.normal) / direction.mag());
+            auto distance_squared = t * t * direction.sqmag();
+            auto cosine = std::fabs(vec3::dot(direction, normal) / direction.mag());
 
             return distance_squared / (cosine * area);
         }
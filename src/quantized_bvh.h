@@ -0,0 +1,468 @@
+#ifndef QUANTIZED_BVH_H
+#define QUANTIZED_BVH_H
+
+#include "wide_bvh.h"
+
+#include <cstring>
+#include <type_traits>
+
+/**
+ * A compressed node of a quantized_bvh storing its children's bounds as small integers relative to the node's box
+ *
+ * Each axis is cut into steps of a power of two starting at the node's minimum corner, and every child bound is
+ * rounded outwards to a whole number of steps. Unused child slots have a minimum above their maximum so they never
+ * pass the slab test. With 8 bit steps a 4 wide node fits in one 64 byte cache line.
+ */
+template <int width, typename quant_t>
+struct alignas(32) quantized_bvh_node {
+    float origin[3];            // minimum corner of the node's bounding box, the children's bounds count steps from it
+    int8_t exponent[3];         // power of two giving the size of one step along each axis
+    uint8_t pad;
+    quant_t lo[3][width];       // minimum corners of the children's bounding boxes in steps along each axis
+    quant_t hi[3][width];       // maximum corners of the children's bounding boxes in steps along each axis
+    uint32_t offset[width];     // interior child: index of its node, leaf child: index of its first primitive
+    uint16_t count[width];      // number of primitives for a leaf child, 0 for an interior or unused child
+
+    /**
+     * Largest number of steps a bound can be stored as
+     */
+    static constexpr int max_steps = std::numeric_limits<quant_t>::max();
+
+    /**
+     * Returns the size of one step along an axis
+     * @param axis axis of the step
+     * @return step size
+     */
+    float step(int axis) const {
+        // Build the power of two directly from its exponent bits, exponents are kept in the normal range
+        uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+        float result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    /**
+     * Turns a stored bound back into a position, exactly as traversal does
+     * @param axis axis of the bound
+     * @param q bound in steps
+     * @return position of the bound
+     */
+    float decode(int axis, int q) const { return origin[axis] + float(q) * step(axis); }
+
+    /**
+     * Returns the bounding box of a child
+     * @param i child slot
+     * @return decoded bounding box
+     */
+    aabb child_bounds(int i) const {
+        aabb box;
+        box.x = interval(decode(0, lo[0][i]), decode(0, hi[0][i]));
+        box.y = interval(decode(1, lo[1][i]), decode(1, hi[1][i]));
+        box.z = interval(decode(2, lo[2][i]), decode(2, hi[2][i]));
+        return box;
+    }
+};
+
+/**
+ * A wide bounding volume hierarchy with compressed nodes, made by quantizing the nodes of a wide_bvh
+ *
+ * Nodes take a half to a third of the memory of wide_bvh nodes at the cost of decoding the children's bounds
+ * during traversal. Bounds are only ever rounded outwards, so no hit is lost to the compression.
+ */
+template <int width, typename quant_t = uint8_t>
+class quantized_bvh : public collidable {
+    static_assert(std::is_same_v<quant_t, uint8_t> || std::is_same_v<quant_t, uint16_t>, "quantized_bvh stores bounds in 8 or 16 bits");
+
+    public:
+        /**
+         * Creates a quantized_bvh from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the hierarchy over
+         * @param config settings used to choose how the binary hierarchy is split before being collapsed
+         */
+        quantized_bvh(const collidable_list& list, bvh_config config = default_config()) {
+            objects = list.flatten();
+
+            wide_bvh<width> wide(list, config);
+            primitives = wide.get_primitives();
+            bbox = wide.bounding_box();
+
+            nodes.reserve(wide.get_nodes().size());
+            for (const auto& node : wide.get_nodes()) {
+                nodes.push_back(quantize(node));
+            }
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+
+            // Children waiting to be visited along with where the ray enters them
+            struct stack_entry {
+                uint32_t offset;
+                uint16_t count;
+                float t_enter;
+            } stack[max_stack_size];
+
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, float(ray_t.min)};
+
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                stack_entry entry = stack[--stack_size];
+
+                // A closer hit was found after this child was queued
+                if (entry.t_enter > ray_t.max) continue;
+
+                if (entry.count > 0) {
+                    for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                        if (primitives[i]->intersect(r, ray_t, hit)) {
+                            hit_anything = true;
+                            ray_t.max = hit.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const quantized_bvh_node<width, quant_t>& node = nodes[entry.offset];
+
+                float t_enter[width];
+                int mask = intersect_children(node, wr, ray_t, t_enter);
+
+                // Sort the hit children by entry distance
+                stack_entry hits[width];
+                int hit_count = 0;
+
+                while (mask) {
+                    int i = __builtin_ctz(mask);
+                    mask &= mask - 1;
+
+                    stack_entry child = {node.offset[i], node.count[i], t_enter[i]};
+                    int j = hit_count++;
+                    while (j > 0 && hits[j-1].t_enter < child.t_enter) {
+                        hits[j] = hits[j-1];
+                        j--;
+                    }
+                    hits[j] = child;
+                }
+
+                // The farthest child is queued first so the nearest one is visited next
+                assert(stack_size + hit_count <= max_stack_size && "tree is deeper than bvh_builder::max_stack_depth");
+                for (int i = 0; i < hit_count; i++) {
+                    stack[stack_size++] = hits[i];
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+
+            // Any collision ends the search, so children are queued without sorting
+            struct stack_entry {
+                uint32_t offset;
+                uint16_t count;
+            } stack[max_stack_size];
+
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0};
+
+            while (stack_size > 0) {
+                stack_entry entry = stack[--stack_size];
+
+                if (entry.count > 0) {
+                    for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                        if (primitives[i]->occluded(r, ray_t)) return true;
+                    }
+                    continue;
+                }
+
+                const quantized_bvh_node<width, quant_t>& node = nodes[entry.offset];
+
+                float t_enter[width];
+                int mask = intersect_children(node, wr, ray_t, t_enter);
+
+                assert(stack_size + __builtin_popcount(mask) <= max_stack_size && "tree is deeper than bvh_builder::max_stack_depth");
+                while (mask) {
+                    int i = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    stack[stack_size++] = {node.offset[i], node.count[i]};
+                }
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns statistics describing the shape and quality of this hierarchy
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(quantized_bvh_node<width, quant_t>) +
+                primitives.capacity() * sizeof(const collidable*) +
+                objects.capacity() * sizeof(shared_ptr<collidable>);
+
+            if (nodes.empty()) return stats;
+
+            // The root holder's single slot is the root of the tree
+            if (nodes[0].count[0] > 0) {
+                stats.add_leaf(0, nodes[0].child_bounds(0), nodes[0].count[0]);
+            } else {
+                collect_stats(stats, nodes[0].offset[0], 0, nodes[0].child_bounds(0));
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the nodes of this hierarchy, the root is at index 0
+         * @return vector of nodes
+         */
+        const std::vector<quantized_bvh_node<width, quant_t>>& get_nodes() const { return nodes; }
+
+        /**
+         * Returns the default settings used to build the binary hierarchy that gets collapsed
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * Most children a ray can have queued, width - 1 more for each of the max_stack_depth levels
+         */
+        static constexpr int max_stack_size = bvh_builder::max_stack_depth * (width - 1) + 1;
+
+        /**
+         * The collidables this hierarchy was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The primitives of this hierarchy, stored contiguously per leaf
+         */
+        std::vector<const collidable*> primitives;
+
+        /**
+         * The nodes of this hierarchy
+         */
+        std::vector<quantized_bvh_node<width, quant_t>> nodes;
+
+        /**
+         * The bounding box surrounding all collidables in this hierarchy
+         */
+        aabb bbox;
+
+        /**
+         * Compresses a wide_bvh node, rounding every child bound outwards to a whole step
+         * @param node node to compress
+         * @return compressed node with the same children
+         */
+        static quantized_bvh_node<width, quant_t> quantize(const wide_bvh_node<width>& node) {
+            using node_t = quantized_bvh_node<width, quant_t>;
+            const int max_steps = node_t::max_steps;
+
+            node_t q;
+            q.pad = 0;
+
+            const float* mins[3] = {node.min_x, node.min_y, node.min_z};
+            const float* maxs[3] = {node.max_x, node.max_y, node.max_z};
+
+            for (int axis = 0; axis < 3; axis++) {
+                float lo = std::numeric_limits<float>::infinity();
+                float hi = -std::numeric_limits<float>::infinity();
+
+                for (int i = 0; i < width; i++) {
+                    if (node.offset[i] == wide_bvh_node<width>::empty_slot) continue;
+                    lo = std::fmin(lo, mins[axis][i]);
+                    hi = std::fmax(hi, maxs[axis][i]);
+                }
+
+                if (lo > hi) lo = hi = 0;
+
+                // Pick the smallest step that lets the largest bound reach the top of the node
+                int exponent;
+                std::frexp(double(hi - lo) / max_steps, &exponent);
+                exponent = std::clamp(exponent, -126, 127);
+
+                q.origin[axis] = lo;
+                q.exponent[axis] = int8_t(exponent);
+                while (q.decode(axis, max_steps) < hi && q.exponent[axis] < 127) q.exponent[axis]++;
+
+                float step = q.step(axis);
+
+                for (int i = 0; i < width; i++) {
+                    if (node.offset[i] == wide_bvh_node<width>::empty_slot) {
+                        q.lo[axis][i] = quant_t(max_steps);
+                        q.hi[axis][i] = 0;
+                        continue;
+                    }
+
+                    // Round outwards, then step further out until decoding is sure to cover the original bound
+                    int child_lo = std::clamp(int(std::floor((mins[axis][i] - lo) / step)), 0, max_steps);
+                    int child_hi = std::clamp(int(std::ceil((maxs[axis][i] - lo) / step)), 0, max_steps);
+
+                    while (child_lo > 0 && q.decode(axis, child_lo) > mins[axis][i]) child_lo--;
+                    while (child_hi < max_steps && q.decode(axis, child_hi) < maxs[axis][i]) child_hi++;
+
+                    q.lo[axis][i] = quant_t(child_lo);
+                    q.hi[axis][i] = quant_t(child_hi);
+                }
+            }
+
+            for (int i = 0; i < width; i++) {
+                q.offset[i] = node.offset[i];
+                q.count[i] = node.count[i];
+            }
+
+            return q;
+        }
+
+        /**
+         * Recursively adds a subtree to a set of statistics
+         * @param stats statistics to add to
+         * @param index index of the subtree's root node
+         * @param depth depth of the subtree's root
+         * @param box bounding box of the subtree's root
+         */
+        void collect_stats(bvh_stats& stats, uint32_t index, int depth, const aabb& box) const {
+            const quantized_bvh_node<width, quant_t>& node = nodes[index];
+
+            aabb children[width];
+            int child_count = 0;
+
+            for (int i = 0; i < width; i++) {
+                if (node.offset[i] != wide_bvh_node<width>::empty_slot) {
+                    children[child_count++] = node.child_bounds(i);
+                }
+            }
+
+            stats.add_interior(depth, box, children, child_count);
+
+            for (int i = 0; i < width; i++) {
+                if (node.offset[i] == wide_bvh_node<width>::empty_slot) continue;
+
+                if (node.count[i] > 0) {
+                    stats.add_leaf(depth + 1, node.child_bounds(i), node.count[i]);
+                } else {
+                    collect_stats(stats, node.offset[i], depth + 1, node.child_bounds(i));
+                }
+            }
+        }
+
+#if defined(WIDE_BVH_SSE)
+        /**
+         * Loads four stored bounds and widens them to floats
+         * @param q first of the four bounds
+         * @return the bounds as floats
+         */
+        static __m128 load_steps(const quant_t* q) {
+            __m128i zero = _mm_setzero_si128();
+            __m128i v;
+
+            if constexpr (std::is_same_v<quant_t, uint8_t>) {
+                int packed;
+                std::memcpy(&packed, q, sizeof(packed));
+                v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+            } else {
+                v = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q)), zero);
+            }
+
+            return _mm_cvtepi32_ps(v);
+        }
+#endif
+
+        /**
+         * Tests a ray against every child of a node at once
+         * @param node node whose children to test
+         * @param wr ray to test in single precision form
+         * @param ray_t interval of ray to check
+         * @param t_enter filled with where the ray enters each child
+         * @return bit mask of the children the ray hits
+         */
+        static int intersect_children(const quantized_bvh_node<width, quant_t>& node, const wide_ray& wr, const interval& ray_t, float* t_enter) {
+            // Shrink near distances and stretch far ones by their rounding error, assuming they aren't negative
+            const float t_min = float(ray_t.min);
+            const float t_max = float(ray_t.max);
+            const float shrink = 1 - wide_ray::distance_error, stretch = 1 + wide_ray::distance_error;
+
+            const quant_t* near[3];
+            const quant_t* far[3];
+            for (int axis = 0; axis < 3; axis++) {
+                near[axis] = wr.dir_is_neg[axis] ? node.hi[axis] : node.lo[axis];
+                far[axis] = wr.dir_is_neg[axis] ? node.lo[axis] : node.hi[axis];
+            }
+
+#if defined(WIDE_BVH_SSE)
+            // Fold the node's origin into the ray so each bound is decoded and tested with one multiply and add
+            __m128 step[3], offset[3], inv[3];
+            for (int axis = 0; axis < 3; axis++) {
+                step[axis] = _mm_set1_ps(node.step(axis));
+                offset[axis] = _mm_set1_ps(node.origin[axis]);
+                inv[axis] = _mm_set1_ps(wr.inv_dir[axis]);
+            }
+
+            __m128 nx = _mm_set1_ps(wr.near_origin[0]), ny = _mm_set1_ps(wr.near_origin[1]), nz = _mm_set1_ps(wr.near_origin[2]);
+            __m128 fx = _mm_set1_ps(wr.far_origin[0]), fy = _mm_set1_ps(wr.far_origin[1]), fz = _mm_set1_ps(wr.far_origin[2]);
+            __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+            __m128 shrink_ps = _mm_set1_ps(shrink), stretch_ps = _mm_set1_ps(stretch);
+
+            auto distance = [&](const quant_t* q, int axis, __m128 o) {
+                __m128 bound = _mm_add_ps(offset[axis], _mm_mul_ps(load_steps(q), step[axis]));
+                return _mm_mul_ps(_mm_sub_ps(bound, o), inv[axis]);
+            };
+
+            int mask = 0;
+            for (int i = 0; i < width; i += 4) {
+                __m128 tnx = distance(near[0] + i, 0, nx);
+                __m128 tny = distance(near[1] + i, 1, ny);
+                __m128 tnz = distance(near[2] + i, 2, nz);
+                __m128 tfx = distance(far[0] + i, 0, fx);
+                __m128 tfy = distance(far[1] + i, 1, fy);
+                __m128 tfz = distance(far[2] + i, 2, fz);
+
+                // max/min return their second operand on NaN, so axes with undefined distances are ignored
+                __m128 tn = _mm_mul_ps(_mm_max_ps(tnx, _mm_max_ps(tny, _mm_max_ps(tnz, lo))), shrink_ps);
+                __m128 tf = _mm_mul_ps(_mm_min_ps(tfx, _mm_min_ps(tfy, _mm_min_ps(tfz, hi))), stretch_ps);
+
+                _mm_storeu_ps(t_enter + i, tn);
+                mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << i;
+            }
+            return mask;
+#else
+            int mask = 0;
+            for (int i = 0; i < width; i++) {
+                float tn = t_min, tf = t_max;
+
+                for (int axis = 0; axis < 3; axis++) {
+                    float t0 = (node.decode(axis, near[axis][i]) - wr.near_origin[axis]) * wr.inv_dir[axis];
+                    float t1 = (node.decode(axis, far[axis][i]) - wr.far_origin[axis]) * wr.inv_dir[axis];
+                    if (t0 > tn) tn = t0;
+                    if (t1 < tf) tf = t1;
+                }
+
+                tn *= shrink;
+                tf *= stretch;
+                t_enter[i] = tn;
+                if (tn <= tf) mask |= 1 << i;
+            }
+            return mask;
+#endif
+        }
+};
+
+using quantized_bvh4 = quantized_bvh<4>;
+using quantized_bvh8 = quantized_bvh<8>;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,181 @@
+#ifndef SAH_H
+#define SAH_H
+
+#include "aabb.h"
+
+#include <vector>
+#include <algorithm>
+
+/**
+ * An enum for choosing how acceleration structures split their primitives
+ */
+enum split_method {
+    split_median,
+    split_sah,
+    split_lbvh,
+    split_sbvh
+};
+
+/**
+ * A struct for configuring how acceleration structures are built
+ */
+struct bvh_config {
+    split_method method = split_median;
+    int bins = 12;                      // number of buckets used when searching for a SAH split
+    int max_leaf_size = 4;              // most primitives a leaf may hold before it is forced to split
+    double traversal_cost = 1.0;        // relative cost of testing a ray against a node's bounding box
+    double intersect_cost = 1.0;        // relative cost of testing a ray against a primitive
+    int leaf_batch_size = 1;            // primitives a leaf tests together for the cost of one, such as a SIMD block
+    bool restructure_treelets = false;  // reorganize small treelets into their cheapest topology after building
+    int treelet_size = 7;               // number of leaves in each restructured treelet, between 3 and 8
+    int build_threads = 0;              // threads used by parallel builders, 0 uses every hardware thread
+    double spatial_split_alpha = 1e-5;  // overlap, relative to the root's area, above which spatial splits are tried
+    double duplication_budget = 0.5;    // most references spatial splits may add, relative to the primitive count
+    double rebuild_cost_ratio = 1.5;    // growth in SAH cost since the last build above which updates rebuild
+    bool cluster_layout = false;        // reorder flattened nodes into clusters of the subtrees rays most often visit together
+    int cluster_bytes = 4096;           // size of each cluster of nodes, usually one memory page
+};
+
+/**
+ * A struct used to hold the result of a surface area heuristic split search
+ */
+struct sah_split {
+    bool make_leaf; // true if keeping the primitives together is cheaper than splitting them
+    size_t mid;     // index the range was partitioned at, [start, mid) is left and [mid, end) is right
+    int axis;       // axis the range was split along, -1 if no split was found
+    double cost;    // estimated cost of the chosen option
+};
+
+/**
+ * Returns the cost of testing a ray against every primitive in a leaf
+ * @param config build settings holding the intersection cost and leaf batch size
+ * @param n number of primitives in the leaf
+ * @return intersection cost of the leaf
+ */
+inline double leaf_intersect_cost(const bvh_config& config, size_t n) {
+    size_t batch = size_t(std::max(1, config.leaf_batch_size));
+    return config.intersect_cost * double((n + batch - 1) / batch);
+}
+
+/**
+ * Finds the cheapest split of a range of items using a binned surface area heuristic and partitions the range around it
+ * @param items vector of items to split
+ * @param start lower bound of range to split
+ * @param end upper bound of range to split
+ * @param bounds_of function returning the bounding box of an item
+ * @param config build settings holding the bin count and cost constants
+ * @return the chosen split; if make_leaf is true the range is left unpartitioned
+ */
+template <typename T, typename bounds_fn>
+sah_split find_sah_split(std::vector<T>& items, size_t start, size_t end, bounds_fn bounds_of, const bvh_config& config) {
+    size_t n = end - start;
+    const int bins = std::max(2, config.bins);
+
+    // Gather the bounds of the range and of its primitives' centroids
+    std::vector<aabb> boxes(n);
+    aabb bbox = aabb::empty;
+    aabb centroid_bounds = aabb::empty;
+
+    for (size_t i = 0; i < n; i++) {
+        boxes[i] = bounds_of(items[start + i]);
+        bbox = aabb(bbox, boxes[i]);
+        vec3 c = boxes[i].centroid();
+        centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+    }
+
+    double parent_area = bbox.surface_area();
+    double inv_area = parent_area > 0 ? 1.0 / parent_area : 0;
+    double leaf_cost = leaf_intersect_cost(config, n);
+
+    auto bin_of = [&](const vec3& c, int axis) {
+        const interval& ax = centroid_bounds.axis_interval(axis);
+        int b = int(bins * ((c[axis] - ax.min) / ax.size()));
+        return std::clamp(b, 0, bins - 1);
+    };
+
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = infinity;
+
+    std::vector<int> counts(bins);
+    std::vector<aabb> bin_bounds(bins);
+    std::vector<double> right_area(bins);
+    std::vector<int> right_count(bins);
+
+    for (int axis = 0; axis < 3; axis++) {
+        // All centroids share a plane on this axis, nothing to split
+        if (centroid_bounds.axis_interval(axis).size() <= 0) continue;
+
+        std::fill(counts.begin(), counts.end(), 0);
+        std::fill(bin_bounds.begin(), bin_bounds.end(), aabb::empty);
+
+        for (size_t i = 0; i < n; i++) {
+            int b = bin_of(boxes[i].centroid(), axis);
+            counts[b]++;
+            bin_bounds[b] = aabb(bin_bounds[b], boxes[i]);
+        }
+
+        // Sweep from the right to get the area and count on the far side of every split
+        aabb right = aabb::empty;
+        int count = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            right = aabb(right, bin_bounds[b]);
+            count += counts[b];
+            right_area[b] = right.surface_area();
+            right_count[b] = count;
+        }
+
+        // Sweep from the left and evaluate the cost of splitting after each bin
+        aabb left = aabb::empty;
+        count = 0;
+        for (int b = 0; b < bins - 1; b++) {
+            left = aabb(left, bin_bounds[b]);
+            count += counts[b];
+
+            if (count == 0 || right_count[b+1] == 0) continue;
+
+            double cost = config.traversal_cost + inv_area *
+                (leaf_intersect_cost(config, count) * left.surface_area() + leaf_intersect_cost(config, right_count[b+1]) * right_area[b+1]);
+
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    bool must_split = n > size_t(config.max_leaf_size);
+
+    if (!must_split && leaf_cost <= best_cost) {
+        return {true, start, -1, leaf_cost};
+    }
+
+    size_t mid = start;
+
+    if (best_axis != -1) {
+        auto split_point = std::partition(
+            std::begin(items) + start, std::begin(items) + end,
+            [&](const T& item) { return bin_of(bounds_of(item).centroid(), best_axis) <= best_bin; }
+        );
+        mid = split_point - std::begin(items);
+    }
+
+    // Centroids are all coincident, so fall back on splitting at the object median
+    if (mid == start || mid == end) {
+        int axis = best_axis == -1 ? bbox.longest_axis() : best_axis;
+        mid = start + n/2;
+
+        std::nth_element(
+            std::begin(items) + start, std::begin(items) + mid, std::begin(items) + end,
+            [&](const T& a, const T& b) { return bounds_of(a).centroid()[axis] < bounds_of(b).centroid()[axis]; }
+        );
+
+        if (best_axis == -1) best_cost = leaf_cost;
+        best_axis = axis;
+    }
+
+    return {false, mid, best_axis, best_cost};
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,197 @@
+#ifndef SCENE_COMPILER_H
+#define SCENE_COMPILER_H
+
+#include "collidable_list.h"
+#include "instance.h"
+#include "accelerator.h"
+
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <ostream>
+
+/**
+ * A function that builds an acceleration structure over a list of collidables
+ */
+using accelerator_builder = std::function<shared_ptr<collidable>(const collidable_list&)>;
+
+/**
+ * A struct counting the changes a scene_compiler made to a scene
+ */
+struct scene_compile_stats {
+    size_t lists_flattened = 0;         // nested collidable_lists merged into the list holding them
+    size_t instances_compiled = 0;      // instances whose placed collidable was compiled in its object space
+    size_t accelerators_built = 0;      // acceleration structures built over lists
+    size_t accelerated_primitives = 0;  // collidables placed into those acceleration structures
+
+    /**
+     * Prints a one line summary of the changes
+     * @param out stream to print to
+     */
+    void print(std::ostream& out) const {
+        out << "Scene compiler: flattened " << lists_flattened << " nested lists, compiled "
+            << instances_compiled << " instances, built "
+            << accelerators_built << " accelerators over " << accelerated_primitives << " primitives" << std::endl;
+    }
+};
+
+/**
+ * A class for turning a scene graph as it was assembled into one that is cheaper to trace rays through
+ *
+ * Nested collidable_lists are merged into the list holding them and every list holding enough collidables is built
+ * into an acceleration structure. Lists placed by an instance, including translate, rotate and scale, are compiled
+ * in their own object space; the instance itself already folds any chain of transformations into one matrix.
+ * Collidables the compiler does not know how to look inside, such as existing acceleration structures, are kept as
+ * they are.
+ */
+class scene_compiler {
+    public:
+        /**
+         * Creates a scene_compiler
+         * @param build function used to build acceleration structures over lists
+         * @param min_accelerated_size lists holding at least this many collidables get an acceleration structure
+         */
+        scene_compiler(accelerator_builder build = default_builder, size_t min_accelerated_size = 8)
+            : build(build), min_accelerated_size(min_accelerated_size) {}
+
+        /**
+         * Compiles a scene
+         * @param world collidables making up the scene
+         * @return compiled scene
+         */
+        shared_ptr<collidable> compile(const collidable_list& world) {
+            std::vector<shared_ptr<collidable>> objects;
+            gather(world, objects);
+            return compile_objects(objects);
+        }
+
+        /**
+         * Returns the changes made by every compile so far
+         * @return compile statistics
+         */
+        const scene_compile_stats& get_stats() const { return stats; }
+
+        /**
+         * Builds a list into a linear_bvh or uniform_grid, whichever suits its primitives
+         * @param list collidables to build over
+         * @return built acceleration structure
+         */
+        static shared_ptr<collidable> default_builder(const collidable_list& list) {
+            return make_accelerator(list);
+        }
+
+    private:
+        /**
+         * The function used to build acceleration structures
+         */
+        accelerator_builder build;
+
+        /**
+         * The smallest list that is built into an acceleration structure
+         */
+        size_t min_accelerated_size;
+
+        /**
+         * The changes made so far
+         */
+        scene_compile_stats stats;
+
+        /**
+         * Collidables placed by instances that were already compiled, so ones shared by several instances are only
+         * compiled once
+         */
+        std::unordered_map<const collidable*, shared_ptr<collidable>> compiled;
+
+        /**
+         * Appends the collidables of a list to a vector, merging nested lists into it
+         * @param list list to gather from
+         * @param objects vector to append to
+         */
+        void gather(const collidable_list& list, std::vector<shared_ptr<collidable>>& objects) {
+            for (const auto& object : list.objects) {
+                auto nested = std::dynamic_pointer_cast<collidable_list>(object);
+
+                if (nested) {
+                    stats.lists_flattened++;
+                    gather(*nested, objects);
+                } else {
+                    objects.push_back(object);
+                }
+            }
+        }
+
+        /**
+         * Compiles each of a set of collidables and builds an acceleration structure over them if there are enough
+         * @param objects collidables to compile, with no nested lists
+         * @return compiled collidable
+         */
+        shared_ptr<collidable> compile_objects(const std::vector<shared_ptr<collidable>>& objects) {
+            collidable_list list;
+
+            for (const auto& object : objects) {
+                list.add(compile_object(object));
+            }
+
+            if (list.objects.size() == 1) return list.objects[0];
+            if (list.objects.size() < min_accelerated_size) return make_shared<collidable_list>(list);
+
+            stats.accelerators_built++;
+            stats.accelerated_primitives += list.objects.size();
+            return build(list);
+        }
+
+        /**
+         * Compiles a single collidable, looking through an instance at the collidable it places
+         * @param object collidable to compile, not a collidable_list
+         * @return compiled collidable
+         */
+        shared_ptr<collidable> compile_object(const shared_ptr<collidable>& object) {
+            // Instances fold any chain of transformations into one when they are made, so one level is enough
+            auto placed = std::dynamic_pointer_cast<instance>(object);
+            if (!placed) return object;
+
+            shared_ptr<collidable> inner = placed->get_object();
+            shared_ptr<collidable> result = compile_placed(inner);
+            if (result == inner) return object;
+
+            stats.instances_compiled++;
+            return make_shared<instance>(result, placed->get_transform());
+        }
+
+        /**
+         * Compiles a collidable placed by an instance in its own object space
+         * @param object collidable to compile
+         * @return compiled collidable, or the same collidable if nothing changed
+         */
+        shared_ptr<collidable> compile_placed(const shared_ptr<collidable>& object) {
+            auto found = compiled.find(object.get());
+            if (found != compiled.end()) return found->second;
+
+            shared_ptr<collidable> result = object;
+            auto nested = std::dynamic_pointer_cast<collidable_list>(object);
+
+            if (nested) {
+                std::vector<shared_ptr<collidable>> objects;
+                gather(*nested, objects);
+                result = compile_objects(objects);
+            }
+
+            compiled[object.get()] = result;
+            return result;
+        }
+};
+
+/**
+ * Compiles a scene and logs what the compiler changed
+ * @param world collidables making up the scene
+ * @param build function used to build acceleration structures over lists
+ * @return compiled scene
+ */
+inline shared_ptr<collidable> compile_scene(const collidable_list& world, accelerator_builder build = scene_compiler::default_builder) {
+    scene_compiler compiler(build);
+    auto scene = compiler.compile(world);
+    compiler.get_stats().print(std::clog);
+    return scene;
+}
+
+#endif
\ No newline at end of file
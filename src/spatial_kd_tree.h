@@ -0,0 +1,538 @@
+#ifndef SPATIAL_KD_TREE_H
+#define SPATIAL_KD_TREE_H
+
+#include "aabb.h"
+#include "collidable_list.h"
+#include "sah.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/**
+ * An 8 byte node of a spatial_kd_tree
+ *
+ * Interior nodes store their split plane, with the child below the plane directly after them and the child above
+ * it at above_child. Leaves store where their primitive indices start and how many there are.
+ */
+struct spatial_kd_node {
+    union {
+        float split;                // interior: position of the split plane along axis
+        uint32_t primitive_offset;  // leaf: offset of the leaf's first primitive in the primitive index list
+    };
+    uint32_t flags;                 // low 2 bits: split axis, or 3 for a leaf, high 30 bits: above child or primitive count
+
+    /**
+     * Returns whether this node is a leaf
+     * @return true if this node holds primitives, false if it splits space
+     */
+    bool is_leaf() const { return (flags & 3) == 3; }
+
+    /**
+     * Returns the axis an interior node splits along
+     */
+    int axis() const { return int(flags & 3); }
+
+    /**
+     * Returns the index of an interior node's child above the split plane
+     */
+    uint32_t above_child() const { return flags >> 2; }
+
+    /**
+     * Returns the number of primitives in a leaf
+     */
+    uint32_t primitive_count() const { return flags >> 2; }
+
+    /**
+     * Makes this node an interior node
+     * @param axis axis to split along
+     * @param position position of the split plane
+     */
+    void make_interior(int axis, float position) {
+        split = position;
+        flags = uint32_t(axis);
+    }
+
+    /**
+     * Sets the index of an interior node's child above the split plane
+     * @param index index of the child
+     */
+    void set_above_child(uint32_t index) { flags = (flags & 3) | (index << 2); }
+
+    /**
+     * Makes this node a leaf
+     * @param offset offset of the leaf's first primitive in the primitive index list
+     * @param count number of primitives in the leaf
+     */
+    void make_leaf(uint32_t offset, uint32_t count) {
+        primitive_offset = offset;
+        flags = 3 | (count << 2);
+    }
+};
+
+static_assert(sizeof(spatial_kd_node) == 8, "spatial_kd_node should fit in 8 bytes");
+
+/**
+ * A kd-tree dividing space with axis-aligned planes chosen by the surface area heuristic
+ *
+ * Unlike kd_tree, which partitions its objects, this partitions space: a primitive crossing a split plane is
+ * referenced from both sides, and primitives are clipped to each node's box so planes can be placed exactly at the
+ * edges of what a node holds. Nodes never overlap, so a ray walks the leaves it passes through strictly front to
+ * back and stops at the first leaf whose hit lies inside it.
+ */
+class spatial_kd_tree : public collidable {
+    public:
+        /**
+         * Creates a spatial_kd_tree from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the tree over
+         * @param config settings holding the relative costs of traversal and intersection
+         */
+        spatial_kd_tree(const collidable_list& list, bvh_config config = default_config()) : config(config) {
+            objects = list.flatten();
+
+            bbox = aabb::empty;
+            for (const auto& object : objects) {
+                bbox = aabb(bbox, object->bounding_box());
+            }
+
+            if (objects.empty()) return;
+
+            std::vector<uint32_t> all(objects.size());
+            for (size_t i = 0; i < objects.size(); i++) {
+                all[i] = uint32_t(i);
+            }
+
+            // Deep enough to cut away the empty space around a scene before dividing the scene itself
+            int max_depth = int(16 + 1.3 * std::log2(double(objects.size())));
+            build(bbox, all, max_depth, 0);
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            double t_min, t_max;
+            if (!clip_to_bounds(r, ray_t, t_min, t_max)) return false;
+
+            const vec3& origin = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir = vec3(1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]);
+
+            // Far children waiting to be visited along with the part of the ray inside them
+            struct stack_entry {
+                uint32_t node;
+                double t_min, t_max;
+            } stack[max_stack_depth];
+
+            int stack_size = 0;
+            uint32_t index = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                // The nearest hit so far lies before this node
+                if (ray_t.max < t_min) break;
+
+                const spatial_kd_node& node = nodes[index];
+
+                if (!node.is_leaf()) {
+                    uint32_t first, second;
+                    double t_split = order_children(node, index, origin, dir, inv_dir, first, second);
+
+                    if (t_split > t_max || t_split <= 0) {
+                        index = first;
+                    } else if (t_split < t_min) {
+                        index = second;
+                    } else {
+                        stack[stack_size++] = {second, t_split, t_max};
+                        index = first;
+                        t_max = t_split;
+                    }
+                    continue;
+                }
+
+                for (uint32_t i = node.primitive_offset; i < node.primitive_offset + node.primitive_count(); i++) {
+                    if (primitives[i]->intersect(r, ray_t, hit)) {
+                        hit_anything = true;
+                        ray_t.max = hit.t;
+                    }
+                }
+
+                // Leaves are visited front to back, so a hit inside this leaf cannot be beaten by a later one
+                if (hit_anything && ray_t.max <= t_max) break;
+                if (stack_size == 0) break;
+
+                stack_entry entry = stack[--stack_size];
+                index = entry.node;
+                t_min = entry.t_min;
+                t_max = entry.t_max;
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            double t_min, t_max;
+            if (!clip_to_bounds(r, ray_t, t_min, t_max)) return false;
+
+            const vec3& origin = r.origin();
+            const vec3& dir = r.direction();
+            vec3 inv_dir = vec3(1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]);
+
+            struct stack_entry {
+                uint32_t node;
+                double t_min, t_max;
+            } stack[max_stack_depth];
+
+            int stack_size = 0;
+            uint32_t index = 0;
+
+            while (true) {
+                const spatial_kd_node& node = nodes[index];
+
+                if (!node.is_leaf()) {
+                    uint32_t first, second;
+                    double t_split = order_children(node, index, origin, dir, inv_dir, first, second);
+
+                    if (t_split > t_max || t_split <= 0) {
+                        index = first;
+                    } else if (t_split < t_min) {
+                        index = second;
+                    } else {
+                        stack[stack_size++] = {second, t_split, t_max};
+                        index = first;
+                        t_max = t_split;
+                    }
+                    continue;
+                }
+
+                for (uint32_t i = node.primitive_offset; i < node.primitive_offset + node.primitive_count(); i++) {
+                    if (primitives[i]->occluded(r, ray_t)) return true;
+                }
+
+                if (stack_size == 0) break;
+
+                stack_entry entry = stack[--stack_size];
+                index = entry.node;
+                t_min = entry.t_min;
+                t_max = entry.t_max;
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the number of nodes in this tree
+         * @return node count
+         */
+        size_t get_node_count() const { return nodes.size(); }
+
+        /**
+         * Returns the number of primitive references held by the leaves, counting primitives split across leaves
+         * @return reference count
+         */
+        size_t get_reference_count() const { return primitives.size(); }
+
+        /**
+         * Returns the default settings used to build a spatial_kd_tree
+         *
+         * Primitive tests are weighted well above node steps, which are only a plane comparison here.
+         * @return build config with the kd-tree's relative costs
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.traversal_cost = 1.0;
+            config.intersect_cost = 20.0;
+            return config;
+        }
+
+    private:
+        /**
+         * A struct holding one edge of a clipped primitive's bounds along an axis, used to sweep candidate planes
+         */
+        struct bound_event {
+            double position;    // position of the edge along the axis
+            int type;           // 0 if a primitive ends here, 1 if it lies flat in the plane, 2 if it starts here
+
+            bool operator<(const bound_event& other) const {
+                return position < other.position || (position == other.position && type < other.type);
+            }
+        };
+
+        /**
+         * Most far children a ray can have queued, enough for the deepest tree the builder makes
+         */
+        static const int max_stack_depth = 64;
+
+        /**
+         * Fraction of the cost saved when a split leaves one side empty, favouring planes that cut off empty space
+         */
+        static constexpr double empty_bonus = 0.5;
+
+        /**
+         * Most splits in a row allowed to cost more than a leaf before the builder gives up on a subtree
+         */
+        static const int max_bad_refines = 3;
+
+        /**
+         * The settings used to build this tree
+         */
+        bvh_config config;
+
+        /**
+         * The collidables this tree was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The primitives referenced by each leaf, stored contiguously per leaf
+         */
+        std::vector<const collidable*> primitives;
+
+        /**
+         * The nodes of this tree in depth first order, the root is at index 0
+         */
+        std::vector<spatial_kd_node> nodes;
+
+        /**
+         * The bounding box surrounding all collidables in this tree
+         */
+        aabb bbox;
+
+        /**
+         * Recursively builds the subtree over the primitives overlapping a box
+         * @param box box covered by the subtree
+         * @param indices indices of the objects overlapping the box
+         * @param depth_left number of levels the subtree may still add
+         * @param bad_refines number of splits above costing more than a leaf
+         */
+        void build(const aabb& box, const std::vector<uint32_t>& indices, int depth_left, int bad_refines) {
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+
+            size_t n = indices.size();
+            double leaf_cost = config.intersect_cost * n;
+
+            if (n <= 1 || depth_left == 0) {
+                make_leaf(index, indices);
+                return;
+            }
+
+            // Clip each primitive to the node so planes can sit exactly at the edges of what it holds
+            std::vector<aabb> clipped(n);
+            size_t overlapping = 0;
+            for (size_t i = 0; i < n; i++) {
+                clipped[i] = objects[indices[i]]->clipped_bounding_box(box);
+                if (clipped[i].x.size() >= 0) overlapping++;
+            }
+
+            double inv_area = 1.0 / box.surface_area();
+            double best_cost = infinity;
+            int best_axis = -1;
+            double best_position = 0;
+            bool best_planar_left = false;
+
+            std::vector<bound_event> events;
+            events.reserve(2 * n);
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& extent = box.axis_interval(axis);
+                events.clear();
+
+                for (const aabb& c : clipped) {
+                    const interval& ax = c.axis_interval(axis);
+                    if (ax.size() < 0) continue;
+
+                    if (ax.min == ax.max) {
+                        events.push_back({ax.min, 1});
+                    } else {
+                        events.push_back({ax.min, 2});
+                        events.push_back({ax.max, 0});
+                    }
+                }
+
+                std::sort(events.begin(), events.end());
+
+                // Sweep the planes from low to high, tracking how many primitives fall on each side
+                size_t below = 0, above = overlapping;
+
+                for (size_t e = 0; e < events.size();) {
+                    double position = events[e].position;
+                    size_t ending = 0, planar = 0, starting = 0;
+
+                    while (e < events.size() && events[e].position == position && events[e].type == 0) { ending++; e++; }
+                    while (e < events.size() && events[e].position == position && events[e].type == 1) { planar++; e++; }
+                    while (e < events.size() && events[e].position == position && events[e].type == 2) { starting++; e++; }
+
+                    above -= planar + ending;
+
+                    // Planes are stored as floats, so only planes still inside the node once rounded can split it
+                    double plane = double(float(position));
+
+                    if (plane > extent.min && plane < extent.max) {
+                        for (int planar_left = 0; planar_left < 2; planar_left++) {
+                            size_t n_below = below + (planar_left ? planar : 0);
+                            size_t n_above = above + (planar_left ? 0 : planar);
+                            double cost = split_cost(box, axis, plane, n_below, n_above, inv_area);
+
+                            if (cost < best_cost) {
+                                best_cost = cost;
+                                best_axis = axis;
+                                best_position = plane;
+                                best_planar_left = planar_left;
+                            }
+                        }
+                    }
+
+                    below += starting + planar;
+                }
+            }
+
+            if (best_axis < 0) {
+                make_leaf(index, indices);
+                return;
+            }
+
+            if (best_cost > leaf_cost) bad_refines++;
+            if ((best_cost > 4 * leaf_cost && n < 16) || bad_refines == max_bad_refines) {
+                make_leaf(index, indices);
+                return;
+            }
+
+            float split = float(best_position);
+            double position = best_position;
+
+            std::vector<uint32_t> below_indices, above_indices;
+
+            for (size_t i = 0; i < n; i++) {
+                const interval& ax = clipped[i].axis_interval(best_axis);
+                if (ax.size() < 0) continue;
+
+                if (ax.min == position && ax.max == position) {
+                    (best_planar_left ? below_indices : above_indices).push_back(indices[i]);
+                } else {
+                    if (ax.min < position) below_indices.push_back(indices[i]);
+                    if (ax.max > position) above_indices.push_back(indices[i]);
+                }
+            }
+
+            aabb below_box = box, above_box = box;
+            set_axis(below_box, best_axis, interval(box.axis_interval(best_axis).min, position));
+            set_axis(above_box, best_axis, interval(position, box.axis_interval(best_axis).max));
+
+            nodes[index].make_interior(best_axis, split);
+            build(below_box, below_indices, depth_left - 1, bad_refines);
+
+            nodes[index].set_above_child(uint32_t(nodes.size()));
+            build(above_box, above_indices, depth_left - 1, bad_refines);
+        }
+
+        /**
+         * Returns the surface area heuristic cost of splitting a box with a plane
+         * @param box box being split
+         * @param axis axis of the plane
+         * @param position position of the plane
+         * @param n_below number of primitives below the plane
+         * @param n_above number of primitives above the plane
+         * @param inv_area inverse of the box's surface area
+         * @return estimated cost of the split
+         */
+        double split_cost(const aabb& box, int axis, double position, size_t n_below, size_t n_above, double inv_area) const {
+            vec3 size = vec3(box.x.size(), box.y.size(), box.z.size());
+            int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+            double face = size[a1] * size[a2];
+            double rim = size[a1] + size[a2];
+
+            double below_area = 2 * (face + (position - box.axis_interval(axis).min) * rim);
+            double above_area = 2 * (face + (box.axis_interval(axis).max - position) * rim);
+
+            double bonus = (n_below == 0 || n_above == 0) ? empty_bonus : 0;
+
+            return config.traversal_cost +
+                config.intersect_cost * (1 - bonus) * (below_area * inv_area * n_below + above_area * inv_area * n_above);
+        }
+
+        /**
+         * Turns a node into a leaf over the given objects
+         * @param index index of the node
+         * @param indices indices of the objects in the leaf
+         */
+        void make_leaf(uint32_t index, const std::vector<uint32_t>& indices) {
+            nodes[index].make_leaf(uint32_t(primitives.size()), uint32_t(indices.size()));
+            for (uint32_t i : indices) {
+                primitives.push_back(objects[i].get());
+            }
+        }
+
+        /**
+         * Finds which child of an interior node a ray enters first and where it crosses the split plane
+         * @param node interior node
+         * @param index index of the node
+         * @param origin origin of the ray
+         * @param dir direction of the ray
+         * @param inv_dir component-wise inverse of the ray's direction
+         * @param first set to the child the ray enters first
+         * @param second set to the child the ray enters second
+         * @return distance along the ray to the split plane
+         */
+        static double order_children(
+            const spatial_kd_node& node, uint32_t index,
+            const vec3& origin, const vec3& dir, const vec3& inv_dir,
+            uint32_t& first, uint32_t& second
+        ) {
+            int axis = node.axis();
+            double split = node.split;
+
+            bool below_first = origin[axis] < split || (origin[axis] == split && dir[axis] <= 0);
+            first = below_first ? index + 1 : node.above_child();
+            second = below_first ? node.above_child() : index + 1;
+
+            // A ray parallel to the plane never crosses it
+            if (dir[axis] == 0) return infinity;
+
+            return (split - origin[axis]) * inv_dir[axis];
+        }
+
+        /**
+         * Finds the part of a ray inside this tree's bounds
+         * @param r ray to clip
+         * @param ray_t interval of ray to check
+         * @param t_min set to where the ray enters the bounds
+         * @param t_max set to where the ray leaves the bounds
+         * @return true if the ray passes through the bounds inside of ray_t, false otherwise
+         */
+        bool clip_to_bounds(const ray& r, const interval& ray_t, double& t_min, double& t_max) const {
+            if (nodes.empty()) return false;
+
+            t_min = ray_t.min;
+            t_max = ray_t.max;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = bbox.axis_interval(axis);
+                double inv = 1.0 / r.direction()[axis];
+                double t0 = (ax.min - r.origin()[axis]) * inv;
+                double t1 = (ax.max - r.origin()[axis]) * inv;
+
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > t_min) t_min = t0;
+                if (t1 < t_max) t_max = t1;
+
+                if (t_max < t_min) return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Replaces one axis of a box without padding it
+         * @param box box to change
+         * @param axis axis to replace
+         * @param value new interval for the axis
+         */
+        static void set_axis(aabb& box, int axis, const interval& value) {
+            if (axis == 0) box.x = value;
+            else if (axis == 1) box.y = value;
+            else box.z = value;
+        }
+};
+
+#endif
\ No newline at end of file
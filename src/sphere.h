@@ -50,44 +50,40 @@ class sphere : public collidable {
             bbox = aabb(bbox1, bbox2);
         }
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const {
-            // Solve quadratic equation for t
-            vec3 current_center = center.at(r.time());
-            vec3 oc = current_center - r.origin();
-            double a = r.direction().sqmag();
-            double h = vec3::dot(r.direction(), oc);
-            double c = oc.sqmag() - radius*radius;
-            double discriminant = h*h - a*c;
-
-            double sqrtd = std::sqrt(discriminant);
-
-            // Find if the calculated roots are in range of this ray
-            double t = (h - sqrtd) / a;
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            double t;
+            if (!intersect(r, center.at(r.time()), ray_t, t)) return false;
 
-            if (!ray_t.surrounds(t)) {
-                t = (h + sqrtd) / a;
+            hit.record(t, this);
+            return true;
+        }
 
-                if (!ray_t.surrounds(t)) return false;
-            }
-            
-            // Root is in range, so we update collision info
-            rec.t = t;
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            rec.t = hit.t;
             rec.point = r.at(rec.t);
-            vec3 outward_normal = (rec.point - current_center) / radius;
+            vec3 outward_normal = (rec.point - center.at(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
             get_sphere_uv(outward_normal, rec.u, rec.v);
-            rec.mat = mat;
+            rec.mat = mat.get();
+        }
 
-            return true;
+        bool occluded(const ray& r, interval ray_t) const override {
+            double t;
+            return intersect(r, center.at(r.time()), ray_t, t);
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        aabb bounding_box_at(double time) const override {
+            vec3 current_center = center.at(time);
+            vec3 rad = vec3(radius, radius, radius);
+            return aabb(current_center - rad, current_center + rad);
+        }
+
         double pdf_value(const vec3& origin, const vec3& direction) const override {
             // This method only works for stationary spheres.
 
-            collision_hit rec;
-            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            if (!this->occluded(ray(origin, direction), interval(0.001, infinity)))
                 return 0;
 
             auto dist_squared = (center.at(0) - origin).sqmag();
@@ -103,6 +99,30 @@ class sphere : public collidable {
             onb ijk(direction);
             return ijk.transform(random_to_sphere(radius, distance_squared));
         }
+
+        /**
+         * Updates uv-coords to be coords of a point on a unit sphere where  
+         * 
+         * u: returned value [0,1] of angle around the Y axis from X=-1.
+         * v: returned value [0,1] of angle from Y=-1 to Y=+1.
+         * @param p point on unit sphere
+         * @param u u value to update
+         * @param v v value to update
+         */
+        static void get_sphere_uv(const vec3& p, double& u, double& v) {
+            // p: a given point on the sphere of radius one, centered at the origin.
+            // u: returned value [0,1] of angle around the Y axis from X=-1.
+            // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+            //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+            //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+            //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+            auto theta = std::acos(-p.y());
+            auto phi = std::atan2(-p.z(), p.x()) + M_PI;
+
+            u = phi / (2*M_PI);
+            v = theta / M_PI;
+        }
     private:
         /**
          * The center of this sphere
@@ -125,27 +145,33 @@ class sphere : public collidable {
         aabb bbox;
 
         /**
-         * Updates uv-coords to be coords of a point on a unit sphere where  
-         * 
-         * u: returned value [0,1] of angle around the Y axis from X=-1.
-         * v: returned value [0,1] of angle from Y=-1 to Y=+1.
-         * @param p point on unit sphere
-         * @param u u value to update
-         * @param v v value to update
+         * Returns if a ray collides with this sphere and the t value of the collision
+         * @param r ray to check
+         * @param current_center center of this sphere at the ray's time
+         * @param ray_t interval of ray to check
+         * @param t place to store the t value of the nearest collision in the interval
+         * @return true if ray collides, false if ray doesn't collide
          */
-        static void get_sphere_uv(const vec3& p, double& u, double& v) {
-            // p: a given point on the sphere of radius one, centered at the origin.
-            // u: returned value [0,1] of angle around the Y axis from X=-1.
-            // v: returned value [0,1] of angle from Y=-1 to Y=+1.
-            //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
-            //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
-            //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+        bool intersect(const ray& r, const vec3& current_center, const interval& ray_t, double& t) const {
+            // Solve quadratic equation for t
+            vec3 oc = current_center - r.origin();
+            double a = r.direction().sqmag();
+            double h = vec3::dot(r.direction(), oc);
+            double c = oc.sqmag() - radius*radius;
+            double discriminant = h*h - a*c;
 
-            auto theta = std::acos(-p.y());
-            auto phi = std::atan2(-p.z(), p.x()) + M_PI;
+            double sqrtd = std::sqrt(discriminant);
 
-            u = phi / (2*M_PI);
-            v = theta / M_PI;
+            // Find if the calculated roots are in range of this ray
+            t = (h - sqrtd) / a;
+
+            if (!ray_t.surrounds(t)) {
+                t = (h + sqrtd) / a;
+
+                if (!ray_t.surrounds(t)) return false;
+            }
+
+            return true;
         }
 
         /**
@@ -0,0 +1,556 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "collidable.h"
+#include "material.h"
+#include "sphere.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+#include "bvh_stats.h"
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define SPHERE_SET_SSE
+#endif
+
+/**
+ * Four spheres of a sphere_set with their centers stored component by component
+ *
+ * The structure-of-arrays layout lets all four spheres be intersected with a single set of SIMD instructions.
+ * Unused slots have a NaN radius so they never pass the discriminant test.
+ */
+struct alignas(16) sphere_block {
+    static constexpr int width = 4;
+
+    float center[3][width]; // center of each sphere, at time 0 for moving spheres
+    float radius[width];    // radius of each sphere
+};
+
+/**
+ * The motion of the four spheres of a sphere_block, stored component by component
+ */
+struct alignas(16) sphere_motion_block {
+    float offset[3][sphere_block::width]; // center at time 1 minus center at time 0
+};
+
+/**
+ * A collidable made of many spheres stored as arrays of centers, radii and material indices, traced with its own
+ * bounding volume hierarchy
+ *
+ * Spheres are packed into blocks that are intersected several at a time, so a set costs far less memory and
+ * time than the same spheres made as separate sphere collidables. Spheres can share any number of materials,
+ * which are copied into a contiguous table of their own.
+ */
+class sphere_set : public collidable {
+    public:
+        /**
+         * Creates a sphere_set and builds a hierarchy over its spheres
+         * @param centers center of each sphere, at time 0 for moving spheres
+         * @param radii radius of each sphere
+         * @param material_ids index into materials of each sphere's material
+         * @param materials materials the spheres index into
+         * @param end_centers center of each sphere at time 1, or empty if no sphere moves
+         * @param config settings used to choose how the hierarchy is split
+         */
+        sphere_set(
+            std::vector<vec3> centers,
+            std::vector<double> radii,
+            std::vector<uint32_t> material_ids,
+            std::vector<shared_ptr<material>> materials,
+            std::vector<vec3> end_centers = {},
+            bvh_config config = default_config()
+        ):
+            centers(std::move(centers)),
+            end_centers(std::move(end_centers)),
+            radii(std::move(radii)),
+            material_ids(std::move(material_ids)),
+            config(config) {
+            // Materials are plain parameters, so a null material copies as one that absorbs every ray
+            this->materials.reserve(materials.size());
+            for (const auto& mat : materials) {
+                this->materials.push_back(mat ? *mat : material());
+            }
+
+            build();
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            sphere_ray sr(r);
+
+            // Only the closest sphere is recorded, once traversal is done
+            size_t closest = 0;
+            double closest_t = 0;
+
+            bool hit_anything = traverse_closest(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index, interval& leaf_t) {
+                const linear_bvh_node& node = nodes[index];
+                bool hit_leaf = false;
+
+                for (uint32_t b = node.offset / sphere_block::width; b * sphere_block::width < node.offset + node.count; b++) {
+                    // Confirm each candidate in double precision, which also narrows the interval for the rest
+                    for (int mask = intersect_block(b, sr, float(leaf_t.min), float(leaf_t.max)); mask != 0; mask &= mask - 1) {
+                        size_t slot = b * sphere_block::width + __builtin_ctz(mask);
+                        double t;
+
+                        if (intersect(sphere_ids[slot], r, leaf_t, t)) {
+                            hit_leaf = true;
+                            leaf_t.max = t;
+                            closest = slot;
+                            closest_t = t;
+                        }
+                    }
+                }
+
+                return hit_leaf;
+            });
+
+            if (!hit_anything) return false;
+
+            hit.record(closest_t, this, uint32_t(closest));
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            size_t index = sphere_ids[hit.primitive];
+            vec3 current_center = center_at(index, r.time());
+
+            rec.t = hit.t;
+            rec.point = r.at(rec.t);
+            vec3 outward_normal = (rec.point - current_center) / radii[index];
+            rec.set_face_normal(r, outward_normal);
+            sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+            rec.mat = &materials[material_ids[index]];
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            sphere_ray sr(r);
+
+            return traverse_any(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index) {
+                const linear_bvh_node& node = nodes[index];
+
+                for (uint32_t b = node.offset / sphere_block::width; b * sphere_block::width < node.offset + node.count; b++) {
+                    for (int mask = intersect_block(b, sr, float(ray_t.min), float(ray_t.max)); mask != 0; mask &= mask - 1) {
+                        double t;
+                        if (intersect(sphere_ids[b * sphere_block::width + __builtin_ctz(mask)], r, ray_t, t)) return true;
+                    }
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the number of spheres in this set
+         * @return sphere count
+         */
+        size_t get_sphere_count() const { return centers.size(); }
+
+        /**
+         * Returns if any sphere in this set moves
+         * @return true if the set stores a second center for each sphere
+         */
+        bool is_moving() const { return !end_centers.empty(); }
+
+        /**
+         * Returns statistics describing the shape and quality of the hierarchy, with memory including the sphere arrays
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(linear_bvh_node) +
+                blocks.capacity() * sizeof(sphere_block) +
+                motion.capacity() * sizeof(sphere_motion_block) +
+                sphere_ids.capacity() * sizeof(uint32_t) +
+                (centers.capacity() + end_centers.capacity()) * sizeof(vec3) +
+                radii.capacity() * sizeof(double) +
+                material_ids.capacity() * sizeof(uint32_t) +
+                materials.capacity() * sizeof(material);
+
+            if (nodes.empty()) return stats;
+
+            std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+
+            while (!stack.empty()) {
+                auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                const linear_bvh_node& node = nodes[index];
+
+                if (node.is_leaf()) {
+                    stats.add_leaf(depth, node.bounding_box(), node.count);
+                    continue;
+                }
+
+                aabb children[2] = {nodes[node.offset].bounding_box(), nodes[node.offset + 1].bounding_box()};
+                stats.add_interior(depth, node.bounding_box(), children, 2);
+
+                stack.push_back({node.offset + 1, depth + 1});
+                stack.push_back({node.offset, depth + 1});
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the default settings used to build a sphere_set's hierarchy
+         *
+         * Leaves are tested a block of spheres at a time, so the surface area heuristic costs them by the block.
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            config.max_leaf_size = 2 * sphere_block::width;
+            config.leaf_batch_size = sphere_block::width;
+            return config;
+        }
+
+    private:
+        /**
+         * The center of each sphere, at time 0 for moving spheres
+         */
+        std::vector<vec3> centers;
+
+        /**
+         * The center of each sphere at time 1, empty if no sphere moves
+         */
+        std::vector<vec3> end_centers;
+
+        /**
+         * The radius of each sphere
+         */
+        std::vector<double> radii;
+
+        /**
+         * The index into materials of each sphere's material
+         */
+        std::vector<uint32_t> material_ids;
+
+        /**
+         * The table of materials the spheres index into
+         */
+        std::vector<material> materials;
+
+        /**
+         * The index of each sphere in the order the hierarchy's leaves reference them, each leaf starting at a
+         * multiple of the block width and padded with copies of its last sphere
+         */
+        std::vector<uint32_t> sphere_ids;
+
+        /**
+         * The spheres in the same order as sphere_ids, grouped into blocks for intersection
+         */
+        std::vector<sphere_block> blocks;
+
+        /**
+         * The motion of the spheres in each block, empty if no sphere moves
+         */
+        std::vector<sphere_motion_block> motion;
+
+        /**
+         * The flattened nodes of the hierarchy, whose leaves hold ranges of spheres
+         */
+        std::vector<linear_bvh_node> nodes;
+
+        /**
+         * The bounding box of the whole set
+         */
+        aabb bbox;
+
+        /**
+         * The settings the hierarchy was built with
+         */
+        bvh_config config;
+
+        /**
+         * A ray in single precision, as the sphere blocks test it
+         */
+        struct sphere_ray {
+            float origin[3];
+            float origin_error[3];  // what rounding took off the origin, taken back off once it is relative to a center
+            float dir[3];
+            float inv_sqmag;
+            float time;
+            float t_slack;          // how far rounding can move a root near the start of the ray, in t
+            float approach_slack;   // how far rounding can move the closest approach to a center, per unit of s
+
+            sphere_ray(const ray& r) : inv_sqmag(float(1.0 / r.direction().sqmag())), time(float(r.time())) {
+                double extent = 0;
+                for (int axis = 0; axis < 3; axis++) {
+                    origin[axis] = float(r.origin()[axis]);
+                    origin_error[axis] = float(r.origin()[axis] - origin[axis]);
+                    dir[axis] = float(r.direction()[axis]);
+                    extent = std::fmax(extent, std::fabs(r.origin()[axis]));
+                }
+                t_slack = float(t_tolerance * extent / r.direction().mag());
+                approach_slack = float(approach_tolerance * r.direction().mag());
+            }
+        };
+
+        /**
+         * Returns the bounding box of a sphere over the whole shutter interval
+         * @param index index of the sphere
+         * @return bounding box of the sphere
+         */
+        aabb sphere_box(size_t index) const {
+            vec3 rad = vec3(radii[index], radii[index], radii[index]);
+            aabb box = aabb(centers[index] - rad, centers[index] + rad);
+            if (is_moving()) box = aabb(box, aabb(end_centers[index] - rad, end_centers[index] + rad));
+            return box;
+        }
+
+        /**
+         * Returns the center of a sphere at a given time
+         * @param index index of the sphere
+         * @param time time to get the center at
+         * @return center of the sphere
+         */
+        vec3 center_at(size_t index, double time) const {
+            if (!is_moving()) return centers[index];
+            return centers[index] + time * (end_centers[index] - centers[index]);
+        }
+
+        /**
+         * Builds the hierarchy and stores the spheres in the order its leaves reference them
+         */
+        void build() {
+            size_t sphere_count = centers.size();
+
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(sphere_count);
+
+            for (size_t i = 0; i < sphere_count; i++) {
+                radii[i] = std::fmax(0, radii[i]);
+                build_primitives.emplace_back(sphere_box(i), i);
+            }
+
+            bvh_builder builder(config, [&](size_t index, const aabb& clip) {
+                return sphere_box(index).intersection(clip);
+            });
+
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            if (!root) {
+                bbox = aabb::empty;
+                return;
+            }
+
+            bbox = root->bbox;
+            builder.flatten(*root, nodes);
+
+            // Start every leaf on a new block so a leaf's blocks hold only its own spheres
+            const uint32_t width = sphere_block::width;
+
+            size_t block_count = 0;
+            for (const auto& node : nodes) {
+                if (node.is_leaf()) block_count += (node.count + width - 1) / width;
+            }
+
+            blocks.reserve(block_count);
+            sphere_ids.reserve(width * block_count);
+            if (is_moving()) motion.reserve(block_count);
+
+            for (auto& node : nodes) {
+                if (!node.is_leaf()) continue;
+
+                uint32_t first = node.offset;
+                node.offset = uint32_t(blocks.size() * width);
+
+                for (uint32_t i = 0; i < (node.count + width - 1) / width * width; i++) {
+                    if (i % width == 0) {
+                        blocks.emplace_back();
+                        if (is_moving()) motion.emplace_back();
+                    }
+
+                    // Padding repeats the leaf's last sphere but with a NaN radius, so it is never hit
+                    size_t index = ordered[first + std::min(i, node.count - 1u)];
+                    sphere_ids.push_back(uint32_t(index));
+
+                    // Rounding the center, and the motion of moving spheres, moves the sphere by up to center_error
+                    double center_error = 0;
+
+                    for (int axis = 0; axis < 3; axis++) {
+                        float center = float(centers[index][axis]);
+                        double error = std::fabs(centers[index][axis] - center);
+                        blocks.back().center[axis][i % width] = center;
+
+                        if (is_moving()) {
+                            double offset = end_centers[index][axis] - centers[index][axis];
+                            float rounded_offset = float(offset);
+                            motion.back().offset[axis][i % width] = rounded_offset;
+
+                            // Interpolating in single precision rounds relative to the offset and the center it reaches
+                            double extent = std::fmax(std::fabs(centers[index][axis]), std::fabs(end_centers[index][axis]));
+                            error += std::fabs(offset - rounded_offset);
+                            error += std::numeric_limits<float>::epsilon() * (std::fabs(offset) + extent);
+                        }
+
+                        center_error += error * error;
+                    }
+
+                    // Pad the radius so the rounded sphere still encloses the exact one
+                    double radius = radii[index] + std::sqrt(center_error);
+                    float rounded_radius = float(radius);
+                    if (rounded_radius < radius) rounded_radius = std::nextafter(rounded_radius, std::numeric_limits<float>::infinity());
+
+                    blocks.back().radius[i % width] = i < node.count ? rounded_radius : std::numeric_limits<float>::quiet_NaN();
+                }
+            }
+        }
+
+        /**
+         * How far inside a sphere's radius squared, relative to it, a single precision miss still counts as a candidate
+         *
+         * Rounding can otherwise miss rays that graze a sphere. Candidates are confirmed in double precision, so the
+         * tolerance only decides which spheres are tested again.
+         */
+        static constexpr float graze_tolerance = 1e-4f;
+
+        /**
+         * How far rounding can move the closest approach of a ray to a center, relative to the distance to it
+         *
+         * The closest approach oc - s d cancels most of oc when the ray starts far from a sphere, which loses far more
+         * than graze_tolerance for small spheres. A few float epsilons cover the subtraction, the products and s.
+         */
+        static constexpr float approach_tolerance = 16 * std::numeric_limits<float>::epsilon();
+
+        /**
+         * How far outside the interval, relative to the size of the ray's coords, a single precision root still
+         * counts as a candidate
+         *
+         * Rounding can otherwise drop hits right at the start of the interval, such as secondary rays hitting near
+         * the surface they leave. Candidates are confirmed in double precision against the exact interval.
+         */
+        static constexpr float t_tolerance = 1e-5f;
+
+        /**
+         * Finds which of the four spheres of a block a ray may hit in an interval
+         *
+         * The roots are found from the distance between the center and the ray's closest approach to it rather than
+         * from the textbook discriminant, which loses most of its precision in single precision far from the origin.
+         * @param b index of the block to test
+         * @param r ray to check, in single precision
+         * @param t_min start of the interval of the ray to check
+         * @param t_max end of the interval of the ray to check
+         * @return mask with a bit set for each slot whose sphere may be hit
+         */
+        int intersect_block(size_t b, const sphere_ray& r, float t_min, float t_max) const {
+            const sphere_block& block = blocks[b];
+
+#if defined(SPHERE_SET_SSE)
+            __m128 cx = _mm_load_ps(block.center[0]), cy = _mm_load_ps(block.center[1]), cz = _mm_load_ps(block.center[2]);
+
+            if (!motion.empty()) {
+                __m128 time = _mm_set1_ps(r.time);
+                cx = _mm_add_ps(cx, _mm_mul_ps(time, _mm_load_ps(motion[b].offset[0])));
+                cy = _mm_add_ps(cy, _mm_mul_ps(time, _mm_load_ps(motion[b].offset[1])));
+                cz = _mm_add_ps(cz, _mm_mul_ps(time, _mm_load_ps(motion[b].offset[2])));
+            }
+
+            __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+
+            // oc = c - o, taking off what rounding took off the origin so the error in oc scales with oc rather than o
+            __m128 ocx = _mm_sub_ps(_mm_sub_ps(cx, _mm_set1_ps(r.origin[0])), _mm_set1_ps(r.origin_error[0]));
+            __m128 ocy = _mm_sub_ps(_mm_sub_ps(cy, _mm_set1_ps(r.origin[1])), _mm_set1_ps(r.origin_error[1]));
+            __m128 ocz = _mm_sub_ps(_mm_sub_ps(cz, _mm_set1_ps(r.origin[2])), _mm_set1_ps(r.origin_error[2]));
+
+            // s = (d . oc) / (d . d) is where the ray passes closest to the center
+            __m128 s = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_add_ps(_mm_mul_ps(dy, ocy), _mm_mul_ps(dz, ocz))), _mm_set1_ps(r.inv_sqmag));
+
+            // l = oc - s d, the roots are s -+ sqrt((r^2 - l . l) / (d . d))
+            __m128 lx = _mm_sub_ps(ocx, _mm_mul_ps(s, dx));
+            __m128 ly = _mm_sub_ps(ocy, _mm_mul_ps(s, dy));
+            __m128 lz = _mm_sub_ps(ocz, _mm_mul_ps(s, dz));
+            __m128 rad = _mm_load_ps(block.radius);
+            __m128 rad2 = _mm_mul_ps(rad, rad);
+            __m128 q = _mm_sub_ps(rad2, _mm_add_ps(_mm_mul_ps(lx, lx), _mm_add_ps(_mm_mul_ps(ly, ly), _mm_mul_ps(lz, lz))));
+
+            // Moving the closest approach by e moves l . l by about 2 e r near the rim
+            __m128 abs_s = _mm_andnot_ps(_mm_set1_ps(-0.0f), s);
+            __m128 approach = _mm_mul_ps(abs_s, _mm_set1_ps(2 * r.approach_slack));
+            __m128 graze = _mm_mul_ps(rad, _mm_add_ps(_mm_mul_ps(rad, _mm_set1_ps(graze_tolerance)), approach));
+
+            // Comparisons with NaN are false, so misses and padding never pass
+            __m128 valid = _mm_cmpge_ps(_mm_add_ps(q, graze), _mm_setzero_ps());
+            __m128 half = _mm_sqrt_ps(_mm_max_ps(_mm_mul_ps(q, _mm_set1_ps(r.inv_sqmag)), _mm_setzero_ps()));
+
+            // The sphere may be hit if either root is in the interval, widened by how far rounding can move the roots
+            __m128 near_t = _mm_sub_ps(s, half);
+            __m128 far_t = _mm_add_ps(s, half);
+            __m128 slack = _mm_add_ps(_mm_set1_ps(r.t_slack), _mm_mul_ps(_mm_set1_ps(t_tolerance), _mm_add_ps(abs_s, half)));
+            valid = _mm_and_ps(valid, _mm_cmpge_ps(_mm_add_ps(far_t, slack), _mm_set1_ps(t_min)));
+            valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_sub_ps(near_t, slack), _mm_set1_ps(t_max)));
+
+            return _mm_movemask_ps(valid);
+#else
+            int mask = 0;
+
+            for (int lane = 0; lane < sphere_block::width; lane++) {
+                float oc[3], l[3];
+
+                for (int axis = 0; axis < 3; axis++) {
+                    float c = block.center[axis][lane];
+                    if (!motion.empty()) c += r.time * motion[b].offset[axis][lane];
+                    oc[axis] = (c - r.origin[axis]) - r.origin_error[axis];
+                }
+
+                float s = (r.dir[0]*oc[0] + r.dir[1]*oc[1] + r.dir[2]*oc[2]) * r.inv_sqmag;
+                for (int axis = 0; axis < 3; axis++) l[axis] = oc[axis] - s*r.dir[axis];
+
+                float rad = block.radius[lane];
+                float q = rad*rad - (l[0]*l[0] + l[1]*l[1] + l[2]*l[2]);
+                float graze = rad * (graze_tolerance * rad + 2 * r.approach_slack * std::fabs(s));
+                if (!(q + graze >= 0)) continue;
+
+                float half = std::sqrt(std::fmax(q * r.inv_sqmag, 0.0f));
+                float slack = r.t_slack + t_tolerance * (std::fabs(s) + half);
+                if (s + half + slack >= t_min && s - half - slack <= t_max) mask |= 1 << lane;
+            }
+
+            return mask;
+#endif
+        }
+
+        /**
+         * Returns if a ray collides with a sphere and the t value of the collision, as in sphere::intersect
+         * @param index index of the sphere
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param t place to store the t value of the nearest collision in the interval
+         * @return true if ray collides, false if ray doesn't collide
+         */
+        bool intersect(size_t index, const ray& r, const interval& ray_t, double& t) const {
+            vec3 oc = center_at(index, r.time()) - r.origin();
+            double a = r.direction().sqmag();
+            double h = vec3::dot(r.direction(), oc);
+            double c = oc.sqmag() - radii[index]*radii[index];
+            double discriminant = h*h - a*c;
+
+            if (discriminant < 0) return false;
+            double sqrtd = std::sqrt(discriminant);
+
+            t = (h - sqrtd) / a;
+
+            if (!ray_t.surrounds(t)) {
+                t = (h + sqrtd) / a;
+
+                if (!ray_t.surrounds(t)) return false;
+            }
+
+            return true;
+        }
+};
+
+#endif
\ No newline at end of file
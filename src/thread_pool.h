@@ -45,7 +45,11 @@ class thread_pool {
 
                         // Perform task
                         task();
-                        completed_tasks++;
+                        {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            completed_tasks++;
+                        }
+                        done_condition.notify_all();
                     }
                 });
             }
@@ -83,6 +87,14 @@ class thread_pool {
             condition_variable.notify_one();
         }
 
+        /**
+         * Blocks until every task added to this thread pool has been completed
+         */
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_condition.wait(lock, [this]{ return completed_tasks == total_tasks; });
+        }
+
         /**
          * Returns the percentage of tasks completed
          * @return percentage of tasks completed
@@ -94,6 +106,7 @@ class thread_pool {
     private:
         mutable std::mutex mutex;
         std::condition_variable condition_variable;
+        std::condition_variable done_condition;
         std::vector<std::thread> threads;
         std::queue<std::function<void()>> tasks;
         bool stop;
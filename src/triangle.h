@@ -99,7 +99,52 @@ class triangle : public collidable {
             area = vec3::cross(b - a, c - a).mag()/2.0;
         }
 
-        bool hit(const ray& r, interval ray_t, collision_hit& rec) const {
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            double t, alpha, beta;
+
+            if (!intersect(r, ray_t, t, alpha, beta)) {
+                return false;
+            }
+
+            hit.record(t, this, 0, alpha, beta);
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            double alpha = hit.alpha, beta = hit.beta;
+
+            // Updating collision info
+            rec.mat = mat.get();
+            rec.t = hit.t;
+
+            vec3 tex_coords = (1-alpha-beta)*ta + alpha*tb + beta*tc;
+
+            rec.u = tex_coords[0];
+            rec.v = tex_coords[1];
+
+            rec.point = r.at(hit.t);
+            if (!interpolated) {
+                rec.set_face_normal(r, normal);
+            } else {
+                rec.set_face_normal(r, ((1-alpha-beta)*na + alpha*nb + beta*nc).normalize());
+            }
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            double t, alpha, beta;
+            return intersect(r, ray_t, t, alpha, beta);
+        }
+
+        /**
+         * Returns if a ray collides with this triangle and the barycentric coords of the collision
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param t place to store the t value of the collision
+         * @param alpha place to store the barycentric coord of the collision for vertex b
+         * @param beta place to store the barycentric coord of the collision for vertex c
+         * @return true if ray collides, false if ray doesn't collide
+         */
+        bool intersect(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const {
             // Fast, Minimum Storage Ray/Triangle Intersection implementation
 
             // Get edges
@@ -118,54 +163,39 @@ class triangle : public collidable {
             
             // Check barycentric coords (alpha, beta) for collision
             vec3 T = r.origin() - a;
-            double alpha = vec3::dot(T, P) / det;
+            alpha = vec3::dot(T, P) / det;
             if (alpha < 0 || alpha > 1) {
                 return false;
             }
 
             const vec3 Q = vec3::cross(T, e1);
-            double beta = vec3::dot(r.direction(), Q) / det;
+            beta = vec3::dot(r.direction(), Q) / det;
             if (beta < 0 || alpha + beta > 1) {
                 return false;
             }
 
-            // Ray hit, so calculate true t, u, and v values
-            double t = vec3::dot(e2, Q) / det;
+            // Ray hit, so calculate true t value
+            t = vec3::dot(e2, Q) / det;
 
             // t value out of ray range, no hit
-            if (!ray_t.contains(t)) { 
-                return false;
-            }
-
-            // Updating collision info
-            rec.mat = mat;
-            rec.t = t;
-
-            vec3 tex_coords = (1-alpha-beta)*ta + alpha*tb + beta*tc;
-
-            rec.u = tex_coords[0];
-            rec.v = tex_coords[1];
-
-            rec.point = r.at(t);
-            if (!interpolated) {
-                rec.set_face_normal(r, normal);
-            } else {
-                rec.set_face_normal(r, ((1-alpha-beta)*na + alpha*nb + beta*nc).normalize());
-            }
-            
-            return true;            
+            return ray_t.contains(t);
         }
         
         aabb bounding_box () const override { return bbox; }
 
+        aabb clipped_bounding_box(const aabb& clip) const override {
+            vec3 vertices[3] = {a, b, c};
+            return clip.clip_polygon(vertices, 3);
+        }
+
         double pdf_value(const vec3& origin, const vec3& direction) const override {
             // Ensure that incoming ray is sampling this quad
-            collision_hit rec;
-            if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            double t, alpha, beta;
+            if (!intersect(ray(origin, direction), interval(0.001, infinity), t, alpha, beta))
                 return 0;
 
             // Get pdf of the given direction 
-            auto distance_squared = rec.t * rec.t * direction.sqmag();
+            auto distance_squared = t * t * direction.sqmag();
 
             auto cosine = std::fabs(vec3::dot(direction, normal) / direction.mag());
 
@@ -0,0 +1,533 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "collidable.h"
+#include "material.h"
+#include "bvh_builder.h"
+#include "bvh_traversal.h"
+#include "bvh_stats.h"
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define TRIANGLE_MESH_SSE
+#endif
+
+/**
+ * A 3 component vector stored in single precision to keep vertex buffers small
+ */
+struct packed_vec3 {
+    float x, y, z;
+
+    packed_vec3() {}
+    packed_vec3(const vec3& v) : x(float(v[0])), y(float(v[1])), z(float(v[2])) {}
+
+    /**
+     * Returns this vector in double precision
+     * @return unpacked vector
+     */
+    vec3 unpack() const { return vec3(x, y, z); }
+};
+
+/**
+ * A struct holding the per-vertex data of a triangle mesh, which any number of triangle_meshes can share
+ *
+ * Vertex data is stored in single precision. Every triangle sharing a vertex reads the same rounded position, so
+ * the mesh stays watertight.
+ */
+struct mesh_buffers {
+    std::vector<packed_vec3> positions; // position of each vertex
+    std::vector<packed_vec3> normals;   // unit normal of each vertex, empty if the mesh has no vertex normals
+    std::vector<packed_vec3> uvs;       // texture coordinates of each vertex, empty if the mesh has none
+
+    /**
+     * Returns the memory used by the buffers
+     * @return size of the buffers in bytes
+     */
+    size_t memory_bytes() const {
+        return (positions.capacity() + normals.capacity() + uvs.capacity()) * sizeof(packed_vec3);
+    }
+};
+
+/**
+ * Four triangles of a mesh with their first vertex and edges stored component by component
+ *
+ * Storing the edges instead of the other two vertices saves recomputing them on every test, and the
+ * structure-of-arrays layout lets all four triangles be intersected with a single set of SIMD instructions.
+ * Unused slots have zero length edges so they never pass the determinant test.
+ */
+struct alignas(16) triangle_block {
+    static constexpr int width = 4;
+
+    float vertex[3][width]; // first vertex of each triangle
+    float edge1[3][width];  // second vertex minus the first
+    float edge2[3][width];  // third vertex minus the first
+};
+
+/**
+ * A collidable made of triangles that index into shared vertex buffers, traced with its own bounding volume hierarchy
+ *
+ * Each triangle is only three vertex indices plus its precomputed edges, so a mesh costs a small fraction of the memory of the same triangles
+ * made as separate triangle collidables, and the buffers can be shared by meshes with different materials.
+ */
+class triangle_mesh : public collidable {
+    public:
+        /**
+         * Creates a triangle_mesh and builds a hierarchy over its triangles
+         * @param buffers vertex data the triangles index into
+         * @param indices three vertex indices per triangle, counter-clockwise when seen from the front
+         * @param mat material of every triangle
+         * @param config settings used to choose how the hierarchy is split
+         */
+        triangle_mesh(shared_ptr<const mesh_buffers> buffers, const std::vector<uint32_t>& indices, shared_ptr<material> mat, bvh_config config = default_config())
+            : buffers(buffers), mat(mat), config(config) {
+            build(indices);
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            mesh_ray mr(r);
+
+            // Only the closest triangle is recorded, once traversal is done
+            size_t closest = 0;
+            double closest_t = 0;
+            double closest_alpha = 0, closest_beta = 0;
+
+            bool hit_anything = traverse_closest(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index, interval& leaf_t) {
+                const linear_bvh_node& node = nodes[index];
+                bool hit_leaf = false;
+
+                for (uint32_t b = node.offset / triangle_block::width; b * triangle_block::width < node.offset + node.count; b++) {
+                    // Confirm each candidate in double precision, which also narrows the interval for the rest
+                    for (int mask = intersect_block(blocks[b], mr, float(leaf_t.min), float(leaf_t.max)); mask != 0; mask &= mask - 1) {
+                        size_t slot = b * triangle_block::width + __builtin_ctz(mask);
+                        double t, alpha, beta;
+
+                        if (intersect(slot, r, leaf_t, t, alpha, beta)) {
+                            hit_leaf = true;
+                            leaf_t.max = t;
+                            closest = slot;
+                            closest_t = t;
+                            closest_alpha = alpha;
+                            closest_beta = beta;
+                        }
+                    }
+                }
+
+                return hit_leaf;
+            });
+
+            if (!hit_anything) return false;
+
+            hit.record(closest_t, this, uint32_t(closest), closest_alpha, closest_beta);
+            return true;
+        }
+
+        void compute_surface_interaction(const ray& r, const collision& hit, collision_hit& rec) const override {
+            const uint32_t* v = &indices[3 * hit.primitive];
+            double alpha = hit.alpha, beta = hit.beta;
+            double gamma = 1 - alpha - beta;
+
+            rec.mat = mat.get();
+            rec.t = hit.t;
+            rec.point = r.at(hit.t);
+
+            // Without texture coordinates the vertices default to (0, 0), (1, 0) and (0, 1)
+            if (buffers->uvs.empty()) {
+                rec.u = alpha;
+                rec.v = beta;
+            } else {
+                const std::vector<packed_vec3>& uv = buffers->uvs;
+                vec3 tex_coords = gamma*uv[v[0]].unpack() + alpha*uv[v[1]].unpack() + beta*uv[v[2]].unpack();
+                rec.u = tex_coords[0];
+                rec.v = tex_coords[1];
+            }
+
+            if (buffers->normals.empty()) {
+                vec3 a, b, c;
+                vertices(v, a, b, c);
+                rec.set_face_normal(r, vec3::cross(b - a, c - a).normalize());
+            } else {
+                const std::vector<packed_vec3>& n = buffers->normals;
+                rec.set_face_normal(r, (gamma*n[v[0]].unpack() + alpha*n[v[1]].unpack() + beta*n[v[2]].unpack()).normalize());
+            }
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            mesh_ray mr(r);
+
+            return traverse_any(linear_bvh_tree(nodes, r), ray_t, [&](uint32_t index) {
+                const linear_bvh_node& node = nodes[index];
+
+                for (uint32_t b = node.offset / triangle_block::width; b * triangle_block::width < node.offset + node.count; b++) {
+                    for (int mask = intersect_block(blocks[b], mr, float(ray_t.min), float(ray_t.max)); mask != 0; mask &= mask - 1) {
+                        double t, alpha, beta;
+                        if (intersect(b * triangle_block::width + __builtin_ctz(mask), r, ray_t, t, alpha, beta)) return true;
+                    }
+                }
+
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the number of triangle references held by the hierarchy's leaves
+         * @return triangle count, including any duplicated by spatial splits
+         */
+        size_t get_triangle_count() const { return triangle_count; }
+
+        /**
+         * Returns the vertex data the triangles index into
+         * @return shared vertex buffers
+         */
+        shared_ptr<const mesh_buffers> get_buffers() const { return buffers; }
+
+        /**
+         * Returns statistics describing the shape and quality of the hierarchy, with memory including the vertex buffers
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(linear_bvh_node) +
+                indices.capacity() * sizeof(uint32_t) +
+                blocks.capacity() * sizeof(triangle_block) +
+                buffers->memory_bytes();
+
+            if (nodes.empty()) return stats;
+
+            std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+
+            while (!stack.empty()) {
+                auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                const linear_bvh_node& node = nodes[index];
+
+                if (node.is_leaf()) {
+                    stats.add_leaf(depth, node.bounding_box(), node.count);
+                    continue;
+                }
+
+                aabb children[2] = {nodes[node.offset].bounding_box(), nodes[node.offset + 1].bounding_box()};
+                stats.add_interior(depth, node.bounding_box(), children, 2);
+
+                stack.push_back({node.offset + 1, depth + 1});
+                stack.push_back({node.offset, depth + 1});
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the default settings used to build a triangle_mesh's hierarchy
+         *
+         * Leaves are tested a block of triangles at a time, so the surface area heuristic costs them by the block
+         * and they may hold a couple of full blocks.
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            config.max_leaf_size = 2 * triangle_block::width;
+            config.leaf_batch_size = triangle_block::width;
+            return config;
+        }
+
+    private:
+        /**
+         * The vertex data the triangles index into
+         */
+        shared_ptr<const mesh_buffers> buffers;
+
+        /**
+         * A ray in single precision, as the triangle blocks test it
+         */
+        struct mesh_ray {
+            float origin[3];
+            float origin_error[3];  // what rounding took off the origin, added back once it is relative to a vertex
+            float dir[3];
+            float t_slack;          // how far rounding can move a collision near the start of the ray, in t
+
+            mesh_ray(const ray& r) {
+                double extent = 0;
+                for (int axis = 0; axis < 3; axis++) {
+                    origin[axis] = float(r.origin()[axis]);
+                    origin_error[axis] = float(r.origin()[axis] - origin[axis]);
+                    dir[axis] = float(r.direction()[axis]);
+                    extent = std::fmax(extent, std::fabs(r.origin()[axis]));
+                }
+                t_slack = float(t_tolerance * extent / r.direction().mag());
+            }
+        };
+
+        /**
+         * Three vertex indices per triangle in the order the hierarchy's leaves reference them, each leaf starting
+         * at a multiple of the block width and padded with copies of its last triangle
+         */
+        std::vector<uint32_t> indices;
+
+        /**
+         * The triangles in the same order as indices, grouped into blocks for intersection
+         */
+        std::vector<triangle_block> blocks;
+
+        /**
+         * The number of triangles referenced by the hierarchy's leaves, not counting padding
+         */
+        size_t triangle_count = 0;
+
+        /**
+         * The flattened nodes of the hierarchy, whose leaves hold ranges of triangles
+         */
+        std::vector<linear_bvh_node> nodes;
+
+        /**
+         * The bounding box of the whole mesh
+         */
+        aabb bbox;
+
+        /**
+         * The material of every triangle
+         */
+        shared_ptr<material> mat;
+
+        /**
+         * The settings the hierarchy was built with
+         */
+        bvh_config config;
+
+        /**
+         * Builds the hierarchy and stores the triangles in the order its leaves reference them
+         * @param triangle_indices three vertex indices per triangle, in their original order
+         */
+        void build(const std::vector<uint32_t>& triangle_indices) {
+            size_t triangle_count = triangle_indices.size() / 3;
+
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(triangle_count);
+
+            for (size_t i = 0; i < triangle_count; i++) {
+                vec3 a, b, c;
+                vertices(&triangle_indices[3 * i], a, b, c);
+                build_primitives.emplace_back(aabb(aabb(a, b), aabb(c, c)), i);
+            }
+
+            // Spatial splits clip triangles to the parts of space they are split into
+            bvh_builder builder(config, [&](size_t index, const aabb& clip) {
+                vec3 corners[3];
+                vertices(&triangle_indices[3 * index], corners[0], corners[1], corners[2]);
+                return clip.clip_polygon(corners, 3);
+            });
+
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            if (!root) {
+                bbox = aabb::empty;
+                return;
+            }
+
+            bbox = root->bbox;
+            builder.flatten(*root, nodes);
+            this->triangle_count = ordered.size();
+
+            // Start every leaf on a new block so a leaf's blocks hold only its own triangles
+            const uint32_t width = triangle_block::width;
+
+            size_t block_count = 0;
+            for (const auto& node : nodes) {
+                if (node.is_leaf()) block_count += (node.count + width - 1) / width;
+            }
+
+            blocks.reserve(block_count);
+            indices.reserve(3 * width * block_count);
+
+            for (auto& node : nodes) {
+                if (!node.is_leaf()) continue;
+
+                uint32_t first = node.offset;
+                node.offset = uint32_t(blocks.size() * width);
+
+                for (uint32_t i = 0; i < (node.count + width - 1) / width * width; i++) {
+                    if (i % width == 0) blocks.emplace_back();
+
+                    // Padding repeats the leaf's last triangle but with zero length edges, so it is never hit
+                    size_t index = ordered[first + std::min(i, node.count - 1u)];
+                    const uint32_t* v = &triangle_indices[3 * index];
+                    indices.insert(indices.end(), v, v + 3);
+
+                    vec3 a, b, c;
+                    vertices(v, a, b, c);
+                    vec3 e1 = i < node.count ? b - a : vec3(0, 0, 0);
+                    vec3 e2 = i < node.count ? c - a : vec3(0, 0, 0);
+
+                    for (int axis = 0; axis < 3; axis++) {
+                        blocks.back().vertex[axis][i % width] = float(a[axis]);
+                        blocks.back().edge1[axis][i % width] = float(e1[axis]);
+                        blocks.back().edge2[axis][i % width] = float(e2[axis]);
+                    }
+                }
+            }
+        }
+
+        /**
+         * How far outside a triangle, in barycentric coords, a single precision test still counts as a hit
+         *
+         * Rounding can otherwise let a ray slip between two triangles sharing an edge. Candidates are confirmed in
+         * double precision, so the tolerance only decides which triangles are tested again.
+         */
+        static constexpr float edge_tolerance = 1e-5f;
+
+        /**
+         * How far outside the interval, relative to the size of the ray's coords, a single precision collision still
+         * counts as a candidate
+         *
+         * Rounding can otherwise drop collisions right at the start of the interval, such as secondary rays hitting
+         * near the surface they leave. Candidates are confirmed in double precision against the exact interval.
+         */
+        static constexpr float t_tolerance = 1e-5f;
+
+        /**
+         * Finds which of the four triangles of a block a ray may hit in an interval using Moller-Trumbore
+         * @param block triangles to test
+         * @param r ray to check, in single precision
+         * @param t_min start of the interval of the ray to check
+         * @param t_max end of the interval of the ray to check
+         * @return mask with a bit set for each slot whose triangle may be hit
+         */
+        static int intersect_block(const triangle_block& block, const mesh_ray& r, float t_min, float t_max) {
+#if !defined(TRIANGLE_MESH_SSE)
+            const int width = triangle_block::width;
+            int mask = 0;
+#endif
+
+#if defined(TRIANGLE_MESH_SSE)
+            __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+            __m128 e1x = _mm_load_ps(block.edge1[0]), e1y = _mm_load_ps(block.edge1[1]), e1z = _mm_load_ps(block.edge1[2]);
+            __m128 e2x = _mm_load_ps(block.edge2[0]), e2y = _mm_load_ps(block.edge2[1]), e2z = _mm_load_ps(block.edge2[2]);
+
+            // P = d x e2, det = e1 . P
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 det = _mm_add_ps(_mm_mul_ps(e1x, px), _mm_add_ps(_mm_mul_ps(e1y, py), _mm_mul_ps(e1z, pz)));
+            __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+            // T = o - a, adding back what rounding took off the origin so the error in T scales with T rather than o
+            __m128 tx = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(r.origin[0]), _mm_load_ps(block.vertex[0])), _mm_set1_ps(r.origin_error[0]));
+            __m128 ty = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(r.origin[1]), _mm_load_ps(block.vertex[1])), _mm_set1_ps(r.origin_error[1]));
+            __m128 tz = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(r.origin[2]), _mm_load_ps(block.vertex[2])), _mm_set1_ps(r.origin_error[2]));
+
+            // u = (T . P) / det
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_add_ps(_mm_mul_ps(ty, py), _mm_mul_ps(tz, pz))), inv_det);
+
+            // Q = T x e1, v = (d . Q) / det, t = (e2 . Q) / det
+            __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+            __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+            __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_add_ps(_mm_mul_ps(dy, qy), _mm_mul_ps(dz, qz))), inv_det);
+            __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_add_ps(_mm_mul_ps(e2y, qy), _mm_mul_ps(e2z, qz))), inv_det);
+
+            // Comparisons with NaN are false, so degenerate triangles and padding never pass
+            __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+            __m128 valid = _mm_cmpge_ps(abs_det, _mm_set1_ps(1e-6f));
+            valid = _mm_and_ps(valid, _mm_cmpge_ps(u, _mm_set1_ps(-edge_tolerance)));
+            valid = _mm_and_ps(valid, _mm_cmpge_ps(v, _mm_set1_ps(-edge_tolerance)));
+            valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f + edge_tolerance)));
+
+            // Widen the interval by how far rounding can move the collision
+            __m128 slack = _mm_add_ps(_mm_set1_ps(r.t_slack), _mm_mul_ps(_mm_set1_ps(t_tolerance), _mm_andnot_ps(_mm_set1_ps(-0.0f), tt)));
+            valid = _mm_and_ps(valid, _mm_cmpge_ps(_mm_add_ps(tt, slack), _mm_set1_ps(t_min)));
+            valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_sub_ps(tt, slack), _mm_set1_ps(t_max)));
+
+            return _mm_movemask_ps(valid);
+#else
+            for (int lane = 0; lane < width; lane++) {
+                float e1[3] = {block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane]};
+                float e2[3] = {block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane]};
+                float T[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    T[axis] = (r.origin[axis] - block.vertex[axis][lane]) + r.origin_error[axis];
+                }
+
+                float P[3] = {r.dir[1]*e2[2] - r.dir[2]*e2[1], r.dir[2]*e2[0] - r.dir[0]*e2[2], r.dir[0]*e2[1] - r.dir[1]*e2[0]};
+                float Q[3] = {T[1]*e1[2] - T[2]*e1[1], T[2]*e1[0] - T[0]*e1[2], T[0]*e1[1] - T[1]*e1[0]};
+
+                float det = e1[0]*P[0] + e1[1]*P[1] + e1[2]*P[2];
+                float inv_det = 1.0f / det;
+
+                float u = (T[0]*P[0] + T[1]*P[1] + T[2]*P[2]) * inv_det;
+                float v = (r.dir[0]*Q[0] + r.dir[1]*Q[1] + r.dir[2]*Q[2]) * inv_det;
+                float t = (e2[0]*Q[0] + e2[1]*Q[1] + e2[2]*Q[2]) * inv_det;
+                float slack = r.t_slack + t_tolerance * std::fabs(t);
+
+                if (std::fabs(det) >= 1e-6f && u >= -edge_tolerance && v >= -edge_tolerance &&
+                    u + v <= 1 + edge_tolerance &&
+                    t + slack >= t_min && t - slack <= t_max) {
+                    mask |= 1 << lane;
+                }
+            }
+
+            return mask;
+#endif
+        }
+
+        /**
+         * Looks up the positions of a triangle's vertices
+         * @param v the triangle's three vertex indices
+         * @param a place to store the first vertex
+         * @param b place to store the second vertex
+         * @param c place to store the third vertex
+         */
+        void vertices(const uint32_t* v, vec3& a, vec3& b, vec3& c) const {
+            a = buffers->positions[v[0]].unpack();
+            b = buffers->positions[v[1]].unpack();
+            c = buffers->positions[v[2]].unpack();
+        }
+
+        /**
+         * Returns if a ray collides with a triangle and the barycentric coords of the collision
+         * @param tri index of the triangle in leaf order
+         * @param r ray to check
+         * @param ray_t interval of ray to check
+         * @param t place to store the t value of the collision
+         * @param alpha place to store the barycentric coord of the collision for the second vertex
+         * @param beta place to store the barycentric coord of the collision for the third vertex
+         * @return true if ray collides, false if ray doesn't collide
+         */
+        bool intersect(size_t tri, const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const {
+            vec3 a, b, c;
+            vertices(&indices[3 * tri], a, b, c);
+
+            // Fast, Minimum Storage Ray/Triangle Intersection, as in triangle::intersect
+            vec3 e1 = b - a;
+            vec3 e2 = c - a;
+
+            vec3 P = vec3::cross(r.direction(), e2);
+            double det = vec3::dot(e1, P);
+
+            if (det > -1e-6 && det < 1e-6) return false;
+
+            vec3 T = r.origin() - a;
+            alpha = vec3::dot(T, P) / det;
+            if (alpha < 0 || alpha > 1) return false;
+
+            vec3 Q = vec3::cross(T, e1);
+            beta = vec3::dot(r.direction(), Q) / det;
+            if (beta < 0 || alpha + beta > 1) return false;
+
+            t = vec3::dot(e2, Q) / det;
+            return ray_t.contains(t);
+        }
+};
+
+#endif
\ No newline at end of file
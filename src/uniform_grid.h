@@ -0,0 +1,433 @@
+#ifndef UNIFORM_GRID_H
+#define UNIFORM_GRID_H
+
+#include "aabb.h"
+#include "collidable_list.h"
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+/**
+ * A struct for configuring how uniform grids are built
+ */
+struct grid_config {
+    double density = 3.0;           // target number of cells per primitive
+    int max_resolution = 128;       // most cells along any axis
+    bool two_level = false;         // give crowded cells a nested grid of their own
+    int subgrid_threshold = 8;      // fewest primitives a cell needs to get a nested grid
+    double outlier_ratio = 16.0;    // primitives wider than this many times the median width are kept out of the cells
+};
+
+/**
+ * A regular grid of cells over the primitives of a scene, traversed cell by cell with a 3D-DDA
+ *
+ * Grids suit scenes made of many primitives of similar size spread evenly through space, where they find the cells
+ * a ray passes through without descending a hierarchy. Primitives far larger than the rest, like a ground plane,
+ * would cover most cells, so they are kept in a separate list and tested against every ray instead.
+ */
+class uniform_grid : public collidable {
+    public:
+        /**
+         * Creates a uniform_grid from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the grid over
+         * @param config settings used to size the grid
+         */
+        uniform_grid(const collidable_list& list, grid_config config = grid_config()) : uniform_grid(list.flatten(), config) {}
+
+        /**
+         * Creates a uniform_grid over the given collidables
+         * @param objects collidables to build the grid over
+         * @param config settings used to size the grid
+         */
+        uniform_grid(std::vector<shared_ptr<collidable>> objects, grid_config config) : objects(std::move(objects)) {
+            std::vector<const collidable*> regular;
+            split_outliers(config, regular);
+
+            bbox = aabb::empty;
+            for (const collidable* object : outliers) {
+                bbox = aabb(bbox, object->bounding_box());
+            }
+
+            if (regular.empty()) return;
+
+            grid_bounds = aabb::empty;
+            for (const collidable* object : regular) {
+                grid_bounds = aabb(grid_bounds, object->bounding_box());
+            }
+            bbox = aabb(bbox, grid_bounds);
+
+            choose_resolution(config, regular.size());
+            fill_cells(regular);
+
+            if (config.two_level) {
+                build_subgrids(config);
+            }
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            bool hit_anything = false;
+
+            for (const collidable* object : outliers) {
+                if (object->intersect(r, ray_t, hit)) {
+                    hit_anything = true;
+                    ray_t.max = hit.t;
+                }
+            }
+
+            traverse(r, ray_t, [&](const collidable* const* begin, const collidable* const* end) {
+                for (const collidable* const* object = begin; object != end; object++) {
+                    if ((*object)->intersect(r, ray_t, hit)) {
+                        hit_anything = true;
+                        ray_t.max = hit.t;
+                    }
+                }
+                return false;
+            });
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            for (const collidable* object : outliers) {
+                if (object->occluded(r, ray_t)) return true;
+            }
+
+            return traverse(r, ray_t, [&](const collidable* const* begin, const collidable* const* end) {
+                for (const collidable* const* object = begin; object != end; object++) {
+                    if ((*object)->occluded(r, ray_t)) return true;
+                }
+                return false;
+            });
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the number of cells along an axis
+         * @param axis axis to check
+         * @return cell count along the axis
+         */
+        int get_resolution(int axis) const { return resolution[axis]; }
+
+        /**
+         * Returns the number of primitives kept out of the cells and tested against every ray
+         * @return outlier count
+         */
+        size_t get_outlier_count() const { return outliers.size(); }
+
+        /**
+         * Returns the number of cells that were given a nested grid
+         * @return nested grid count
+         */
+        size_t get_subgrid_count() const { return subgrids.size(); }
+
+    private:
+        /**
+         * The collidables this grid was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The primitives tested against every ray instead of being placed in cells
+         */
+        std::vector<const collidable*> outliers;
+
+        /**
+         * The nested grids of crowded cells
+         */
+        std::vector<shared_ptr<uniform_grid>> subgrids;
+
+        /**
+         * The offset of each cell's first primitive in cell_objects, followed by the total count
+         */
+        std::vector<uint32_t> cell_offsets;
+
+        /**
+         * The primitives overlapping each cell, stored contiguously per cell
+         */
+        std::vector<const collidable*> cell_objects;
+
+        /**
+         * The number of cells along each axis
+         */
+        int resolution[3] = {0, 0, 0};
+
+        /**
+         * The size of a cell along each axis
+         */
+        vec3 cell_size;
+
+        /**
+         * The box covered by the cells
+         */
+        aabb grid_bounds;
+
+        /**
+         * The bounding box surrounding all collidables in this grid
+         */
+        aabb bbox;
+
+        /**
+         * Sets aside primitives too large or unbounded to place in cells
+         * @param config settings holding the outlier ratio
+         * @param regular filled with the primitives that go in cells
+         */
+        void split_outliers(const grid_config& config, std::vector<const collidable*>& regular) {
+            std::vector<double> widths(objects.size());
+            for (size_t i = 0; i < objects.size(); i++) {
+                widths[i] = diagonal(objects[i]->bounding_box());
+            }
+
+            double median = 0;
+            if (!widths.empty()) {
+                std::vector<double> sorted = widths;
+                std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+                median = sorted[sorted.size() / 2];
+            }
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                if (!std::isfinite(widths[i]) || widths[i] > config.outlier_ratio * median) {
+                    outliers.push_back(objects[i].get());
+                } else {
+                    regular.push_back(objects[i].get());
+                }
+            }
+        }
+
+        /**
+         * Picks the number of cells along each axis so cells are close to cubes and number about density per primitive
+         * @param config settings holding the density and resolution limit
+         * @param count number of primitives going in cells
+         */
+        void choose_resolution(const grid_config& config, size_t count) {
+            double volume = grid_bounds.x.size() * grid_bounds.y.size() * grid_bounds.z.size();
+            double cells_per_unit = std::cbrt(config.density * count / volume);
+
+            for (int axis = 0; axis < 3; axis++) {
+                double extent = grid_bounds.axis_interval(axis).size();
+                resolution[axis] = std::clamp(int(extent * cells_per_unit), 1, std::max(1, config.max_resolution));
+                cell_size[axis] = extent / resolution[axis];
+            }
+        }
+
+        /**
+         * Places each primitive in every cell its bounds overlap
+         * @param regular primitives to place
+         */
+        void fill_cells(const std::vector<const collidable*>& regular) {
+            size_t cell_count = size_t(resolution[0]) * resolution[1] * resolution[2];
+
+            // Collect every cell and primitive pair, then bucket them by cell
+            std::vector<std::pair<uint32_t, const collidable*>> entries;
+            entries.reserve(regular.size() * 2);
+
+            for (const collidable* object : regular) {
+                aabb box = object->bounding_box();
+                int lo[3], hi[3];
+
+                for (int axis = 0; axis < 3; axis++) {
+                    const interval& ax = box.axis_interval(axis);
+                    lo[axis] = cell_coordinate(axis, ax.min);
+                    hi[axis] = cell_coordinate(axis, ax.max);
+                }
+
+                bool spans_cells = lo[0] != hi[0] || lo[1] != hi[1] || lo[2] != hi[2];
+
+                for (int z = lo[2]; z <= hi[2]; z++) {
+                    for (int y = lo[1]; y <= hi[1]; y++) {
+                        for (int x = lo[0]; x <= hi[0]; x++) {
+                            // Skip cells the primitive's bounds overlap but the primitive itself misses
+                            if (spans_cells && object->clipped_bounding_box(cell_bounds(x, y, z)).x.size() < 0) continue;
+                            entries.emplace_back(cell_index(x, y, z), object);
+                        }
+                    }
+                }
+            }
+
+            cell_offsets.assign(cell_count + 1, 0);
+            for (const auto& entry : entries) {
+                cell_offsets[entry.first + 1]++;
+            }
+            for (size_t i = 0; i < cell_count; i++) {
+                cell_offsets[i + 1] += cell_offsets[i];
+            }
+
+            cell_objects.resize(entries.size());
+            std::vector<uint32_t> next(cell_offsets.begin(), cell_offsets.end() - 1);
+            for (const auto& entry : entries) {
+                cell_objects[next[entry.first]++] = entry.second;
+            }
+        }
+
+        /**
+         * Replaces the contents of each crowded cell with a nested grid built over them
+         * @param config settings holding the crowding threshold and used to size the nested grids
+         */
+        void build_subgrids(const grid_config& config) {
+            grid_config nested = config;
+            nested.two_level = false;
+            nested.outlier_ratio = infinity;
+
+            std::unordered_map<const collidable*, shared_ptr<collidable>> owners;
+            for (const auto& object : objects) {
+                owners[object.get()] = object;
+            }
+
+            size_t cell_count = cell_offsets.size() - 1;
+            std::vector<uint32_t> offsets(cell_count + 1, 0);
+            std::vector<const collidable*> contents;
+            contents.reserve(cell_objects.size());
+
+            for (size_t cell = 0; cell < cell_count; cell++) {
+                uint32_t begin = cell_offsets[cell];
+                uint32_t end = cell_offsets[cell + 1];
+
+                if (end - begin >= uint32_t(std::max(2, config.subgrid_threshold))) {
+                    std::vector<shared_ptr<collidable>> crowd;
+                    for (uint32_t i = begin; i < end; i++) {
+                        crowd.push_back(owners[cell_objects[i]]);
+                    }
+
+                    subgrids.push_back(make_shared<uniform_grid>(crowd, nested));
+                    contents.push_back(subgrids.back().get());
+                } else {
+                    contents.insert(contents.end(), cell_objects.begin() + begin, cell_objects.begin() + end);
+                }
+
+                offsets[cell + 1] = uint32_t(contents.size());
+            }
+
+            cell_offsets = std::move(offsets);
+            cell_objects = std::move(contents);
+        }
+
+        /**
+         * Walks the cells a ray passes through in order, handing each one's primitives to a visitor
+         *
+         * The walk stops once the ray's interval ends inside the current cell, so a visitor narrowing the interval
+         * to its closest hit ends the walk at the first cell that cannot hold anything closer.
+         * @param r ray to walk along
+         * @param ray_t interval of ray to walk, which the visitor may shrink
+         * @param visit function given the primitives of a cell, returning true to end the walk early
+         * @return true if the visitor ended the walk early, false otherwise
+         */
+        template <typename cell_fn>
+        bool traverse(const ray& r, interval& ray_t, cell_fn visit) const {
+            if (cell_offsets.empty()) return false;
+
+            const vec3& origin = r.origin();
+            const vec3& dir = r.direction();
+
+            // Clip the ray to the grid
+            double t_enter = ray_t.min;
+            double t_leave = ray_t.max;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval& ax = grid_bounds.axis_interval(axis);
+                double inv = 1.0 / dir[axis];
+                double t0 = (ax.min - origin[axis]) * inv;
+                double t1 = (ax.max - origin[axis]) * inv;
+
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > t_enter) t_enter = t0;
+                if (t1 < t_leave) t_leave = t1;
+
+                if (t_leave < t_enter) return false;
+            }
+
+            // Set up the distances to each axis' next cell boundary and between boundaries
+            int cell[3], step[3], stop[3];
+            double next_t[3], delta_t[3];
+
+            for (int axis = 0; axis < 3; axis++) {
+                double lo = grid_bounds.axis_interval(axis).min;
+                cell[axis] = cell_coordinate(axis, origin[axis] + t_enter * dir[axis]);
+
+                if (dir[axis] > 0) {
+                    step[axis] = 1;
+                    stop[axis] = resolution[axis];
+                    next_t[axis] = (lo + (cell[axis] + 1) * cell_size[axis] - origin[axis]) / dir[axis];
+                    delta_t[axis] = cell_size[axis] / dir[axis];
+                } else if (dir[axis] < 0) {
+                    step[axis] = -1;
+                    stop[axis] = -1;
+                    next_t[axis] = (lo + cell[axis] * cell_size[axis] - origin[axis]) / dir[axis];
+                    delta_t[axis] = -cell_size[axis] / dir[axis];
+                } else {
+                    step[axis] = 0;
+                    stop[axis] = -1;
+                    next_t[axis] = infinity;
+                    delta_t[axis] = infinity;
+                }
+            }
+
+            while (true) {
+                uint32_t index = cell_index(cell[0], cell[1], cell[2]);
+                const collidable* const* objects_begin = cell_objects.data() + cell_offsets[index];
+                const collidable* const* objects_end = cell_objects.data() + cell_offsets[index + 1];
+
+                if (objects_begin != objects_end && visit(objects_begin, objects_end)) return true;
+
+                // Step into the neighbouring cell across the nearest boundary
+                int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+                double t_exit = std::fmin(next_t[axis], t_leave);
+
+                if (ray_t.max <= t_exit) break;
+
+                cell[axis] += step[axis];
+                if (cell[axis] == stop[axis]) break;
+                next_t[axis] += delta_t[axis];
+            }
+
+            return false;
+        }
+
+        /**
+         * Returns the cell holding a coordinate along an axis, clamped to the grid
+         * @param axis axis of the coordinate
+         * @param value coordinate to find the cell of
+         * @return cell coordinate between 0 and the axis' resolution - 1
+         */
+        int cell_coordinate(int axis, double value) const {
+            int c = int((value - grid_bounds.axis_interval(axis).min) / cell_size[axis]);
+            return std::clamp(c, 0, resolution[axis] - 1);
+        }
+
+        /**
+         * Returns the index of a cell in cell_offsets
+         * @param x cell coordinate along the x axis
+         * @param y cell coordinate along the y axis
+         * @param z cell coordinate along the z axis
+         * @return cell index
+         */
+        uint32_t cell_index(int x, int y, int z) const {
+            return uint32_t((z * resolution[1] + y) * resolution[0] + x);
+        }
+
+        /**
+         * Returns the box covered by a cell
+         * @param x cell coordinate along the x axis
+         * @param y cell coordinate along the y axis
+         * @param z cell coordinate along the z axis
+         * @return bounding box of the cell
+         */
+        aabb cell_bounds(int x, int y, int z) const {
+            vec3 lo = vec3(grid_bounds.x.min, grid_bounds.y.min, grid_bounds.z.min);
+            vec3 a = lo + vec3(x * cell_size[0], y * cell_size[1], z * cell_size[2]);
+            vec3 b = a + cell_size;
+            return aabb(a, b);
+        }
+
+        /**
+         * Returns the length of a bounding box's diagonal
+         * @param box bounding box to measure
+         * @return diagonal length
+         */
+        static double diagonal(const aabb& box) {
+            return vec3(box.x.size(), box.y.size(), box.z.size()).mag();
+        }
+};
+
+#endif
\ No newline at end of file
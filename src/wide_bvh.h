@@ -0,0 +1,578 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "collidable_list.h"
+#include "bvh_builder.h"
+#include "bvh_stats.h"
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <immintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+/**
+ * A node of a wide_bvh holding the bounds of up to width children in structure-of-arrays form
+ *
+ * Unused child slots have empty bounds so they never pass the slab test.
+ */
+template <int width>
+struct alignas(32) wide_bvh_node {
+    float min_x[width], min_y[width], min_z[width];    // minimum corners of the children's bounding boxes
+    float max_x[width], max_y[width], max_z[width];    // maximum corners of the children's bounding boxes
+    uint32_t offset[width];                             // interior child: index of its node, leaf child: index of its first primitive
+    uint16_t count[width];                              // number of primitives for a leaf child, 0 for an interior or unused child
+
+    /**
+     * Creates a node with every child slot unused
+     */
+    wide_bvh_node() {
+        for (int i = 0; i < width; i++) {
+            min_x[i] = min_y[i] = min_z[i] = std::numeric_limits<float>::infinity();
+            max_x[i] = max_y[i] = max_z[i] = -std::numeric_limits<float>::infinity();
+            offset[i] = empty_slot;
+            count[i] = 0;
+        }
+    }
+
+    /**
+     * Sets the bounds of a child slot, rounding outwards to float precision
+     * @param i child slot
+     * @param box bounding box of the child
+     */
+    void set_bounds(int i, const aabb& box) {
+        min_x[i] = linear_bvh_node::round_down(box.x.min);
+        min_y[i] = linear_bvh_node::round_down(box.y.min);
+        min_z[i] = linear_bvh_node::round_down(box.z.min);
+        max_x[i] = linear_bvh_node::round_up(box.x.max);
+        max_y[i] = linear_bvh_node::round_up(box.y.max);
+        max_z[i] = linear_bvh_node::round_up(box.z.max);
+    }
+
+    /**
+     * Offset marking a child slot as unused
+     */
+    static const uint32_t empty_slot = 0xFFFFFFFF;
+};
+
+/**
+ * A struct holding a ray in the single precision form used by wide_bvh slab tests
+ *
+ * Rounding the origin to the nearest float would move every slab by up to half an ulp of the origin, which culls
+ * thin boxes far from the world's origin. Instead the origin is rounded once towards each side of every axis, so
+ * distances to near planes are never overestimated and distances to far planes are never underestimated.
+ */
+struct wide_ray {
+    float near_origin[3];   // origin rounded so distances to the near planes of boxes only come out smaller
+    float far_origin[3];    // origin rounded so distances to the far planes of boxes only come out larger
+    float inv_dir[3];       // component-wise inverse of the ray's direction
+    int dir_is_neg[3];      // 1 if the ray points in the negative direction along an axis, 0 otherwise
+
+    /**
+     * Relative error of a distance computed in single precision, from the subtraction, inverse and product
+     */
+    static constexpr float distance_error = 4 * std::numeric_limits<float>::epsilon();
+
+    /**
+     * Creates a wide_ray from a given ray
+     * @param r ray to convert
+     */
+    wide_ray(const ray& r) {
+        for (int axis = 0; axis < 3; axis++) {
+            double exact = r.origin()[axis];
+            float lower = float(exact), upper = lower;
+            if (lower > exact) lower = std::nextafter(lower, -std::numeric_limits<float>::infinity());
+            if (upper < exact) upper = std::nextafter(upper, std::numeric_limits<float>::infinity());
+
+            inv_dir[axis] = float(1.0 / r.direction()[axis]);
+            dir_is_neg[axis] = inv_dir[axis] < 0;
+
+            // A larger origin gives smaller distances along a positive direction and larger ones along a negative one
+            near_origin[axis] = dir_is_neg[axis] ? lower : upper;
+            far_origin[axis] = dir_is_neg[axis] ? upper : lower;
+        }
+    }
+};
+
+/**
+ * A bounding volume hierarchy with 4 or 8 children per node, made by collapsing a binary hierarchy
+ *
+ * A ray is tested against all of a node's children at once with SSE, or AVX for 8 wide nodes when available.
+ */
+template <int width>
+class wide_bvh : public collidable {
+    static_assert(width == 4 || width == 8, "wide_bvh supports widths of 4 and 8");
+
+    public:
+        /**
+         * Creates a wide_bvh from a given collidable_list, expanding any nested collidable_lists
+         * @param list collidable_list to build the hierarchy over
+         * @param config settings used to choose how the binary hierarchy is split before being collapsed
+         */
+        wide_bvh(const collidable_list& list, bvh_config config = default_config()) {
+            objects = list.flatten();
+
+            std::vector<bvh_primitive> build_primitives;
+            build_primitives.reserve(objects.size());
+
+            for (size_t i = 0; i < objects.size(); i++) {
+                build_primitives.emplace_back(objects[i]->bounding_box(), i);
+            }
+
+            // Spatial splits clip primitives to the parts of space they are split into
+            bvh_builder builder(config, [this](size_t index, const aabb& clip) {
+                return objects[index]->clipped_bounding_box(clip);
+            });
+            std::vector<size_t> ordered;
+            auto root = builder.build(build_primitives, ordered);
+
+            if (!root) return;
+
+            bbox = root->bbox;
+
+            primitives.reserve(ordered.size());
+            for (size_t index : ordered) {
+                primitives.push_back(objects[index].get());
+            }
+
+            // The root's single slot holds the whole tree so traversal can start from one stack entry
+            nodes.emplace_back();
+            if (root->is_leaf()) {
+                nodes[0].set_bounds(0, root->bbox);
+                nodes[0].offset[0] = uint32_t(root->first_primitive);
+                nodes[0].count[0] = uint16_t(root->primitive_count);
+            } else {
+                collapse(*root, 0);
+            }
+
+            if (config.cluster_layout) {
+                cluster_nodes(config);
+            }
+        }
+
+        bool intersect(const ray& r, interval ray_t, collision& hit) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+
+            // Children waiting to be visited along with where the ray enters them
+            struct stack_entry {
+                uint32_t offset;
+                uint16_t count;
+                float t_enter;
+            } stack[max_stack_size];
+
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, float(ray_t.min)};
+
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                stack_entry entry = stack[--stack_size];
+
+                // A closer hit was found after this child was queued
+                if (entry.t_enter > ray_t.max) continue;
+
+                if (entry.count > 0) {
+                    for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                        if (primitives[i]->intersect(r, ray_t, hit)) {
+                            hit_anything = true;
+                            ray_t.max = hit.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const wide_bvh_node<width>& node = nodes[entry.offset];
+
+                float t_enter[width];
+                int mask = intersect_children(node, wr, ray_t, t_enter);
+
+                // Sort the hit children by entry distance
+                stack_entry hits[width];
+                int hit_count = 0;
+
+                while (mask) {
+                    int i = __builtin_ctz(mask);
+                    mask &= mask - 1;
+
+                    stack_entry child = {node.offset[i], node.count[i], t_enter[i]};
+                    int j = hit_count++;
+                    while (j > 0 && hits[j-1].t_enter < child.t_enter) {
+                        hits[j] = hits[j-1];
+                        j--;
+                    }
+                    hits[j] = child;
+                }
+
+                // The farthest child is queued first so the nearest one is visited next
+                assert(stack_size + hit_count <= max_stack_size && "tree is deeper than bvh_builder::max_stack_depth");
+                for (int i = 0; i < hit_count; i++) {
+                    stack[stack_size++] = hits[i];
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            wide_ray wr(r);
+
+            // Any collision ends the search, so children are queued without sorting
+            struct stack_entry {
+                uint32_t offset;
+                uint16_t count;
+            } stack[max_stack_size];
+
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0};
+
+            while (stack_size > 0) {
+                stack_entry entry = stack[--stack_size];
+
+                if (entry.count > 0) {
+                    for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                        if (primitives[i]->occluded(r, ray_t)) return true;
+                    }
+                    continue;
+                }
+
+                const wide_bvh_node<width>& node = nodes[entry.offset];
+
+                float t_enter[width];
+                int mask = intersect_children(node, wr, ray_t, t_enter);
+
+                assert(stack_size + __builtin_popcount(mask) <= max_stack_size && "tree is deeper than bvh_builder::max_stack_depth");
+                while (mask) {
+                    int i = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    stack[stack_size++] = {node.offset[i], node.count[i]};
+                }
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        /**
+         * Returns the nodes of this hierarchy, the root is at index 0
+         * @return vector of nodes
+         */
+        const std::vector<wide_bvh_node<width>>& get_nodes() const { return nodes; }
+
+        /**
+         * Returns the primitives of this hierarchy in the order its leaves reference them
+         * @return vector of primitive pointers
+         */
+        const std::vector<const collidable*>& get_primitives() const { return primitives; }
+
+        /**
+         * Returns statistics describing the shape and quality of this hierarchy
+         * @return collected statistics
+         */
+        bvh_stats stats() const {
+            bvh_stats stats;
+            stats.memory_bytes =
+                nodes.capacity() * sizeof(wide_bvh_node<width>) +
+                primitives.capacity() * sizeof(const collidable*) +
+                objects.capacity() * sizeof(shared_ptr<collidable>);
+
+            if (nodes.empty()) return stats;
+
+            // The root holder's single slot is the root of the tree
+            if (nodes[0].count[0] > 0) {
+                stats.add_leaf(0, child_bounds(nodes[0], 0), nodes[0].count[0]);
+            } else {
+                collect_stats(stats, nodes[0].offset[0], 0, child_bounds(nodes[0], 0));
+            }
+
+            return stats;
+        }
+
+        /**
+         * Returns the default settings used to build the binary hierarchy that gets collapsed
+         * @return build config using the surface area heuristic
+         */
+        static bvh_config default_config() {
+            bvh_config config;
+            config.method = split_sah;
+            return config;
+        }
+
+    private:
+        /**
+         * Most children a ray can have queued, width - 1 more for each of the max_stack_depth levels
+         */
+        static constexpr int max_stack_size = bvh_builder::max_stack_depth * (width - 1) + 1;
+
+        /**
+         * Recursively adds a subtree to a set of statistics
+         * @param stats statistics to add to
+         * @param index index of the subtree's root node
+         * @param depth depth of the subtree's root
+         * @param box bounding box of the subtree's root
+         */
+        void collect_stats(bvh_stats& stats, uint32_t index, int depth, const aabb& box) const {
+            const wide_bvh_node<width>& node = nodes[index];
+
+            aabb children[width];
+            int child_count = 0;
+
+            for (int i = 0; i < width; i++) {
+                if (node.offset[i] != wide_bvh_node<width>::empty_slot) {
+                    children[child_count++] = child_bounds(node, i);
+                }
+            }
+
+            stats.add_interior(depth, box, children, child_count);
+
+            for (int i = 0; i < width; i++) {
+                if (node.offset[i] == wide_bvh_node<width>::empty_slot) continue;
+
+                if (node.count[i] > 0) {
+                    stats.add_leaf(depth + 1, child_bounds(node, i), node.count[i]);
+                } else {
+                    collect_stats(stats, node.offset[i], depth + 1, child_bounds(node, i));
+                }
+            }
+        }
+
+        /**
+         * Returns the bounding box of one of a node's children
+         * @param node node holding the child
+         * @param i child slot
+         * @return bounding box of the child
+         */
+        static aabb child_bounds(const wide_bvh_node<width>& node, int i) {
+            aabb box;
+            box.x = interval(node.min_x[i], node.max_x[i]);
+            box.y = interval(node.min_y[i], node.max_y[i]);
+            box.z = interval(node.min_z[i], node.max_z[i]);
+            return box;
+        }
+
+        /**
+         * The collidables this hierarchy was built over, kept to own the primitives
+         */
+        std::vector<shared_ptr<collidable>> objects;
+
+        /**
+         * The primitives of this hierarchy, stored contiguously per leaf
+         */
+        std::vector<const collidable*> primitives;
+
+        /**
+         * The nodes of this hierarchy
+         */
+        std::vector<wide_bvh_node<width>> nodes;
+
+        /**
+         * The bounding box surrounding all collidables in this hierarchy
+         */
+        aabb bbox;
+
+        /**
+         * Recursively collapses an interior build node and its descendants into wide nodes
+         * @param build_node interior node of the binary hierarchy
+         * @param index index of the wide node to fill, 0 for the root
+         * @return index of the filled wide node
+         */
+        uint32_t collapse(const bvh_build_node& build_node, uint32_t index) {
+            // Open up the largest interior children until the node is full
+            const bvh_build_node* children[width];
+            int child_count = 0;
+            children[child_count++] = build_node.children[0].get();
+            children[child_count++] = build_node.children[1].get();
+
+            while (child_count < width) {
+                int largest = -1;
+                double largest_area = -1;
+
+                for (int i = 0; i < child_count; i++) {
+                    if (children[i]->is_leaf()) continue;
+
+                    double area = children[i]->bbox.surface_area();
+                    if (area > largest_area) {
+                        largest_area = area;
+                        largest = i;
+                    }
+                }
+
+                if (largest == -1) break;
+
+                const bvh_build_node* opened = children[largest];
+                children[largest] = opened->children[0].get();
+                children[child_count++] = opened->children[1].get();
+            }
+
+            if (index == 0) {
+                // The root's single slot points at the first real node
+                nodes[0].set_bounds(0, build_node.bbox);
+                nodes[0].offset[0] = uint32_t(nodes.size());
+                nodes[0].count[0] = 0;
+                index = uint32_t(nodes.size());
+                nodes.emplace_back();
+            }
+
+            for (int i = 0; i < child_count; i++) {
+                const bvh_build_node* child = children[i];
+                nodes[index].set_bounds(i, child->bbox);
+
+                if (child->is_leaf()) {
+                    nodes[index].offset[i] = uint32_t(child->first_primitive);
+                    nodes[index].count[i] = uint16_t(child->primitive_count);
+                } else {
+                    uint32_t child_index = uint32_t(nodes.size());
+                    nodes.emplace_back();
+                    nodes[index].offset[i] = child_index;
+                    nodes[index].count[i] = 0;
+                    collapse(*child, child_index);
+                }
+            }
+
+            return index;
+        }
+
+        /**
+         * Reorders the nodes into clusters of config.cluster_bytes using bvh_builder::cluster_order
+         * @param config settings holding the cluster size
+         */
+        void cluster_nodes(const bvh_config& config) {
+            size_t nodes_per_cluster = size_t(std::max(1, config.cluster_bytes)) / sizeof(wide_bvh_node<width>);
+
+            auto children_of = [&](uint32_t index, auto visit) {
+                const wide_bvh_node<width>& node = nodes[index];
+                for (int i = 0; i < width; i++) {
+                    if (node.offset[i] != wide_bvh_node<width>::empty_slot && node.count[i] == 0) {
+                        visit(node.offset[i], child_bounds(node, i).surface_area());
+                    }
+                }
+            };
+
+            std::vector<uint32_t> order = bvh_builder::cluster_order(0, nodes.size(), children_of, nodes_per_cluster);
+
+            std::vector<uint32_t> new_index(nodes.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                new_index[order[i]] = uint32_t(i);
+            }
+
+            std::vector<wide_bvh_node<width>> clustered;
+            clustered.reserve(nodes.size());
+
+            for (uint32_t index : order) {
+                clustered.push_back(nodes[index]);
+                wide_bvh_node<width>& node = clustered.back();
+
+                for (int i = 0; i < width; i++) {
+                    if (node.offset[i] != wide_bvh_node<width>::empty_slot && node.count[i] == 0) {
+                        node.offset[i] = new_index[node.offset[i]];
+                    }
+                }
+            }
+
+            nodes = std::move(clustered);
+        }
+
+        /**
+         * Tests a ray against every child of a node
+         * @param node node whose children to test
+         * @param wr ray to test
+         * @param ray_t interval of ray to check
+         * @param t_enter filled with where the ray enters each child
+         * @return bitmask of the children the ray hits
+         */
+        static int intersect_children(const wide_bvh_node<width>& node, const wide_ray& wr, const interval& ray_t, float* t_enter) {
+            // Shrink near distances and stretch far ones by their rounding error, assuming they aren't negative
+            const float t_min = float(ray_t.min);
+            const float t_max = float(ray_t.max);
+            const float shrink = 1 - wide_ray::distance_error, stretch = 1 + wide_ray::distance_error;
+
+            const float* near_x = wr.dir_is_neg[0] ? node.max_x : node.min_x;
+            const float* near_y = wr.dir_is_neg[1] ? node.max_y : node.min_y;
+            const float* near_z = wr.dir_is_neg[2] ? node.max_z : node.min_z;
+            const float* far_x = wr.dir_is_neg[0] ? node.min_x : node.max_x;
+            const float* far_y = wr.dir_is_neg[1] ? node.min_y : node.max_y;
+            const float* far_z = wr.dir_is_neg[2] ? node.min_z : node.max_z;
+
+#if defined(__AVX__)
+            if constexpr (width == 8) {
+                __m256 nx = _mm256_set1_ps(wr.near_origin[0]), ny = _mm256_set1_ps(wr.near_origin[1]), nz = _mm256_set1_ps(wr.near_origin[2]);
+                __m256 fx = _mm256_set1_ps(wr.far_origin[0]), fy = _mm256_set1_ps(wr.far_origin[1]), fz = _mm256_set1_ps(wr.far_origin[2]);
+                __m256 ix = _mm256_set1_ps(wr.inv_dir[0]), iy = _mm256_set1_ps(wr.inv_dir[1]), iz = _mm256_set1_ps(wr.inv_dir[2]);
+
+                __m256 tnx = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_x), nx), ix);
+                __m256 tny = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_y), ny), iy);
+                __m256 tnz = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_z), nz), iz);
+                __m256 tfx = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_x), fx), ix);
+                __m256 tfy = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_y), fy), iy);
+                __m256 tfz = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_z), fz), iz);
+
+                // max/min return their second operand on NaN, so axes with undefined distances are ignored
+                __m256 tn = _mm256_max_ps(tnx, _mm256_max_ps(tny, _mm256_max_ps(tnz, _mm256_set1_ps(t_min))));
+                __m256 tf = _mm256_min_ps(tfx, _mm256_min_ps(tfy, _mm256_min_ps(tfz, _mm256_set1_ps(t_max))));
+                tn = _mm256_mul_ps(tn, _mm256_set1_ps(shrink));
+                tf = _mm256_mul_ps(tf, _mm256_set1_ps(stretch));
+
+                _mm256_storeu_ps(t_enter, tn);
+                return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+            }
+#endif
+
+#if defined(WIDE_BVH_SSE)
+            __m128 nx = _mm_set1_ps(wr.near_origin[0]), ny = _mm_set1_ps(wr.near_origin[1]), nz = _mm_set1_ps(wr.near_origin[2]);
+            __m128 fx = _mm_set1_ps(wr.far_origin[0]), fy = _mm_set1_ps(wr.far_origin[1]), fz = _mm_set1_ps(wr.far_origin[2]);
+            __m128 ix = _mm_set1_ps(wr.inv_dir[0]), iy = _mm_set1_ps(wr.inv_dir[1]), iz = _mm_set1_ps(wr.inv_dir[2]);
+            __m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max);
+            __m128 shrink_ps = _mm_set1_ps(shrink), stretch_ps = _mm_set1_ps(stretch);
+
+            int mask = 0;
+            for (int i = 0; i < width; i += 4) {
+                __m128 tnx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_x + i), nx), ix);
+                __m128 tny = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_y + i), ny), iy);
+                __m128 tnz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_z + i), nz), iz);
+                __m128 tfx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_x + i), fx), ix);
+                __m128 tfy = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_y + i), fy), iy);
+                __m128 tfz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_z + i), fz), iz);
+
+                // max/min return their second operand on NaN, so axes with undefined distances are ignored
+                __m128 tn = _mm_mul_ps(_mm_max_ps(tnx, _mm_max_ps(tny, _mm_max_ps(tnz, lo))), shrink_ps);
+                __m128 tf = _mm_mul_ps(_mm_min_ps(tfx, _mm_min_ps(tfy, _mm_min_ps(tfz, hi))), stretch_ps);
+
+                _mm_storeu_ps(t_enter + i, tn);
+                mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << i;
+            }
+            return mask;
+#else
+            int mask = 0;
+            for (int i = 0; i < width; i++) {
+                float tn = t_min, tf = t_max;
+                const float near[3] = {near_x[i], near_y[i], near_z[i]};
+                const float far[3] = {far_x[i], far_y[i], far_z[i]};
+
+                for (int axis = 0; axis < 3; axis++) {
+                    float t0 = (near[axis] - wr.near_origin[axis]) * wr.inv_dir[axis];
+                    float t1 = (far[axis] - wr.far_origin[axis]) * wr.inv_dir[axis];
+                    if (t0 > tn) tn = t0;
+                    if (t1 < tf) tf = t1;
+                }
+
+                tn *= shrink;
+                tf *= stretch;
+                t_enter[i] = tn;
+                if (tn <= tf) mask |= 1 << i;
+            }
+            return mask;
+#endif
+        }
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+#endif
\ No newline at end of file